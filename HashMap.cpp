@@ -1,8 +1,37 @@
 #include <iostream>
-#include <list>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <new>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <type_traits>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 using namespace std;
 
-#define HASH_BUCKETS 100
+#define HASH_MIN_SLOTS 16
+#define HASH_MAX_LOAD 0.875         /* grow once 7/8 of the slots are used */
+#define HASH_ARENA_SLACK 4096       /* removed key bytes tolerated in the arena */
+#define CHM_SHARDS 64               /* default shard count, a power of two */
+#define CHM_MIGRATE_STEP 64         /* old slots moved per write while resizing */
+#define CHM_KEY_BLOCK (64 * 1024)   /* key arena allocation unit */
+#define SNAP_MAGIC "HMSNAP1"
+#define SNAP_BYTE_ORDER 0x01020304
 
 typedef uint32_t (*hashFn) (const char *key, size_t len);
 
@@ -21,83 +50,1233 @@ uint32_t jenkins_one_at_a_time_hash(const char *key, size_t len)
     return hash;
 }
 
-template <typename T>
+/*
+ * jenkins_one_at_a_time_hash takes a byte and three dependent shifts per
+ * iteration, which for UUID sized keys costs more than the table probe.
+ * The two below take the key eight bytes at a time.
+ */
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_read8(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t wy_read4(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * wyhash style: 16 bytes per step folded by a 64x64->128 bit multiply,
+ * keys up to 16 bytes read as two overlapping words with no loop at all.
+ */
+uint32_t wy_hash(const char *key, size_t len)
+{
+    static const uint64_t s0 = 0xa0761d6478bd642fULL, s1 = 0xe7037ed1a0b428dbULL;
+    static const uint64_t s2 = 0x8ebc6af09c88c6e3ULL;
+    uint64_t seed = wy_mix(s0, s1), a, b;
+    const char *p = key;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = wy_read4(p) << 32 | wy_read4(p + mid);
+            b = wy_read4(p + len - 4) << 32 | wy_read4(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = (uint64_t)(unsigned char)p[0] << 16 |
+                (uint64_t)(unsigned char)p[len >> 1] << 8 |
+                (unsigned char)p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        for (; i > 16; i -= 16, p += 16) {
+            seed = wy_mix(wy_read8(p) ^ s1, wy_read8(p + 8) ^ seed);
+        }
+        a = wy_read8(p + i - 16);
+        b = wy_read8(p + i - 8);
+    }
+    uint64_t h = wy_mix(wy_mix(a ^ s1, b ^ seed) ^ s2, len ^ s1);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/* murmur3 finalizer */
+static inline uint32_t fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* the crc32 instruction on the low n bytes of v, a bit at a time */
+static inline uint64_t crc32c_soft_word(uint64_t crc, uint64_t v, int n)
+{
+    for (int i = 0; i < n * 8; i++) {
+        crc = (crc >> 1) ^ (0x82f63b78 & -((crc ^ (v >> i)) & 1));
+    }
+    return crc;
+}
+
+/* same words as crc32c_sse42, so the hash does not depend on the CPU */
+static uint32_t crc32c_soft(const char *key, size_t len)
+{
+    uint64_t crc = ~(uint32_t)len;
+    if (len >= 8) {
+        size_t i;
+        for (i = 0; i + 8 < len; i += 8) {
+            crc = crc32c_soft_word(crc, wy_read8(key + i), 8);
+        }
+        crc = crc32c_soft_word(crc, wy_read8(key + len - 8), 8);
+    } else if (len >= 4) {
+        crc = crc32c_soft_word(crc,
+            wy_read4(key) << 32 | wy_read4(key + len - 4), 8);
+    } else if (len > 0) {
+        crc = crc32c_soft_word(crc, (unsigned char)key[0] << 16 |
+            (unsigned char)key[len >> 1] << 8 | (unsigned char)key[len - 1], 4);
+    }
+    return ~(uint32_t)crc;
+}
+
+#if defined(__x86_64__)
+/* the tail is read as words overlapping what came before, seeded with len */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const char *key, size_t len)
+{
+    uint64_t crc = ~(uint32_t)len;
+    if (len >= 8) {
+        size_t i;
+        for (i = 0; i + 8 < len; i += 8) {
+            crc = _mm_crc32_u64(crc, wy_read8(key + i));
+        }
+        crc = _mm_crc32_u64(crc, wy_read8(key + len - 8));
+    } else if (len >= 4) {
+        crc = _mm_crc32_u64(crc, wy_read4(key) << 32 | wy_read4(key + len - 4));
+    } else if (len > 0) {
+        crc = _mm_crc32_u32(crc, (unsigned char)key[0] << 16 |
+            (unsigned char)key[len >> 1] << 8 | (unsigned char)key[len - 1]);
+    }
+    return ~(uint32_t)crc;
+}
+#endif
+
+/*
+ * CRC32C, with the SSE4.2 crc32 instruction when the CPU has it.  It is a
+ * table hash, not the standard checksum: short keys and the tail are read
+ * as overlapping words.  A CRC is linear in the key bits, so similar keys
+ * give related values; the finalizer spreads them before the table masks
+ * off the low bits.
+ */
+uint32_t crc32c_hash(const char *key, size_t len)
+{
+#if defined(__x86_64__)
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42) {
+        return fmix32(crc32c_sse42(key, len));
+    }
+#endif
+    return fmix32(crc32c_soft(key, len));
+}
+
+/*
+ * A hash function as a type: HashMap<T, StaticHash<wy_hash>> calls it
+ * directly, so it is inlined rather than reached through a pointer.
+ */
+template <hashFn F>
+struct StaticHash {
+    uint32_t operator()(const char *key, size_t len) const
+    {
+        return F(key, len);
+    }
+};
+
+/*
+ * Open addressing with Robin Hood probing.
+ *
+ * All entries live in one power of two array of slots, so finding a key is
+ * a masked hash and a short forward scan.  Each slot remembers how far it
+ * sits from its home slot; an insert that has come further than the entry
+ * it meets takes that slot and carries the entry on.  Probe lengths stay
+ * short and even, and a lookup stops at the first slot that is closer to
+ * home than the key would be.  remove() shifts the rest of the run back
+ * one slot, so there are no tombstones.  The full 32 bit hash is kept in
+ * the slot and compared first, so a mismatch rarely touches the key bytes.
+ *
+ * Keys are copied once into a byte arena and referred to by offset; space
+ * of removed keys is reclaimed when the table is rebuilt.  Keys are taken
+ * as string_view, so a literal or a piece of a larger buffer is looked up
+ * without building a std::string.  Adding a key that is present replaces
+ * its value.
+ *
+ * Hasher is either a hashFn, passed to the constructor, or a function
+ * object type such as StaticHash<wy_hash>.
+ */
+template <typename T, typename Hasher = hashFn>
 class HashMap {
-    class HashMapNode {
-		public:
-        	string key;
-        	T data;
-        	int hashValue;
-
-			HashMapNode(string _k, T d, int h) {
-				key = _k;
-				data = d;
-				hashValue = h;
-			}
-			
-			void print() {
-				cout<<"Key = "<<key<<" data = "<<data<<" hash = "<<hashValue<<endl;
-			}
+    struct Slot {
+        uint32_t hash;
+        uint32_t dist;          /* 1 + distance from the home slot, 0 if empty */
+        uint32_t key_len;
+        size_t key_off;         /* into arena */
+        alignas(T) unsigned char value[sizeof(T)];
+
+        T &data() { return *launder(reinterpret_cast<T *>(value)); }
+        const T &data() const
+        {
+            return *launder(reinterpret_cast<const T *>(value));
+        }
     };
+
     private:
-        list<HashMapNode *>buckets[HASH_BUCKETS];
-        hashFn _h;
-
-        void add_to_bucket(string key, T rhs, int hash_value)
-        {
-			HashMapNode *hmn = new HashMapNode(key, rhs, hash_value);
-            buckets[hash_value].push_back(hmn);
-        }
-
-        void remove_from_bucket(string key, int hash_value)
-		{
-			typename list<HashMapNode*>::iterator it = buckets[hash_value].begin();
-			HashMapNode *hmn;
-			for(; it != buckets[hash_value].end(); ++it) {
-				if ((*it)->hashValue == hash_value &&
-					((*it)->key.compare(key) == 0)) {
-					hmn = (*it);
-					break;	
-				}
-			}
-			if (hmn != NULL) {
-				buckets[hash_value].remove(hmn);
-			} else {
-				cout<<"error: The key is not found! "<<key<<endl;
-			}
-		}
+        vector<Slot> slots;
+        size_t mask;
+        size_t count;
+        string arena;
+        size_t dead_bytes;
+        Hasher _h;
+
+        string_view key_of(const Slot &s) const
+        {
+            return string_view(arena.data() + s.key_off, s.key_len);
+        }
+
+        const Slot *lookup(string_view key, uint32_t hash) const
+        {
+            size_t i = hash & mask;
+            for (uint32_t dist = 1; ; dist++, i = (i + 1) & mask) {
+                const Slot &s = slots[i];
+                if (s.dist < dist) {
+                    /* empty, or an entry a present key would have displaced */
+                    return nullptr;
+                }
+                if (s.hash == hash && key_of(s) == key) {
+                    return &s;
+                }
+            }
+        }
+
+        /* insert an entry whose key is known to be absent and already in arena */
+        void place(uint32_t hash, size_t key_off, uint32_t key_len, T &&value)
+        {
+            size_t i = hash & mask;
+            for (uint32_t dist = 1; ; dist++, i = (i + 1) & mask) {
+                Slot &s = slots[i];
+                if (s.dist == 0) {
+                    s.hash = hash;
+                    s.dist = dist;
+                    s.key_off = key_off;
+                    s.key_len = key_len;
+                    new (s.value) T(std::move(value));
+                    return;
+                }
+                if (s.dist < dist) {
+                    swap(s.hash, hash);
+                    swap(s.dist, dist);
+                    swap(s.key_off, key_off);
+                    swap(s.key_len, key_len);
+                    swap(s.data(), value);
+                }
+            }
+        }
+
+        /* move every entry to a table of n slots, compacting the arena */
+        void rehash(size_t n)
+        {
+            vector<Slot> old_slots(n);
+            string old_arena;
+            old_slots.swap(slots);
+            old_arena.swap(arena);
+            arena.reserve(old_arena.size() - dead_bytes);
+            mask = n - 1;
+            dead_bytes = 0;
+            for (Slot &s : old_slots) {
+                if (s.dist == 0) {
+                    continue;
+                }
+                size_t off = arena.size();
+                arena.append(old_arena.data() + s.key_off, s.key_len);
+                place(s.hash, off, s.key_len, std::move(s.data()));
+                s.data().~T();
+            }
+        }
 
     public:
-        HashMap(hashFn h) {
-            _h = h;
-        }
-        void add(string lhs, T rhs)
-        {
-            int hash_value = _h(lhs.c_str(), lhs.size()) % HASH_BUCKETS;
-            add_to_bucket(lhs, rhs, hash_value);
-        } 
-
-        void remove(string lhs)
-        {
-            int hash_value = _h(lhs.c_str(), lhs.size()) % HASH_BUCKETS;
-            remove_from_bucket(lhs, hash_value);
-        }
-		
-		void print()
-		{
-			for (int i = 0; i < HASH_BUCKETS; ++i) {
-				cout<<"Printing bucket "<<i<<endl;
-				typename list<HashMapNode*>::iterator it = buckets[i].begin();
-				for(; it != buckets[i].end(); ++it) {
-					(*it)->print();
-				}
-			}
-		}
+        HashMap(Hasher h) : slots(HASH_MIN_SLOTS), mask(HASH_MIN_SLOTS - 1),
+            count(0), dead_bytes(0), _h(h)
+        {
+        }
+
+        HashMap() : HashMap(Hasher())
+        {
+            static_assert(!is_pointer<Hasher>::value,
+                "a HashMap over a hashFn needs the function");
+        }
+
+        ~HashMap()
+        {
+            for (Slot &s : slots) {
+                if (s.dist != 0) {
+                    s.data().~T();
+                }
+            }
+        }
+
+        HashMap(const HashMap &) = delete;
+        HashMap &operator=(const HashMap &) = delete;
+
+        size_t size() const { return count; }
+
+        /* make room for n entries without growing on the way */
+        void reserve(size_t n)
+        {
+            size_t want = slots.size();
+            while (n > want * HASH_MAX_LOAD) {
+                want *= 2;
+            }
+            if (want != slots.size()) {
+                rehash(want);
+            }
+        }
+
+        void add(string_view lhs, T rhs)
+        {
+            uint32_t hash = _h(lhs.data(), lhs.size());
+            Slot *s = const_cast<Slot *>(lookup(lhs, hash));
+            if (s != NULL) {
+                s->data() = std::move(rhs);
+                return;
+            }
+            if (count + 1 > slots.size() * HASH_MAX_LOAD) {
+                rehash(slots.size() * 2);
+            }
+            size_t off = arena.size();
+            arena.append(lhs.data(), lhs.size());
+            place(hash, off, lhs.size(), std::move(rhs));
+            count++;
+        }
+
+        bool remove(string_view lhs)
+        {
+            uint32_t hash = _h(lhs.data(), lhs.size());
+            const Slot *found = lookup(lhs, hash);
+            if (found == NULL) {
+                cout<<"error: The key is not found! "<<lhs<<endl;
+                return false;
+            }
+            size_t i = found - slots.data();
+            dead_bytes += slots[i].key_len;
+            slots[i].data().~T();
+            /* backward shift: pull each displaced follower one slot closer */
+            for (;;) {
+                size_t j = (i + 1) & mask;
+                Slot &hole = slots[i], &next = slots[j];
+                if (next.dist <= 1) {
+                    break;
+                }
+                hole.hash = next.hash;
+                hole.dist = next.dist - 1;
+                hole.key_off = next.key_off;
+                hole.key_len = next.key_len;
+                new (hole.value) T(std::move(next.data()));
+                next.data().~T();
+                i = j;
+            }
+            slots[i].dist = 0;
+            count--;
+            if (dead_bytes > HASH_ARENA_SLACK && dead_bytes > arena.size() / 2) {
+                rehash(slots.size());
+            }
+            return true;
+        }
+
+        /* the value stored for key, or NULL; valid until the next add/remove */
+        T *find(string_view key)
+        {
+            return const_cast<T *>(as_const(*this).find(key));
+        }
+
+        const T *find(string_view key) const
+        {
+            const Slot *s = lookup(key, _h(key.data(), key.size()));
+            return s != NULL ? &s->data() : NULL;
+        }
+
+        /* copy the value for key into out; false if there is none */
+        bool get(string_view key, T &out) const
+        {
+            const T *v = find(key);
+            if (v == NULL) {
+                return false;
+            }
+            out = *v;
+            return true;
+        }
+
+        const Hasher &hasher() const { return _h; }
+
+        /* fn(key, value, hash) for every entry */
+        template <typename Fn>
+        void for_each(Fn fn) const
+        {
+            for (const Slot &s : slots) {
+                if (s.dist != 0) {
+                    fn(key_of(s), s.data(), s.hash);
+                }
+            }
+        }
+
+        void print()
+        {
+            for (size_t i = 0; i < slots.size(); ++i) {
+                const Slot &s = slots[i];
+                if (s.dist != 0) {
+                    cout<<"Key = "<<key_of(s)<<" data = "<<s.data()
+                        <<" hash = "<<s.hash<<" slot = "<<i
+                        <<" probe = "<<s.dist - 1<<endl;
+                }
+            }
+        }
 } ;
 
+/*
+ * A HashMap shared between threads.
+ *
+ * The table is split into shards by the top bits of the hash, each a
+ * Robin Hood table like HashMap's behind its own writer mutex and
+ * sequence counter.  Writers lock the shard and make the counter odd while
+ * they change it; readers take no lock at all: they note the counter,
+ * probe, copy the value out and retry if the counter moved meanwhile.
+ * Every slot field is an atomic accessed relaxed, so a reader racing a
+ * writer sees stale or mixed fields but never torn words, and the retry
+ * throws that attempt away.
+ *
+ * For that to be safe nothing a reader can reach is ever freed while the
+ * map is alive: keys sit length-prefixed in append-only blocks, and
+ * outgrown tables are kept until the map is destroyed (together less than
+ * the live table).  Growing is incremental: a shard gets a table twice the
+ * size and every later write to it moves CHM_MIGRATE_STEP slots of the old
+ * one over, so no write pays for a whole rehash.  Until that finishes,
+ * lookups try the new table and then the old one, where moved and removed
+ * entries are left flagged DEAD so probe runs stay intact.
+ *
+ * Values are copied word by word, so T has to be trivially copyable;
+ * store an index or pointer to share anything bigger.
+ */
+template <typename T, typename Hasher = hashFn>
+class ConcurrentHashMap {
+    static_assert(is_trivially_copyable<T>::value,
+        "values are read optimistically and must be trivially copyable");
+
+    static const size_t WORDS = (sizeof(T) + 7) / 8;
+    static const uint64_t DEAD = 0x80000000;    /* in the dist half of meta */
+
+    struct Slot {
+        atomic<uint64_t> meta;          /* hash << 32 | dist, 0 if empty */
+        atomic<const char *> key;       /* uint32_t length, then the bytes */
+        atomic<uint64_t> words[WORDS];
+    };
+
+    struct Table {
+        size_t mask;
+        unique_ptr<Slot[]> slots;
+
+        explicit Table(size_t n) : mask(n - 1), slots(new Slot[n]()) {}
+    };
+
+    struct alignas(64) Shard {
+        mutex lock;
+        atomic<uint32_t> seq{0};
+        atomic<Table *> cur{nullptr};
+        atomic<Table *> old{nullptr};   /* being moved into cur */
+        size_t migrated = 0;            /* old slots moved so far */
+        size_t cur_count = 0;           /* live entries in cur */
+        atomic<size_t> count{0};        /* live entries in cur and old */
+        vector<unique_ptr<Table>> tables;
+        vector<unique_ptr<char[]>> key_blocks;
+        size_t block_used = 0;
+        size_t block_size = 0;
+    };
+
+    private:
+        unique_ptr<Shard[]> shards;
+        unsigned shard_shift;
+        Hasher _h;
+
+        Shard &shard_of(uint32_t hash) const
+        {
+            return shards[shard_shift < 32 ? hash >> shard_shift : 0];
+        }
+
+        static uint32_t dist_of(uint64_t meta)
+        {
+            return (uint32_t)(meta & ~DEAD);
+        }
+
+        static string_view key_view(const char *k)
+        {
+            uint32_t len;
+            memcpy(&len, k, sizeof(len));
+            return string_view(k + sizeof(len), len);
+        }
+
+        /* safe against a concurrent writer: at worst a wrong answer to retry */
+        static const Slot *probe(const Table *t, string_view key, uint32_t hash)
+        {
+            size_t i = hash & t->mask;
+            for (uint32_t dist = 1; ; dist++, i = (i + 1) & t->mask) {
+                const Slot &s = t->slots[i];
+                uint64_t meta = s.meta.load(memory_order_relaxed);
+                if (dist_of(meta) < dist) {
+                    return nullptr;
+                }
+                if ((uint32_t)(meta >> 32) == hash && !(meta & DEAD)) {
+                    const char *k = s.key.load(memory_order_acquire);
+                    if (k != nullptr && key_view(k) == key) {
+                        return &s;
+                    }
+                }
+            }
+        }
+
+        static void store_value(Slot &s, const T &v)
+        {
+            uint64_t w[WORDS] = {};
+            memcpy(w, &v, sizeof(T));
+            for (size_t i = 0; i < WORDS; i++) {
+                s.words[i].store(w[i], memory_order_relaxed);
+            }
+        }
+
+        const char *copy_key(Shard &s, string_view key)
+        {
+            uint32_t len = key.size();
+            size_t need = sizeof(len) + len;
+            if (s.key_blocks.empty() || s.block_used + need > s.block_size) {
+                s.block_size = max((size_t)CHM_KEY_BLOCK, need);
+                s.key_blocks.emplace_back(new char[s.block_size]);
+                s.block_used = 0;
+            }
+            char *p = s.key_blocks.back().get() + s.block_used;
+            memcpy(p, &len, sizeof(len));
+            memcpy(p + sizeof(len), key.data(), len);
+            s.block_used += need;
+            return p;
+        }
+
+        /* Robin Hood insert of an absent key; the writer holds the shard */
+        static void place(Table *t, uint64_t meta, const char *key,
+            const uint64_t *words)
+        {
+            uint64_t w[WORDS];
+            memcpy(w, words, sizeof(w));
+            for (size_t i = (meta >> 32) & t->mask; ; i = (i + 1) & t->mask) {
+                Slot &s = t->slots[i];
+                uint64_t sm = s.meta.load(memory_order_relaxed);
+                if (sm == 0 || dist_of(sm) < dist_of(meta)) {
+                    const char *sk = s.key.load(memory_order_relaxed);
+                    s.meta.store(meta, memory_order_relaxed);
+                    s.key.store(key, memory_order_release);
+                    for (size_t j = 0; j < WORDS; j++) {
+                        uint64_t old = s.words[j].load(memory_order_relaxed);
+                        s.words[j].store(w[j], memory_order_relaxed);
+                        w[j] = old;
+                    }
+                    if (sm == 0) {
+                        return;
+                    }
+                    meta = sm;
+                    key = sk;
+                }
+                meta++;
+            }
+        }
 
-int main()
+        /* backward shift delete in cur */
+        static void erase(Table *t, size_t i)
+        {
+            for (;;) {
+                size_t j = (i + 1) & t->mask;
+                Slot &hole = t->slots[i], &next = t->slots[j];
+                uint64_t nm = next.meta.load(memory_order_relaxed);
+                if (dist_of(nm) <= 1) {
+                    break;
+                }
+                hole.meta.store(nm - 1, memory_order_relaxed);
+                hole.key.store(next.key.load(memory_order_relaxed),
+                    memory_order_relaxed);
+                for (size_t w = 0; w < WORDS; w++) {
+                    hole.words[w].store(
+                        next.words[w].load(memory_order_relaxed),
+                        memory_order_relaxed);
+                }
+                i = j;
+            }
+            t->slots[i].meta.store(0, memory_order_relaxed);
+        }
+
+        /* move up to n slots of old over, all of them if n is 0 */
+        void migrate(Shard &s, size_t n)
+        {
+            Table *old = s.old.load(memory_order_relaxed);
+            if (old == nullptr) {
+                return;
+            }
+            Table *cur = s.cur.load(memory_order_relaxed);
+            size_t end = old->mask + 1;
+            if (n != 0 && s.migrated + n < end) {
+                end = s.migrated + n;
+            }
+            for (; s.migrated < end; s.migrated++) {
+                Slot &os = old->slots[s.migrated];
+                uint64_t meta = os.meta.load(memory_order_relaxed);
+                if (meta == 0 || (meta & DEAD)) {
+                    continue;
+                }
+                uint64_t w[WORDS];
+                for (size_t j = 0; j < WORDS; j++) {
+                    w[j] = os.words[j].load(memory_order_relaxed);
+                }
+                place(cur, (meta & ~(uint64_t)UINT32_MAX) | 1,
+                    os.key.load(memory_order_relaxed), w);
+                os.meta.store(meta | DEAD, memory_order_relaxed);
+                s.cur_count++;
+            }
+            if (s.migrated == old->mask + 1) {
+                s.old.store(nullptr, memory_order_release);
+            }
+        }
+
+        void grow(Shard &s)
+        {
+            migrate(s, 0);
+            Table *cur = s.cur.load(memory_order_relaxed);
+            s.tables.emplace_back(new Table((cur->mask + 1) * 2));
+            s.old.store(cur, memory_order_release);
+            s.cur.store(s.tables.back().get(), memory_order_release);
+            s.migrated = 0;
+            s.cur_count = 0;
+        }
+
+        static void write_begin(Shard &s)
+        {
+            s.seq.store(s.seq.load(memory_order_relaxed) + 1,
+                memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+        }
+
+        static void write_end(Shard &s)
+        {
+            s.seq.store(s.seq.load(memory_order_relaxed) + 1,
+                memory_order_release);
+        }
+
+    public:
+        ConcurrentHashMap(Hasher h, unsigned nshards = CHM_SHARDS) : _h(h)
+        {
+            unsigned bits = 0;
+            while ((1u << bits) < nshards) {
+                bits++;
+            }
+            shard_shift = 32 - bits;
+            shards.reset(new Shard[1u << bits]);
+            for (unsigned i = 0; i < (1u << bits); i++) {
+                shards[i].tables.emplace_back(new Table(HASH_MIN_SLOTS));
+                shards[i].cur.store(shards[i].tables.back().get());
+            }
+        }
+
+        size_t size() const
+        {
+            size_t n = 0;
+            for (unsigned i = 0; i < (1u << (32 - shard_shift)); i++) {
+                n += shards[i].count.load(memory_order_relaxed);
+            }
+            return n;
+        }
+
+        void add(string_view lhs, const T &rhs)
+        {
+            uint32_t hash = _h(lhs.data(), lhs.size());
+            Shard &s = shard_of(hash);
+            lock_guard<mutex> guard(s.lock);
+            write_begin(s);
+            Table *cur = s.cur.load(memory_order_relaxed);
+            Slot *slot = const_cast<Slot *>(probe(cur, lhs, hash));
+            if (slot != nullptr) {
+                store_value(*slot, rhs);
+            } else {
+                Table *old = s.old.load(memory_order_relaxed);
+                Slot *os = old ? const_cast<Slot *>(probe(old, lhs, hash))
+                    : nullptr;
+                const char *key;
+                if (os != nullptr) {
+                    /* still in the old table: move it over with the new value */
+                    key = os->key.load(memory_order_relaxed);
+                    os->meta.fetch_or(DEAD, memory_order_relaxed);
+                } else {
+                    key = copy_key(s, lhs);
+                    s.count.fetch_add(1, memory_order_relaxed);
+                }
+                if (s.cur_count + 1 > (cur->mask + 1) * HASH_MAX_LOAD) {
+                    grow(s);
+                }
+                uint64_t w[WORDS] = {};
+                memcpy(w, &rhs, sizeof(T));
+                place(s.cur.load(memory_order_relaxed),
+                    (uint64_t)hash << 32 | 1, key, w);
+                s.cur_count++;
+            }
+            migrate(s, CHM_MIGRATE_STEP);
+            write_end(s);
+        }
+
+        bool remove(string_view lhs)
+        {
+            uint32_t hash = _h(lhs.data(), lhs.size());
+            Shard &s = shard_of(hash);
+            lock_guard<mutex> guard(s.lock);
+            write_begin(s);
+            Table *cur = s.cur.load(memory_order_relaxed);
+            Table *old = s.old.load(memory_order_relaxed);
+            const Slot *slot = probe(cur, lhs, hash);
+            bool found = true;
+            if (slot != nullptr) {
+                erase(cur, slot - cur->slots.get());
+                s.cur_count--;
+            } else if (old && (slot = probe(old, lhs, hash)) != nullptr) {
+                const_cast<Slot *>(slot)->meta.fetch_or(DEAD,
+                    memory_order_relaxed);
+            } else {
+                found = false;
+            }
+            if (found) {
+                s.count.fetch_sub(1, memory_order_relaxed);
+            }
+            migrate(s, CHM_MIGRATE_STEP);
+            write_end(s);
+            return found;
+        }
+
+        /* lock free: copy the value for key into out; false if there is none */
+        bool get(string_view key, T &out) const
+        {
+            uint32_t hash = _h(key.data(), key.size());
+            const Shard &s = shard_of(hash);
+            uint64_t w[WORDS];
+            for (;;) {
+                uint32_t seq = s.seq.load(memory_order_acquire);
+                if (seq & 1) {
+                    this_thread::yield();
+                    continue;
+                }
+                const Table *cur = s.cur.load(memory_order_acquire);
+                const Table *old = s.old.load(memory_order_acquire);
+                const Slot *slot = probe(cur, key, hash);
+                if (slot == nullptr && old != nullptr) {
+                    slot = probe(old, key, hash);
+                }
+                if (slot != nullptr) {
+                    for (size_t i = 0; i < WORDS; i++) {
+                        w[i] = slot->words[i].load(memory_order_relaxed);
+                    }
+                }
+                atomic_thread_fence(memory_order_acquire);
+                if (s.seq.load(memory_order_relaxed) == seq) {
+                    if (slot == nullptr) {
+                        return false;
+                    }
+                    memcpy(&out, w, sizeof(T));
+                    return true;
+                }
+            }
+        }
+} ;
+
+/* the baseline ConcurrentHashMap is measured against: one lock for all */
+template <typename T, typename Hasher = hashFn>
+class LockedHashMap {
+    private:
+        mutable mutex lock;
+        HashMap<T, Hasher> map;
+
+    public:
+        LockedHashMap(Hasher h) : map(h) {}
+
+        void add(string_view lhs, const T &rhs)
+        {
+            lock_guard<mutex> guard(lock);
+            map.add(lhs, rhs);
+        }
+
+        bool get(string_view key, T &out) const
+        {
+            lock_guard<mutex> guard(lock);
+            return map.get(key, out);
+        }
+} ;
+
+/*
+ * Snapshots: a HashMap<string> written out as a flat image that is mapped
+ * read-only and queried where it lies, with nothing to parse or allocate
+ * on open.  The file is a header, a Robin Hood slot array like HashMap's,
+ * and the key and value bytes; slots refer to those by offset from the
+ * start of the file, so the image works at any address, and processes
+ * mapping the same file share its page cache pages.
+ *
+ * The image is in native byte order and tied to the hash function: the
+ * header keeps the hash of SNAP_MAGIC, and a snapshot opened with a hasher
+ * that disagrees is refused, as is one from a machine of the other
+ * endianness.  save_snapshot() writes a temporary file of its own, syncs
+ * it and renames it over the old one, so readers that have the old one
+ * mapped are undisturbed, concurrent savers do not mix their output, and
+ * a crash leaves either the old snapshot or the complete new one.
+ */
+struct SnapHeader {
+    char magic[8];
+    uint32_t byte_order;        /* SNAP_BYTE_ORDER as the writer stored it */
+    uint32_t hash_check;        /* the writer's hash of SNAP_MAGIC */
+    uint64_t slots;             /* a power of two */
+    uint64_t count;
+    uint64_t slots_off;
+    uint64_t file_size;
+};
+
+struct SnapSlot {
+    uint32_t hash;
+    uint32_t dist;              /* as in HashMap, 0 if empty */
+    uint32_t key_len;
+    uint32_t value_len;
+    uint64_t off;               /* the key, then the value right after it */
+};
+
+template <typename Hasher>
+bool save_snapshot(const HashMap<string, Hasher> &map, const char *path)
 {
+    SnapHeader hdr = {};
+    size_t n = HASH_MIN_SLOTS;
+    while (map.size() > n * HASH_MAX_LOAD) {
+        n *= 2;
+    }
+    vector<SnapSlot> slots(n);
+    string bytes;
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    hdr.byte_order = SNAP_BYTE_ORDER;
+    hdr.hash_check = map.hasher()(SNAP_MAGIC, strlen(SNAP_MAGIC));
+    hdr.slots = n;
+    hdr.count = map.size();
+    hdr.slots_off = sizeof(hdr);
+    uint64_t bytes_off = hdr.slots_off + n * sizeof(SnapSlot);
+
+    map.for_each([&](string_view key, const string &value, uint32_t hash) {
+        SnapSlot e = { hash, 1, (uint32_t)key.size(), (uint32_t)value.size(),
+            bytes_off + bytes.size() };
+        bytes.append(key);
+        bytes.append(value);
+        for (size_t i = hash & (n - 1); ; i = (i + 1) & (n - 1), e.dist++) {
+            if (slots[i].dist == 0) {
+                slots[i] = e;
+                break;
+            }
+            if (slots[i].dist < e.dist) {
+                swap(slots[i], e);
+            }
+        }
+    });
+    hdr.file_size = bytes_off + bytes.size();
+
+    /* a unique temporary beside path, so the rename stays in one directory */
+    string tmp = string(path) + ".XXXXXX";
+    string dir = path;
+    size_t slash = dir.rfind('/');
+    dir = slash == string::npos ? "." : dir.substr(0, slash ? slash : 1);
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        return false;
+    }
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    /* mkstemp makes it private to us; other processes map it too */
+    bool ok = fchmod(fd, 0644) == 0 &&
+        fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+        fwrite(slots.data(), sizeof(SnapSlot), n, f) == n &&
+        fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size() &&
+        fflush(f) == 0 && fsync(fd) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    /* and make the rename itself survive a crash */
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) {
+        return false;
+    }
+    ok = fsync(dfd) == 0;
+    close(dfd);
+    return ok;
+}
+
+template <typename Hasher = hashFn>
+class HashMapSnapshot {
+    private:
+        const char *base;
+        size_t length;
+        const SnapHeader *hdr;
+        const SnapSlot *slots;
+        Hasher _h;
+
+    public:
+        HashMapSnapshot(Hasher h) : base(NULL), length(0), hdr(NULL),
+            slots(NULL), _h(h)
+        {
+        }
+
+        ~HashMapSnapshot()
+        {
+            unmap();
+        }
+
+        void unmap()
+        {
+            if (base != NULL) {
+                munmap(const_cast<char *>(base), length);
+            }
+            base = NULL;
+            hdr = NULL;
+            slots = NULL;
+            length = 0;
+        }
+
+        HashMapSnapshot(const HashMapSnapshot &) = delete;
+        HashMapSnapshot &operator=(const HashMapSnapshot &) = delete;
+
+        /*
+         * map path and check its header; false if it is not a usable image.
+         * A snapshot already open is unmapped first, also on failure.
+         */
+        bool open(const char *path)
+        {
+            struct stat st;
+            unmap();
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapHeader)) {
+                close(fd);
+                return false;
+            }
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) {
+                return false;
+            }
+            base = static_cast<const char *>(p);
+            length = st.st_size;
+            madvise(p, length, MADV_RANDOM);
+            hdr = reinterpret_cast<const SnapHeader *>(base);
+            slots = reinterpret_cast<const SnapSlot *>(base + hdr->slots_off);
+            if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+                hdr->byte_order != SNAP_BYTE_ORDER ||
+                hdr->hash_check != _h(SNAP_MAGIC, strlen(SNAP_MAGIC)) ||
+                hdr->file_size != length || hdr->slots == 0 ||
+                (hdr->slots & (hdr->slots - 1)) != 0 ||
+                hdr->slots_off != sizeof(SnapHeader) ||
+                hdr->slots > (length - hdr->slots_off) / sizeof(SnapSlot)) {
+                unmap();
+                return false;
+            }
+            return true;
+        }
+
+        size_t size() const { return base ? hdr->count : 0; }
+
+        /* the value for key, pointing into the mapping; false if there is none */
+        bool get(string_view key, string_view &value) const
+        {
+            if (base == NULL) {
+                return false;
+            }
+            uint32_t hash = _h(key.data(), key.size());
+            size_t mask = hdr->slots - 1;
+            size_t i = hash & mask;
+            for (uint32_t dist = 1; dist <= hdr->slots; dist++, i = (i + 1) & mask) {
+                const SnapSlot &s = slots[i];
+                if (s.dist < dist) {
+                    return false;
+                }
+                if (s.hash != hash || s.key_len != key.size()) {
+                    continue;
+                }
+                /* a damaged offset fails the lookup rather than reading past the map */
+                if (s.off > length || length - s.off < (uint64_t)s.key_len + s.value_len) {
+                    return false;
+                }
+                if (memcmp(base + s.off, key.data(), key.size()) == 0) {
+                    value = string_view(base + s.off + s.key_len, s.value_len);
+                    return true;
+                }
+            }
+            return false;
+        }
+} ;
+
+/*
+ * Contention benchmark: threads doing a mix of lookups and updates over a
+ * shared key set, the single locked HashMap against the sharded one, for
+ * 1, 2, 4 ... max_threads threads.
+ */
+template <typename Map>
+static double run_mix(Map &map, const vector<string> &keys, int threads,
+    size_t ops, int read_pct)
+{
+    atomic<int> ready{0};
+    atomic<bool> go{false};
+    atomic<uint64_t> hits{0};
+    vector<thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] {
+            uint64_t x = 0x9e3779b97f4a7c15ULL * (t + 1), v, found = 0;
+            ready++;
+            while (!go.load(memory_order_acquire)) {
+                this_thread::yield();
+            }
+            for (size_t i = 0; i < ops; i++) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                const string &k = keys[x % keys.size()];
+                if ((int)(x >> 40) % 100 < read_pct) {
+                    found += map.get(k, v);
+                } else {
+                    map.add(k, x);
+                }
+            }
+            hits += found;
+        });
+    }
+    while (ready.load() < threads) {
+        this_thread::yield();
+    }
+    auto start = chrono::steady_clock::now();
+    go.store(true, memory_order_release);
+    for (thread &t : pool) {
+        t.join();
+    }
+    chrono::duration<double> secs = chrono::steady_clock::now() - start;
+    return threads * ops / secs.count() / 1e6;
+}
+
+static void contention_bench(size_t nkeys, int read_pct, size_t ops,
+    int max_threads)
+{
+    vector<string> keys;
+    char buf[64];
+    LockedHashMap<uint64_t> locked(jenkins_one_at_a_time_hash);
+    ConcurrentHashMap<uint64_t> sharded(jenkins_one_at_a_time_hash);
+
+    for (size_t i = 0; i < nkeys; i++) {
+        snprintf(buf, sizeof(buf), "session:%08zx:client", i * 2654435761u);
+        keys.push_back(buf);
+        locked.add(keys.back(), i);
+        sharded.add(keys.back(), i);
+    }
+    cout<<nkeys<<" keys, "<<read_pct<<"% lookups, "<<ops
+        <<" ops per thread, Mops/s"<<endl;
+    cout<<"threads\tlocked\tsharded\tspeedup"<<endl;
+    for (int t = 1; t <= max_threads; t *= 2) {
+        double a = run_mix(locked, keys, t, ops, read_pct);
+        double b = run_mix(sharded, keys, t, ops, read_pct);
+        cout<<t<<"\t"<<a<<"\t"<<b<<"\t"<<b / a<<endl;
+    }
+}
+
+/*
+ * Hash benchmark: per key set, each hash's speed alone, how evenly its low
+ * 16 bits (what a table masks with) spread the keys, and the time to fill
+ * and query a HashMap with it, once through a hashFn pointer and once
+ * inlined as StaticHash.  The spread is chi-square over the expected
+ * count per bucket, divided by the bucket count: about 1 for a uniform
+ * hash, clearly more for a skewed one.
+ */
+#define HASH_BENCH_BUCKETS (1 << 16)
+
+template <typename Hasher>
+static double table_ns(Hasher h, const vector<string> &keys)
+{
+    HashMap<uint32_t, Hasher> map(h);
+    uint32_t v, sum = 0;
+    auto start = chrono::steady_clock::now();
+    map.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        map.add(keys[i], i);
+    }
+    for (const string &k : keys) {
+        sum += map.get(k, v) ? v : 0;
+    }
+    chrono::duration<double> secs = chrono::steady_clock::now() - start;
+    if (sum == 1) {
+        cout<<"";
+    }
+    return secs.count() * 1e9 / keys.size();
+}
+
+template <hashFn F>
+static void hash_row(const char *name, const vector<string> &keys)
+{
+    StaticHash<F> h;
+    vector<uint32_t> buckets(HASH_BENCH_BUCKETS);
+    size_t bytes = 0, rounds = 0;
+    uint32_t sink = 0;
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double> secs;
+    do {
+        for (const string &k : keys) {
+            sink += h(k.data(), k.size());
+            bytes += k.size();
+        }
+        rounds++;
+        secs = chrono::steady_clock::now() - start;
+    } while (secs.count() < 0.2);
+    for (const string &k : keys) {
+        buckets[h(k.data(), k.size()) & (HASH_BENCH_BUCKETS - 1)]++;
+    }
+    double expect = (double)keys.size() / HASH_BENCH_BUCKETS, chi = 0;
+    for (uint32_t b : buckets) {
+        chi += (b - expect) * (b - expect) / expect;
+    }
+    cout<<name<<"\t"<<secs.count() * 1e9 / (rounds * keys.size())
+        <<"\t"<<bytes / secs.count() / 1e9
+        <<"\t"<<chi / HASH_BENCH_BUCKETS
+        <<"\t"<<table_ns<hashFn>(F, keys)
+        <<"\t"<<table_ns(h, keys)<<(sink == 1 ? " " : "")<<endl;
+}
+
+static void hash_bench(size_t nkeys)
+{
+    vector<string> words, uuids;
+    uint64_t x = 88172645463325252ULL;
+    char buf[64];
+    auto next = [&x] {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
+    };
+    /* short capitalised words like the ones main() adds, and UUIDs */
+    for (size_t i = 0; i < nkeys; i++) {
+        string w(3 + next() % 11, 'a');
+        for (char &c : w) {
+            c = 'a' + next() % 26;
+        }
+        w[0] -= 'a' - 'A';
+        words.push_back(w);
+        uint64_t a = next(), b = next();
+        snprintf(buf, sizeof(buf), "%08x-%04x-4%03x-%04x-%012llx",
+            (unsigned)(a >> 32), (unsigned)(a >> 16) & 0xffff,
+            (unsigned)a & 0xfff, (unsigned)(b >> 48) | 0x8000,
+            (unsigned long long)b & 0xffffffffffffULL);
+        uuids.push_back(buf);
+    }
+    for (vector<string> *keys : { &words, &uuids }) {
+        sort(keys->begin(), keys->end());
+        keys->erase(unique(keys->begin(), keys->end()), keys->end());
+    }
+    for (int set = 0; set < 2; set++) {
+        const vector<string> &keys = set ? uuids : words;
+        cout<<(set ? "uuids" : "words")<<", "<<keys.size()<<" keys"<<endl;
+        cout<<"hash\tns/key\tGB/s\tspread\tmap ns/key (pointer, inlined)"<<endl;
+        hash_row<jenkins_one_at_a_time_hash>("jenkins", keys);
+        hash_row<wy_hash>("wyhash", keys);
+        hash_row<crc32c_hash>("crc32c", keys);
+    }
+}
+
+/*
+ * Snapshot benchmark: build a HashMap<string> of n entries, save it, and
+ * compare the build with opening the snapshot and answering from it.
+ */
+static void snapshot_bench(const char *path, size_t n)
+{
+    typedef StaticHash<wy_hash> Hash;
+    HashMap<string, Hash> map;
+    HashMapSnapshot<Hash> snap((Hash()));
+    char key[64], value[64];
+    string_view v;
+
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "session:%08zx:client", i * 2654435761u);
+        snprintf(value, sizeof(value), "ap-%zu/radio-%zu", i % 4093, i % 3);
+        map.add(key, value);
+    }
+    auto t1 = chrono::steady_clock::now();
+    if (!save_snapshot(map, path)) {
+        cout<<"error: could not write "<<path<<endl;
+        return;
+    }
+    auto t2 = chrono::steady_clock::now();
+    if (!snap.open(path)) {
+        cout<<"error: "<<path<<" is not a usable snapshot"<<endl;
+        return;
+    }
+    bool ok = snap.get("session:00000000:client", v) && v == "ap-0/radio-0";
+    auto t3 = chrono::steady_clock::now();
+    size_t found = 0;
+    map.for_each([&](string_view k, const string &val, uint32_t) {
+        found += snap.get(k, v) && v == val;
+    });
+    auto t4 = chrono::steady_clock::now();
+
+    typedef chrono::duration<double, milli> ms;
+    cout<<n<<" entries, "<<snap.size()<<" in "<<path<<endl;
+    cout<<"build\t"<<ms(t1 - t0).count()<<" ms"<<endl;
+    cout<<"save\t"<<ms(t2 - t1).count()<<" ms"<<endl;
+    cout<<"open + first get\t"<<ms(t3 - t2).count()<<" ms"
+        <<(ok ? "" : " (wrong answer)")<<endl;
+    cout<<"get\t"<<ms(t4 - t3).count() * 1e6 / n<<" ns/key, "<<found
+        <<" of "<<map.size()<<" found"<<endl;
+}
+
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "contention") == 0) {
+		/* HashMap contention [keys [read-percent [ops-per-thread [max-threads]]]] */
+		contention_bench(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 18,
+			argc > 3 ? atoi(argv[3]) : 90,
+			argc > 4 ? strtoul(argv[4], NULL, 0) : 200000,
+			argc > 5 ? atoi(argv[5]) : 64);
+		return 0;
+	}
+	if (argc > 2 && strcmp(argv[1], "snapshot") == 0) {
+		/* HashMap snapshot file [entries] */
+		snapshot_bench(argv[2], argc > 3 ? strtoul(argv[3], NULL, 0) : 1 << 21);
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "hashes") == 0) {
+		/* HashMap hashes [keys] */
+		hash_bench(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 20);
+		return 0;
+	}
+
 	HashMap<string> *h = new HashMap<string>(jenkins_one_at_a_time_hash);
 	h->add("Hello", "World");
 	h->add("Dan", "Brown");
@@ -113,4 +1292,11 @@ int main()
 	h->add("Functionality", "ramming");
 	h->print();
 	h->remove("Dan");
+
+	string value;
+	if (h->get("Haskell", value)) {
+		cout<<"Haskell -> "<<value<<endl;
+	}
+	cout<<"Dan -> "<<(h->find("Dan") ? *h->find("Dan") : "(none)")<<endl;
+	delete h;
 }
@@ -1,91 +1,323 @@
 #include <iostream>
 using namespace std;
 #include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
 
+#define CACHE_LINE 64
+
+/*
+ * Single producer, single consumer ring.
+ *
+ * head and tail count every element ever popped and pushed; they are never
+ * wrapped, so the ring is empty when they are equal and full when they are
+ * capacity apart, and every slot is usable.  capacity is size rounded up to
+ * a power of two, so a count becomes a slot with a mask.
+ *
+ * Only the producer writes tail and only the consumer writes head.  The
+ * producer publishes an element with a release store of tail, and the
+ * consumer's acquire load of tail makes the element visible before it is
+ * read; head works the same way in the other direction, returning slots.
+ * Each side keeps its index and its last seen copy of the other side's
+ * index on its own cache line, so the two threads only exchange lines
+ * when a side runs out of room (or elements) by its cached view.
+ *
+ * push_n/pop_n move as many elements as fit in one go, with a single
+ * index update, which is what a batching producer or consumer wants.
+ */
 template<class T, size_t size>
 class Q
 {
+	static_assert(size > 0, "a queue needs room for an element");
+
+	static constexpr size_t round_pow2(size_t n)
+	{
+		size_t p = 1;
+		while (p < n) {
+			p <<= 1;
+		}
+		return p;
+	}
+
 	public:
-		enum {
-			capacity = size+1
+		enum : size_t {
+			capacity = round_pow2(size),
+			mask = capacity - 1
 		};
-		
-    private:
-        T arr[capacity];
-        std::atomic<size_t> tail;
-        std::atomic<size_t> head;
+
+	private:
+		/* producer side */
+		alignas(CACHE_LINE) std::atomic<size_t> tail;
+		size_t head_cache;
+		/* consumer side */
+		alignas(CACHE_LINE) std::atomic<size_t> head;
+		size_t tail_cache;
+		alignas(CACHE_LINE) T arr[capacity];
 
 	public:
 		bool push(const T &element);
 		bool pop(T &element);
+		size_t push_n(const T *elements, size_t n);
+		size_t pop_n(T *elements, size_t n);
 		void print();
-		size_t increment(size_t idx) const 
-		{
-			 return ((idx+1) % capacity);
-		}
-		Q() : tail(0), head(0) 
+		Q() : tail(0), head_cache(0), head(0), tail_cache(0)
 		{
-			cout<<"array size = "<<sizeof(arr)/sizeof(T);
 		}
 };
 
 template<class T, size_t size>
 bool Q<T, size>::push(const T &element)
 {
-	const auto curr_tail = tail.load();	
-	const auto next_tail = increment(curr_tail);
-	if (next_tail == head.load()) {
-		cout<<"Overflow"<<endl;
-		return false;	
-	}
-	arr[curr_tail] = element;
-	tail.store(next_tail);
-	print();
+	const size_t curr_tail = tail.load(std::memory_order_relaxed);
+	if (curr_tail - head_cache == capacity) {
+		head_cache = head.load(std::memory_order_acquire);
+		if (curr_tail - head_cache == capacity) {
+			return false;
+		}
+	}
+	arr[curr_tail & mask] = element;
+	tail.store(curr_tail + 1, std::memory_order_release);
 	return true;
 }
 
 template<class T, size_t size>
 bool Q<T, size>::pop(T &element)
 {
-	const auto cur_head = head.load();
-	if (tail.load() == cur_head) {
-		cout<<"Underflow"<<endl;
-		return false;
+	const size_t cur_head = head.load(std::memory_order_relaxed);
+	if (cur_head == tail_cache) {
+		tail_cache = tail.load(std::memory_order_acquire);
+		if (cur_head == tail_cache) {
+			return false;
+		}
 	}
-	element = arr[cur_head];
-	
-	head.store(increment(cur_head));
-	print();
+	element = arr[cur_head & mask];
+	head.store(cur_head + 1, std::memory_order_release);
 	return true;
 }
 
+/* push up to n elements, returns how many fit */
 template<class T, size_t size>
-void Q<T, size>::print() 
+size_t Q<T, size>::push_n(const T *elements, size_t n)
 {
-	auto i = tail.load();
-	auto old_i = i;
-	i = increment(i);
+	const size_t curr_tail = tail.load(std::memory_order_relaxed);
+	if (capacity - (curr_tail - head_cache) < n) {
+		head_cache = head.load(std::memory_order_acquire);
+	}
+	n = std::min(n, capacity - (curr_tail - head_cache));
+	if (n == 0) {
+		return 0;
+	}
+	/* at most two runs: up to the end of arr, then from its start */
+	const size_t first = std::min(n, capacity - (curr_tail & mask));
+	std::copy(elements, elements + first, arr + (curr_tail & mask));
+	std::copy(elements + first, elements + n, arr);
+	tail.store(curr_tail + n, std::memory_order_release);
+	return n;
+}
+
+/* pop up to n elements, returns how many there were */
+template<class T, size_t size>
+size_t Q<T, size>::pop_n(T *elements, size_t n)
+{
+	const size_t cur_head = head.load(std::memory_order_relaxed);
+	if (tail_cache - cur_head < n) {
+		tail_cache = tail.load(std::memory_order_acquire);
+	}
+	n = std::min(n, tail_cache - cur_head);
+	if (n == 0) {
+		return 0;
+	}
+	const size_t first = std::min(n, capacity - (cur_head & mask));
+	std::copy(arr + (cur_head & mask), arr + (cur_head & mask) + first, elements);
+	std::copy(arr, arr + (n - first), elements + first);
+	head.store(cur_head + n, std::memory_order_release);
+	return n;
+}
+
+/* debugging aid, only meaningful while neither side is running */
+template<class T, size_t size>
+void Q<T, size>::print()
+{
+	const size_t t = tail.load(std::memory_order_acquire);
 	cout<<"queue elements: "<<"::";
-	for (; i != old_i; i=increment(i)) {
-		cout<<arr[i]<<"\t";		
+	for (size_t i = head.load(std::memory_order_acquire); i != t; i++) {
+		cout<<arr[i & mask]<<"\t";
+	}
+	cout<<endl;
+}
+
+/*
+ * Benchmark: a producer and a consumer thread pinned to two CPUs.
+ * Throughput streams BENCH_ITEMS integers one at a time and in batches;
+ * latency bounces a value through a pair of queues and halves the round
+ * trip.  A side that keeps finding its queue full or empty yields after
+ * BENCH_SPINS tries, so the run still finishes with both on one cpu.
+ */
+#define BENCH_ITEMS (1 << 25)
+#define BENCH_PINGS (1 << 20)
+#define BENCH_BATCH 64
+#define BENCH_SPINS 1024        /* failed tries before giving up the cpu */
+
+typedef Q<uint64_t, 4096> BenchQ;
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		cerr<<"could not pin to cpu "<<cpu<<", running unpinned"<<endl;
+	}
+}
+
+static inline void backoff(unsigned &spins)
+{
+	if (++spins >= BENCH_SPINS) {
+		spins = 0;
+		this_thread::yield();
 	}
-	cout<<endl;	
 }
 
-int main()
+static double throughput(int pcpu, int ccpu, size_t batch)
 {
+	BenchQ *q = new BenchQ;
+	size_t misordered = 0;
+	auto start = chrono::steady_clock::now();
+	thread consumer([&] {
+		pin(ccpu);
+		uint64_t buf[BENCH_BATCH], v;
+		size_t got = 0;
+		unsigned spins = 0;
+		while (got < BENCH_ITEMS) {
+			size_t n;
+			if (batch == 1) {
+				n = q->pop(v);
+				misordered += n && v != got;
+			} else {
+				n = q->pop_n(buf, batch);
+				for (size_t i = 0; i < n; i++) {
+					misordered += buf[i] != got + i;
+				}
+			}
+			if (n == 0) {
+				backoff(spins);
+			}
+			got += n;
+		}
+	});
+	thread producer([&] {
+		pin(pcpu);
+		uint64_t buf[BENCH_BATCH];
+		unsigned spins = 0;
+		for (uint64_t i = 0; i < BENCH_ITEMS; ) {
+			size_t n;
+			if (batch == 1) {
+				n = q->push(i);
+			} else {
+				n = min((uint64_t)batch, BENCH_ITEMS - i);
+				for (size_t j = 0; j < n; j++) {
+					buf[j] = i + j;
+				}
+				n = q->push_n(buf, n);
+			}
+			if (n == 0) {
+				backoff(spins);
+			}
+			i += n;
+		}
+	});
+	producer.join();
+	consumer.join();
+	chrono::duration<double> secs = chrono::steady_clock::now() - start;
+	delete q;
+	if (misordered != 0) {
+		cerr<<misordered<<" elements lost or out of order"<<endl;
+	}
+	return BENCH_ITEMS / secs.count() / 1e6;
+}
+
+static double latency(int pcpu, int ccpu)
+{
+	BenchQ *ping = new BenchQ, *pong = new BenchQ;
+	auto start = chrono::steady_clock::now();
+	thread echo([&] {
+		pin(ccpu);
+		uint64_t v;
+		unsigned spins = 0;
+		for (size_t i = 0; i < BENCH_PINGS; i++) {
+			while (!ping->pop(v)) {
+				backoff(spins);
+			}
+			while (!pong->push(v)) {
+				backoff(spins);
+			}
+		}
+	});
+	pin(pcpu);
+	uint64_t v;
+	unsigned spins = 0;
+	for (uint64_t i = 0; i < BENCH_PINGS; i++) {
+		while (!ping->push(i)) {
+			backoff(spins);
+		}
+		while (!pong->pop(v)) {
+			backoff(spins);
+		}
+	}
+	echo.join();
+	chrono::duration<double> secs = chrono::steady_clock::now() - start;
+	delete ping;
+	delete pong;
+	return secs.count() * 1e9 / BENCH_PINGS / 2;
+}
+
+static void bench(int pcpu, int ccpu)
+{
+	cout<<"producer cpu "<<pcpu<<", consumer cpu "<<ccpu<<", capacity "
+		<<BenchQ::capacity<<endl;
+	cout<<"push/pop\t"<<throughput(pcpu, ccpu, 1)<<" M items/s"<<endl;
+	cout<<"push_n/pop_n "<<BENCH_BATCH<<"\t"
+		<<throughput(pcpu, ccpu, BENCH_BATCH)<<" M items/s"<<endl;
+	cout<<"one way latency\t"<<latency(pcpu, ccpu)<<" ns"<<endl;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		/* atomic_cirq bench [producer-cpu consumer-cpu] */
+		bench(argc > 2 ? atoi(argv[2]) : 0, argc > 3 ? atoi(argv[3]) : 1);
+		return 0;
+	}
+
 	Q<int, 5> q;
-	q.push(10);
-	q.push(9);
-	q.push(4);
-	q.push(5);
-	q.push(8);
-	q.push(110);
+	cout<<"capacity "<<q.capacity<<endl;
+	for (int v : { 10, 9, 4, 5, 8, 110, 7, 3, 12 }) {
+		if (!q.push(v)) {
+			cout<<"Overflow pushing "<<v<<endl;
+		}
+	}
+	q.print();
 	int el;
 	q.pop(el);
 	cout <<"Removed "<<el<<endl;
 	q.pop(el);
 	cout <<"Removed "<<el<<endl;
-	q.push(88);q.push(55);q.push(34);
-
+	int more[] = { 88, 55, 34 };
+	cout<<"pushed "<<q.push_n(more, 3)<<" of 3"<<endl;
+	q.print();
+	int out[16];
+	size_t n = q.pop_n(out, 16);
+	cout<<"popped "<<n<<":";
+	for (size_t i = 0; i < n; i++) {
+		cout<<" "<<out[i];
+	}
+	cout<<endl;
+	if (!q.pop(el)) {
+		cout<<"Underflow"<<endl;
+	}
 }
@@ -1,254 +1,529 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <array>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdlib>
+#include <unistd.h>
+#include "log_time.h"
+#include "log_cursor.h"
 using namespace std;
 
-int isdigit(char c)
-{
-	return (c >= '0' && c <= '9');	
-}
-#define TS_LEN 18 /* MM/DD HH:MM:SS.XXX */
-extern "C" int date_time_matcher (const char *start, int size) {
-    int total_len = size - TS_LEN;
-    int matched = 0;
-    const char *cp = start;
-
-    if (isdigit(*cp)) { /* Month */
-        if (isdigit(*(cp + 1))) {
-        if (*(cp + 2) == '/') {
-            if (isdigit(*(cp + 3))) { /* Day */
-            if (isdigit(*(cp + 4))) {
-                if (*(cp + 5) == ' ') {
-                if (isdigit(*(cp + 6))) { /* Hour */
-                    if (isdigit(*(cp + 7))) {
-                    if (*(cp + 8) == ':') {
-                        if (isdigit(*(cp + 9))) { /*Minute */
-                        if (isdigit(*(cp + 10))) {
-                            if (*(cp + 11) == ':') {
-                            if (isdigit(*(cp + 12))) { /*Second */
-                                if (isdigit(*(cp + 13))) {
-                                if (*(cp + 14) == '.') {
-                                    if (isdigit(*(cp + 15))) { /*microsecond */
-                                    if (isdigit(*(cp + 16))) {
-                                        if (isdigit(*(cp + 17))) {
-                                        if (*(cp + 18) == ' ') { /*space */
-                                            matched = 1;
-                                        }
-                                        }
-                                    }
-                                    }
-                                }
-                                }
-                            }
-                            }
-                        }
-                        }
-                    }
-                    }
-                }
-                }
-            }
-            }
-        }
-        }
-    }
-    return matched;
-}
+#define CHUNK_SIZE (4 * 1024 * 1024)
+#define CHUNKS_PER_THREAD 4     /* normalized chunks waiting to be written */
+
+/*
+ * Normalizer
+ *
+ * Every line is reduced to its shape so that two log sets can be compared
+ * regardless of when they ran and on which clients: the record timestamp
+ * is dropped, and inside each word (a run of bytes between delimiters)
+ * MACs, UUIDs, hex pointers, long hex ids and numbers are replaced by
+ * <mac>, <uuid>, <ptr>, <hex> and <n>.
+ *
+ * Bytes are first mapped to a handful of classes.  Each token kind is a
+ * linear pattern of class segments with repeat counts, e.g. a MAC is
+ * hex{1,2} ':' repeated, and the patterns are combined once, at startup,
+ * into a single DFA over the classes by exploring the reachable tuples of
+ * per-pattern states.  A word is then one table lookup per byte, and
+ * is replaced when the DFA ends in an accepting state after the whole
+ * word.  A word without any digit cannot be any of the tokens (almost:
+ * all letter hex is left alone) and is copied without running the DFA.
+ * A word that is not a token as a whole is tried piece by piece between
+ * its ':', '.' and '-', so thread:0xfff536ae30 reads thread:<ptr>, and
+ * what is left has its free standing digit runs masked: 11:36:19.952
+ * reads <n>:<n>:<n>.<n> while ipv4 stays ipv4.
+ */
+enum ByteClass {
+    C_ZERO, C_DIGIT, C_HEXALPHA, C_X, C_ALPHA, C_COLON, C_DOT, C_DASH,
+    C_DELIM, NUM_CLASSES
+};
 
-#define IS_VALID_CHAR(s) (( (*s) >= '0' && (*s) <= '9') \
-    || (( (*s) >= 'a' && (*s) <= 'f')) || (( (*s) >= 'A' && (*s) <= 'F')))
+#define CB(c) (1u << (c))
+#define CLS_DEC (CB(C_ZERO) | CB(C_DIGIT))
+#define CLS_HEX (CLS_DEC | CB(C_HEXALPHA))
+
+enum Token { T_NONE, T_MAC, T_UUID, T_PTR, T_NUM, T_HEX, NUM_TOKENS };
+
+static const char *token_text[NUM_TOKENS] = {
+    "", "<mac>", "<uuid>", "<ptr>", "<n>", "<hex>"
+};
 
-/* Match one character portion of a valid sextet */
-static int match_one (const char *s, int last) {
-    if (IS_VALID_CHAR(s)) {
-    s++;
-    if (!last && *s == ':') {
-        return 2;
+struct Segment {
+    unsigned classes;
+    int min;
+    int max;                /* 0: no upper bound */
+};
+
+struct Pattern {
+    Token token;
+    vector<Segment> segs;
+};
+
+/*
+ * Per pattern state: segment * 64 + bytes matched in it, -1 once dead.
+ * Adjacent segments take disjoint classes, so each pattern on its own is
+ * deterministic.  Unbounded counts stop at the minimum to keep the state
+ * space finite.
+ */
+static int pattern_step (const Pattern &p, int st, int cls) {
+    if (st < 0) {
+        return -1;
     }
-    if (last && *s == ' ') {
-        return 1;
+    size_t seg = st / 64;
+    int cnt = st % 64;
+    const Segment &s = p.segs[seg];
+    if ((s.classes & CB(cls)) && (s.max == 0 || cnt < s.max)) {
+        return seg * 64 + (s.max == 0 ? min(cnt + 1, max(s.min, 1)) : cnt + 1);
     }
+    if (cnt >= s.min && seg + 1 < p.segs.size() &&
+        (p.segs[seg + 1].classes & CB(cls))) {
+        return (seg + 1) * 64 + 1;
     }
-    return 0;
+    return -1;
+}
+
+static bool pattern_accepts (const Pattern &p, int st) {
+    return st >= 0 && (size_t)(st / 64) == p.segs.size() - 1 &&
+        st % 64 >= max(p.segs.back().min, 1);
 }
 
-/* Match two characters one portion of a valid sextet */
-static int match_two (const char *s, int last) {
-    if (IS_VALID_CHAR(s)) {
-    s++;
-    if (IS_VALID_CHAR(s)) {
-        s++;
-        if (!last && *s == ':') {
-        return 3;
+class TokenDfa {
+	public:
+	TokenDfa();
+	/* the token word is as a whole, or T_NONE */
+	Token match(const char *w, size_t len) const
+	{
+		uint16_t s = 1;
+		for (size_t i = 0; i < len; i++) {
+			s = trans[s][byte_class[(unsigned char)w[i]]];
+			if (s == 0) {
+				return T_NONE;
+			}
+		}
+		return accept[s];
+	}
+	uint8_t byte_class[256];
+	private:
+	vector<array<uint16_t, NUM_CLASSES>> trans;  /* state 0 is dead */
+	vector<Token> accept;
+};
+
+TokenDfa::TokenDfa()
+{
+	vector<Pattern> pats;
+	Segment hex12 = { CLS_HEX, 1, 2 }, colon = { CB(C_COLON), 1, 1 };
+	Segment dot = { CB(C_DOT), 1, 1 }, dash = { CB(C_DASH), 1, 1 };
+	Pattern mac = { T_MAC, { hex12 } };
+	for (int i = 0; i < 5; i++) {
+		mac.segs.push_back(colon);
+		mac.segs.push_back(hex12);
+	}
+	/* in priority order, the first accepting pattern names the token */
+	pats.push_back(mac);
+	pats.push_back({ T_MAC, { { CLS_HEX, 4, 4 }, dot, { CLS_HEX, 4, 4 }, dot,
+		{ CLS_HEX, 4, 4 } } });
+	pats.push_back({ T_UUID, { { CLS_HEX, 8, 8 }, dash, { CLS_HEX, 4, 4 },
+		dash, { CLS_HEX, 4, 4 }, dash, { CLS_HEX, 4, 4 }, dash,
+		{ CLS_HEX, 12, 12 } } });
+	pats.push_back({ T_PTR, { { CB(C_ZERO), 1, 1 }, { CB(C_X), 1, 1 },
+		{ CLS_HEX, 1, 16 } } });
+	pats.push_back({ T_NUM, { { CLS_DEC, 1, 0 } } });
+	pats.push_back({ T_HEX, { { CLS_HEX, 8, 0 } } });
+
+	for (int c = 0; c < 256; c++) {
+		uint8_t cls = C_DELIM;
+		if (c == '0') {
+			cls = C_ZERO;
+		} else if (c >= '1' && c <= '9') {
+			cls = C_DIGIT;
+		} else if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+			cls = C_HEXALPHA;
+		} else if (c == 'x' || c == 'X') {
+			cls = C_X;
+		} else if (isalpha(c) || c == '_') {
+			cls = C_ALPHA;
+		} else if (c == ':') {
+			cls = C_COLON;
+		} else if (c == '.') {
+			cls = C_DOT;
+		} else if (c == '-') {
+			cls = C_DASH;
+		}
+		byte_class[c] = cls;
+	}
+
+	/* subset construction over the tuples of pattern states */
+	map<vector<int>, uint16_t> ids;
+	vector<vector<int>> states;
+	vector<int> dead(pats.size(), -1), start(pats.size(), 0);
+	ids[dead] = 0;
+	ids[start] = 1;
+	states.push_back(dead);
+	states.push_back(start);
+	for (size_t i = 0; i < states.size(); i++) {
+		array<uint16_t, NUM_CLASSES> row;
+		for (int cls = 0; cls < NUM_CLASSES; cls++) {
+			vector<int> next(pats.size());
+			for (size_t p = 0; p < pats.size(); p++) {
+				next[p] = pattern_step(pats[p], states[i][p], cls);
+			}
+			auto it = ids.find(next);
+			if (it == ids.end()) {
+				it = ids.emplace(next, states.size()).first;
+				states.push_back(next);
+			}
+			row[cls] = it->second;
+		}
+		trans.push_back(row);
+		Token t = T_NONE;
+		for (size_t p = 0; p < pats.size() && t == T_NONE; p++) {
+			if (pattern_accepts(pats[p], states[i][p])) {
+				t = pats[p].token;
+			}
+		}
+		accept.push_back(t);
+	}
+}
+
+static const TokenDfa token_dfa;
+
+static inline bool is_letter (uint8_t cls) {
+    return cls == C_HEXALPHA || cls == C_X || cls == C_ALPHA;
+}
+
+/* digit runs of [w, w + len) not touching a letter become <n> */
+static void mask_digits (const char *w, size_t len, string &out) {
+    const uint8_t *bc = token_dfa.byte_class;
+    size_t i, j;
+    for (i = 0; i < len; i = j) {
+        j = i + 1;
+        if (bc[(unsigned char)w[i]] > C_DIGIT) {
+            out += w[i];
+            continue;
         }
-        if (last && *s == ' ') {
-        return 2;
+        while (j < len && bc[(unsigned char)w[j]] <= C_DIGIT) {
+            j++;
+        }
+        if ((i > 0 && is_letter(bc[(unsigned char)w[i - 1]])) ||
+            (j < len && is_letter(bc[(unsigned char)w[j]]))) {
+            out.append(w + i, j - i);
+        } else {
+            out += token_text[T_NUM];
         }
     }
-    }
-    return 0;
 }
 
-static int find_one_or_two_byte_mac (const char *s, int toks_matched, int *skip) 
-{
-    int last = 0;
-    if (toks_matched == 6) {
-    return 1;
-    }
-    if (toks_matched == 5) {
-    last = 1;
+static void normalize_word (const char *w, size_t len, string &out) {
+    const uint8_t *bc = token_dfa.byte_class;
+    size_t i, j;
+    bool digits = false;
+    for (i = 0; i < len && !digits; i++) {
+        digits = bc[(unsigned char)w[i]] <= C_DIGIT;
     }
-    if (match_two(s, last)) {
-    *skip += 3;
-    return find_one_or_two_byte_mac(s+3, ++toks_matched, skip);
+    if (!digits) {
+        out.append(w, len);
+        return;
     }
-    if (match_one(s, last)) {
-    *skip += 2;
-    return find_one_or_two_byte_mac(s+2, ++toks_matched, skip);
+    Token t = token_dfa.match(w, len);
+    if (t != T_NONE) {
+        out += token_text[t];
+        return;
     }
-    return 0;
-}
-
-int find_one_quartet(const char *s, int last)
-{
-    if (IS_VALID_CHAR(s)) {
-        s++;
-        if (IS_VALID_CHAR(s)) {
-            s++;
-            if (IS_VALID_CHAR(s)) {
-                s++;
-                if (IS_VALID_CHAR(s)) {
-                    s++;
-                    if (!last && *s == '.') {
-                        return 1;
-                    }
-                    if (last) {
-                        return 1;
-                    }
-                }
+    /* not a token as a whole: try the pieces between ':', '.' and '-' */
+    for (i = 0; i < len; i = j) {
+        uint8_t cls = bc[(unsigned char)w[i]];
+        if (cls == C_COLON || cls == C_DOT || cls == C_DASH) {
+            out += w[i];
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < len; j++) {
+            cls = bc[(unsigned char)w[j]];
+            if (cls == C_COLON || cls == C_DOT || cls == C_DASH) {
+                break;
             }
         }
+        t = token_dfa.match(w + i, j - i);
+        if (t != T_NONE) {
+            out += token_text[t];
+        } else {
+            mask_digits(w + i, j - i, out);
+        }
     }
-    return 0;
 }
 
-
-#define MAX_WORD_LENGTH 256
-
-// If mac, return mac size, else 0
-extern "C"
-char *
-match_mac (const char *orig_line) 
-{ 
-    int num = 0;
-    char word[MAX_WORD_LENGTH] = {'\0'};
-    int  i =0;
-	char *start_of_mac;
-
-	char *start = strdup(orig_line);
-    
-    while (*start) {
-        i = 0;
-		start_of_mac = start;
-        while (*start != ' ') {
-            word[i] = *start;
-            i++;start++;
+/* the shape of line, timestamp dropped unless keep_ts, into out */
+static void normalize_line (log_time_ctx_t *ctx, string_view line,
+    bool keep_ts, string &out) {
+    const uint8_t *bc = token_dfa.byte_class;
+    const char *p = line.data(), *end = p + line.size();
+    uint64_t ns;
+    size_t ts_len;
+    if (!keep_ts && ctx->format != LOG_TIME_UNKNOWN &&
+        (ts_len = log_time_parse(ctx, p, end, &ns)) != 0) {
+        p += ts_len;
+    }
+    while (p < end) {
+        if (bc[(unsigned char)*p] == C_DELIM) {
+            out += *p++;
+            continue;
         }
-        word[i] = ' ';
-        start++;
-		  int num = 0;
-    	if (find_one_quartet(word,0))  {
-        	if (find_one_quartet(word+5, 0)) {
-            	if (find_one_quartet(word+10, 1)) {
-					for (;start_of_mac != start;start_of_mac++) {
-						*start_of_mac = 'X';
-					}	
-            	}	
-        	}	
-    	}
-        if (find_one_or_two_byte_mac(word, 0, &num)) {
-			for (;start_of_mac != start;start_of_mac++) {
-				*start_of_mac = 'X';
-			}	
+        const char *w = p;
+        while (p < end && bc[(unsigned char)*p] != C_DELIM) {
+            p++;
         }
+        normalize_word(w, p - w, out);
     }
-    return start;
 }
 
-
+/*
+ * One log set (a file), mapped and cut into chunks of whole lines that
+ * the workers normalize independently.
+ */
 class LogSet {
 	public:
-    	LogSet(const char *filename);   
-    private:
-    string featureSet();
-    friend int date_string_matcher(const char *str, int s);
-    void Tokenize(const string& str,
-                      vector<string>& tokens,
-                      const string& delimiters = ": ")
+	LogSet(const char *filename);
+	bool ok() const { return input.ok(); }
+	const char *name;
+	MappedFile input;
+	log_time_ctx_t tctx;    /* format detected up front, copied per chunk */
+	vector<string_view> chunks;
+};
+
+LogSet::LogSet(const char *filename) : name(filename), input(filename)
+{
+	if (!input.ok()) {
+		return;
+	}
+	/* years missing from the timestamps are inferred from the mtime */
+	log_time_init(&tctx, LOG_TIME_UNKNOWN, input.modified(),
+		log_time_local_offset());
+	log_time_detect(&tctx, input.begin(), input.end());
+
+	const char *p = input.begin(), *end = input.end();
+	while (p < end) {
+		const char *stop = p + CHUNK_SIZE < end ? p + CHUNK_SIZE : end;
+		if (stop < end) {
+			const char *nl = static_cast<const char *>(
+				memchr(stop, '\n', end - stop));
+			stop = nl ? nl + 1 : end;
+		}
+		chunks.push_back(string_view(p, stop - p));
+		p = stop;
+	}
+}
+
+/* how often a normalized line occurs in each set */
+struct Shape {
+    uint64_t count[2];
+};
+
+typedef unordered_map<string_view, Shape> ShapeMap;
+
+/*
+ * A worker's shapes, keyed by the normalized line itself.  The keys view
+ * the copies in texts, and a deque never moves an element once added.
+ */
+struct ShapeCounts {
+    deque<string> texts;
+    ShapeMap shapes;
+
+    Shape &operator[](string_view line)
     {
-        // Skip delimiters at beginning.
-        string::size_type lastPos = str.find_first_not_of(delimiters, 0);
-        // Find first "non-delimiter".
-        string::size_type pos     = str.find_first_of(delimiters, lastPos);
-
-        while (string::npos != pos || string::npos != lastPos)
-        {
-            // Found a token, add it to the vector.
-            tokens.push_back(str.substr(lastPos, pos - lastPos));
-            // Skip delimiters.  Note the "not_of"
-            lastPos = str.find_first_not_of(delimiters, pos);
-            // Find next "non-delimiter"
-            pos = str.find_first_of(delimiters, lastPos);
+        auto it = shapes.find(line);
+        if (it == shapes.end()) {
+            texts.emplace_back(line);
+            it = shapes.emplace(texts.back(), Shape{ { 0, 0 } }).first;
         }
+        return it->second;
     }
+};
 
-	size_t
-	find_first_of_level(const string &str)
-	{
-		size_t pos = string::npos;
-		pos = str.find("(info)");
-		if (pos !=string::npos) {
-			return pos + strlen("(info)");
+struct Job {
+    LogSet *set;
+    int which;              /* 0 or 1, the side of the diff */
+    string_view chunk;
+    string out;             /* normalized text, when streaming */
+    bool done;
+};
+
+/*
+ * A pool of threads pulls chunks off a shared counter.  Streaming a single
+ * set, the chunks are written in order as they complete, and workers stay
+ * at most CHUNKS_PER_THREAD chunks each ahead of the writer.  Diffing two
+ * sets, every worker counts shapes in its own table and the tables are
+ * merged at the end, so nothing is shared per line.
+ */
+class Normalizer {
+	public:
+	Normalizer(int threads, bool keep_ts, bool diff)
+		: nthreads(threads), keep_ts(keep_ts), diff(diff) {}
+	void add(LogSet &set, int which);
+	void run();
+	ShapeMap counts;        /* viewing the texts of local */
+	private:
+	void worker(ShapeCounts *local);
+	vector<ShapeCounts> local;
+	int nthreads;
+	bool keep_ts;
+	bool diff;
+	vector<Job> jobs;
+	atomic<size_t> next_job{0};
+	size_t written = 0;
+	mutex lock;
+	condition_variable cond;
+};
+
+void Normalizer::add(LogSet &set, int which)
+{
+	for (string_view c : set.chunks) {
+		jobs.push_back({ &set, which, c, string(), false });
+	}
+}
+
+void Normalizer::worker(ShapeCounts *local)
+{
+	string line_out;
+	for (;;) {
+		size_t j;
+		if (!diff) {
+			unique_lock<mutex> guard(lock);
+			cond.wait(guard, [&] {
+				return next_job >= jobs.size() ||
+					next_job < written + nthreads * CHUNKS_PER_THREAD;
+			});
 		}
-		pos = str.find("(debug)"); 
-		if (pos !=string::npos) {
-			return pos + strlen("(debug)");
+		if ((j = next_job++) >= jobs.size()) {
+			break;
 		}
-		pos = str.find("(error)");
-		if (pos !=string::npos) {
-			return pos + strlen("(error)");
+		Job &job = jobs[j];
+		log_time_ctx_t ctx = job.set->tctx;
+		LineCursor lines(job.chunk.data(), job.chunk.data() + job.chunk.size());
+		string_view line;
+		job.out.reserve(diff ? 0 : job.chunk.size());
+		while (lines.next(line)) {
+			if (diff) {
+				line_out.clear();
+				normalize_line(&ctx, line, keep_ts, line_out);
+				(*local)[line_out].count[job.which]++;
+			} else {
+				normalize_line(&ctx, line, keep_ts, job.out);
+				job.out += '\n';
+			}
 		}
-		return pos;
+		lock_guard<mutex> guard(lock);
+		job.done = true;
+		cond.notify_all();
 	}
-};
+}
 
-LogSet::LogSet(const char *filename)
+void Normalizer::run()
 {
-	std::ifstream input(filename);
-	if (!input) {
-		cout <<"Reading the file failed"<<endl;
+	vector<thread> threads;
+	local.resize(nthreads);
+	for (int i = 0; i < nthreads; i++) {
+		threads.emplace_back(&Normalizer::worker, this, &local[i]);
 	}
-	
-	string line="", prevline ="";
-	while (getline(input, line)) {
-		if (date_time_matcher(line.c_str(), line.size())) {
-			if (prevline.size() > 0) {
-				size_t pos = find_first_of_level(prevline);  	
-				if (pos != string::npos) {
-					string mod_line = string(prevline.c_str(), pos+2);;
-					//cout<<match_mac(mod_line.c_str())<<endl;;
-					cout<<mod_line<<endl;
-				}
-				prevline = line;
-			} 
-		} else {
-			prevline += line;
+	if (!diff) {
+		for (size_t j = 0; j < jobs.size(); j++) {
+			unique_lock<mutex> guard(lock);
+			cond.wait(guard, [&] { return jobs[j].done; });
+			guard.unlock();
+			cout.write(jobs[j].out.data(), jobs[j].out.size());
+			string().swap(jobs[j].out);
+			guard.lock();
+			written = j + 1;
+			cond.notify_all();
 		}
 	}
+	for (thread &t : threads) {
+		t.join();
+	}
+	for (ShapeCounts &l : local) {
+		for (auto &kv : l.shapes) {
+			Shape &s = counts.emplace(kv.first, Shape{ { 0, 0 } }).first->second;
+			s.count[0] += kv.second.count[0];
+			s.count[1] += kv.second.count[1];
+		}
+	}
+}
+
+/*
+ * Shapes whose counts differ between the sets, the largest difference
+ * first: "-n shape" for n more in the first set, "+n shape" in the second.
+ */
+static void print_diff (const ShapeMap &counts) {
+    typedef ShapeMap::value_type Entry;
+    vector<const Entry *> diffs;
+    for (const Entry &kv : counts) {
+        if (kv.second.count[0] != kv.second.count[1]) {
+            diffs.push_back(&kv);
+        }
+    }
+    auto delta = [](const Entry *e) {
+        const uint64_t *n = e->second.count;
+        return n[0] > n[1] ? n[0] - n[1] : n[1] - n[0];
+    };
+    sort(diffs.begin(), diffs.end(), [&](const Entry *a, const Entry *b) {
+        return delta(a) != delta(b) ? delta(a) > delta(b) : a->first < b->first;
+    });
+    for (const Entry *e : diffs) {
+        cout << (e->second.count[0] > e->second.count[1] ? '-' : '+')
+            << delta(e) << '\t' << e->first << '\n';
+    }
 }
 
-int main()
+int main(int argc, char **argv)
 {
-	LogSet("ra.txt");
+	int threads = thread::hardware_concurrency(), c;
+	bool keep_ts = false;
+
+	while ((c = getopt(argc, argv, "t:k")) != -1) {
+		switch (c) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'k':
+			keep_ts = true;
+			break;
+		default:
+			cerr<<"usage: "<<argv[0]<<" [-t threads] [-k] [log [other-log]]"
+				<<endl;
+			return 1;
+		}
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	int nsets = argc - optind;
+	if (nsets > 2) {
+		cerr<<"at most two log sets to compare"<<endl;
+		return 1;
+	}
+	LogSet first(nsets > 0 ? argv[optind] : "ra.txt");
+	LogSet second(nsets > 1 ? argv[optind + 1] : "");
+	if (!first.ok() || (nsets > 1 && !second.ok())) {
+		cout <<"Reading the file failed"<<endl;
+		return 1;
+	}
+
+	Normalizer norm(threads, keep_ts, nsets > 1);
+	norm.add(first, 0);
+	if (nsets > 1) {
+		norm.add(second, 1);
+	}
+	norm.run();
+	if (nsets > 1) {
+		print_diff(norm.counts);
+	}
 	return 0;
 }
@@ -1,33 +1,126 @@
 #include <iostream>
-#include <fstream>
-#include <string>
-#include <stack>
+#include <cstdlib>
+#include <cerrno>
+#include <poll.h>
+#include <sys/inotify.h>
+#include "log_cursor.h"
 using namespace std;
 
+#define FOLLOW_POLL_MS 1000
+#define FOLLOW_CHUNK (64 * 1024)
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+ * The last lines of a file, found from the end of its mapping so only the
+ * pages holding them are read: the cost follows the output, not the file.
+ * Follow() then keeps copying whatever is appended, like tail -f.
+ */
 class ReadFile {
 	private:
-		stack<string> s;
+		const char *name;
+		MappedFile file;
 	public:
-	ReadFile(const char *filename)
+	ReadFile(const char *filename) : name(filename), file(filename, MADV_RANDOM)
 	{
-		std::ifstream infile(filename);
-		string line;
-		while (std::getline(infile, line)) {
-			s.push(line);
-		}
 	}
-	
-	void Print_k_Lines(int k)
+
+	bool ok() const { return file.ok(); }
+
+	void Print_k_Lines(size_t k)
+	{
+		const char *start = tail_lines(file.begin(), file.end(), k);
+		write_all(1, start, file.end() - start);
+	}
+
+	/* copy what gets appended after the mapped size, until killed */
+	void Follow()
 	{
-		for (int i = 0; i <= k; ++i, s.pop()) {
-			cout<<s.top()<<endl;
+		int fd = open(name, O_RDONLY);
+		off_t pos = file.length();
+		struct pollfd pfd;
+		char buf[FOLLOW_CHUNK];
+		struct stat st;
+
+		if (fd < 0) {
+			cerr<<"could not reopen "<<name<<" to follow it"<<endl;
+			return;
+		}
+		/* woken by inotify, but polled as well in case an event is missed */
+		pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		pfd.events = POLLIN;
+		if (pfd.fd >= 0) {
+			inotify_add_watch(pfd.fd, name, IN_MODIFY);
+		}
+		for (;;) {
+			if (fstat(fd, &st) != 0) {
+				break;
+			}
+			if (st.st_size < pos) {
+				cerr<<name<<": file truncated"<<endl;
+				pos = 0;
+			}
+			while (pos < st.st_size) {
+				ssize_t n = pread(fd, buf, sizeof(buf), pos);
+				if (n <= 0 || !write_all(1, buf, n)) {
+					break;
+				}
+				pos += n;
+			}
+			if (pfd.fd >= 0 && poll(&pfd, 1, FOLLOW_POLL_MS) > 0) {
+				char evbuf[4096];
+				while (read(pfd.fd, evbuf, sizeof(evbuf)) > 0) {
+				}
+			} else if (pfd.fd < 0) {
+				usleep(FOLLOW_POLL_MS * 1000);
+			}
 		}
+		close(fd);
 	}
 };
 
 
-int main()
+int main(int argc, char **argv)
 {
-	ReadFile rf("input.txt");
-	rf.Print_k_Lines(10);
+	size_t k = 10;
+	bool follow = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:f")) != -1) {
+		switch (c) {
+		case 'n':
+			k = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			follow = true;
+			break;
+		default:
+			cerr<<"usage: "<<argv[0]<<" [-n lines] [-f] [file]"<<endl;
+			return 1;
+		}
+	}
+	ReadFile rf(optind < argc ? argv[optind] : "input.txt");
+	if (!rf.ok()) {
+		cerr<<"Reading the file failed"<<endl;
+		return 1;
+	}
+	rf.Print_k_Lines(k);
+	if (follow) {
+		rf.Follow();
+	}
+	return 0;
 }
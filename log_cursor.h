@@ -0,0 +1,162 @@
+/*
+ * log_cursor.h
+ *
+ * Zero-copy readers for the C++ log tools (diff_logs.cpp, last_k_lines.cpp).
+ *
+ * MappedFile maps a whole file read-only and tells the kernel how it will
+ * be walked, so reading is page faults on the page cache and read-ahead
+ * rather than copies through an ifstream buffer.  LineCursor hands out
+ * std::string_view spans into that mapping, each a line without its '\n'
+ * (getline semantics).  Nothing is allocated per line; a span is valid
+ * for as long as its MappedFile is.  tail_lines() goes the other way,
+ * from the end of a span back to the start of its last k lines.
+ */
+
+#ifndef __LOG_CURSOR_H__
+#define __LOG_CURSOR_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+class MappedFile {
+    public:
+    explicit MappedFile(const char *filename, int advice = MADV_SEQUENTIAL)
+    {
+        struct stat st;
+        fd = open(filename, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            return;
+        }
+        mtime = st.st_mtime;
+        size = st.st_size;
+        valid = true;
+        if (size == 0) {
+            /* nothing to map, an empty span */
+            return;
+        }
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            size = 0;
+            valid = false;
+            return;
+        }
+        base = static_cast<const char *>(p);
+        madvise(p, size, advice);
+    }
+
+    ~MappedFile()
+    {
+        if (base) {
+            munmap(const_cast<char *>(base), size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /* opened and mapped (an empty file is fine) */
+    bool ok() const { return valid; }
+    const char *begin() const { return base; }
+    const char *end() const { return base + size; }
+    size_t length() const { return size; }
+    time_t modified() const { return mtime; }
+    std::string_view view() const { return std::string_view(base, size); }
+
+    private:
+    const char *base = nullptr;
+    size_t size = 0;
+    time_t mtime = 0;
+    int fd = -1;
+    bool valid = false;
+};
+
+/* lines of [begin, end), without the '\n'; a last unterminated line counts */
+class LineCursor {
+    public:
+    LineCursor(const char *b, const char *e) : cur(b), last(e) {}
+    explicit LineCursor(const MappedFile &f) : cur(f.begin()), last(f.end()) {}
+
+    bool next(std::string_view &line)
+    {
+        if (cur == last) {
+            return false;
+        }
+        const char *nl = static_cast<const char *>(
+            memchr(cur, '\n', last - cur));
+        const char *stop = nl ? nl : last;
+        line = std::string_view(cur, stop - cur);
+        cur = nl ? nl + 1 : last;
+        return true;
+    }
+
+    /* where the next line starts */
+    const char *position() const { return cur; }
+
+    private:
+    const char *cur;
+    const char *last;
+};
+
+/*
+ * Start of the last k lines of [begin, end), found scanning backwards so
+ * only the tail of a mapping is ever touched.  A final '\n' ends the last
+ * line rather than starting an empty one.  With SSE2 the scan takes 64
+ * bytes at a time: four compares make a 64 bit newline mask, whole blocks
+ * are skipped by its popcount, and only the block holding the k-th
+ * newline from the end is looked at bit by bit.
+ */
+inline const char *tail_lines(const char *begin, const char *end, size_t k)
+{
+    const char *p = end;
+    if (k == 0) {
+        return end;
+    }
+    if (p > begin && p[-1] == '\n') {
+        p--;
+    }
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (p - begin >= 64) {
+        const __m128i *v = reinterpret_cast<const __m128i *>(p - 64);
+        uint64_t mask = 
+            (uint64_t)(unsigned)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128(v), nl)) |
+            (uint64_t)(unsigned)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128(v + 1), nl)) << 16 |
+            (uint64_t)(unsigned)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128(v + 2), nl)) << 32 |
+            (uint64_t)(unsigned)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_loadu_si128(v + 3), nl)) << 48;
+        size_t n = __builtin_popcountll(mask);
+        if (n >= k) {
+            /* drop the k - 1 newlines nearest the end, the next is it */
+            while (--k) {
+                mask &= ~(1ULL << (63 - __builtin_clzll(mask)));
+            }
+            return p - 64 + (63 - __builtin_clzll(mask)) + 1;
+        }
+        k -= n;
+        p -= 64;
+    }
+#endif
+    while (p > begin) {
+        if (*--p == '\n' && --k == 0) {
+            return p + 1;
+        }
+    }
+    return begin;
+}
+
+#endif /* __LOG_CURSOR_H__ */
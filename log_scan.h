@@ -0,0 +1,138 @@
+/*
+ * log_scan.h
+ *
+ * Record boundary scanner shared by msort_log.c and diff_logs.cpp.
+ *
+ * A record starts with "MM/DD HH:MM:SS.XXX " (the timestamp plus the space
+ * after it).  log_scan_ts() looks for that shape 32 (AVX2) or 16 (SSE2)
+ * candidate positions at a time: one unaligned load per character of the
+ * shape, shifted by its offset, compared against the delimiters and range
+ * checked for the digits.  The lowest set bit of the combined mask is the
+ * first record start.  Build with -mavx2 (or -march=native) for the wide
+ * path; without SSE2 everything falls back to the scalar check.
+ */
+
+#ifndef __LOG_SCAN_H__
+#define __LOG_SCAN_H__
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define LOG_TS_LEN 18           /* MM/DD HH:MM:SS.XXX */
+#define LOG_TS_SHAPE_LEN 19     /* timestamp and the space after it */
+
+#define LOG_SCAN_IS_DIGIT(c) ((unsigned char)((c) - '0') <= 9)
+
+/* does a full record timestamp start at cp, cp[0..18] must be readable */
+static inline int log_ts_at (const char *cp) {
+    return LOG_SCAN_IS_DIGIT(cp[0]) && LOG_SCAN_IS_DIGIT(cp[1]) &&
+        cp[2] == '/' &&
+        LOG_SCAN_IS_DIGIT(cp[3]) && LOG_SCAN_IS_DIGIT(cp[4]) &&
+        cp[5] == ' ' &&
+        LOG_SCAN_IS_DIGIT(cp[6]) && LOG_SCAN_IS_DIGIT(cp[7]) &&
+        cp[8] == ':' &&
+        LOG_SCAN_IS_DIGIT(cp[9]) && LOG_SCAN_IS_DIGIT(cp[10]) &&
+        cp[11] == ':' &&
+        LOG_SCAN_IS_DIGIT(cp[12]) && LOG_SCAN_IS_DIGIT(cp[13]) &&
+        cp[14] == '.' &&
+        LOG_SCAN_IS_DIGIT(cp[15]) && LOG_SCAN_IS_DIGIT(cp[16]) &&
+        LOG_SCAN_IS_DIGIT(cp[17]) &&
+        cp[18] == ' ';
+}
+
+#if defined(__AVX2__)
+
+#define LOG_SCAN_WIDTH 32
+typedef __m256i log_scan_vec_t;
+#define LOG_SCAN_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define LOG_SCAN_SET1(c) _mm256_set1_epi8(c)
+#define LOG_SCAN_EQ(a, b) _mm256_cmpeq_epi8((a), (b))
+#define LOG_SCAN_AND(a, b) _mm256_and_si256((a), (b))
+#define LOG_SCAN_SUB(a, b) _mm256_sub_epi8((a), (b))
+#define LOG_SCAN_MIN(a, b) _mm256_min_epu8((a), (b))
+#define LOG_SCAN_MASK(a) ((unsigned int)_mm256_movemask_epi8(a))
+
+#elif defined(__SSE2__)
+
+#define LOG_SCAN_WIDTH 16
+typedef __m128i log_scan_vec_t;
+#define LOG_SCAN_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define LOG_SCAN_SET1(c) _mm_set1_epi8(c)
+#define LOG_SCAN_EQ(a, b) _mm_cmpeq_epi8((a), (b))
+#define LOG_SCAN_AND(a, b) _mm_and_si128((a), (b))
+#define LOG_SCAN_SUB(a, b) _mm_sub_epi8((a), (b))
+#define LOG_SCAN_MIN(a, b) _mm_min_epu8((a), (b))
+#define LOG_SCAN_MASK(a) ((unsigned int)_mm_movemask_epi8(a))
+
+#endif
+
+#ifdef LOG_SCAN_WIDTH
+
+/* lanes of p + off that hold an ASCII digit */
+static inline log_scan_vec_t log_scan_digits (const char *p, int off) {
+    log_scan_vec_t d = LOG_SCAN_SUB(LOG_SCAN_LOAD(p + off), LOG_SCAN_SET1('0'));
+    return LOG_SCAN_EQ(LOG_SCAN_MIN(d, LOG_SCAN_SET1(9)), d);
+}
+
+/* lanes of p + off equal to c */
+static inline log_scan_vec_t log_scan_char (const char *p, int off, char c) {
+    return LOG_SCAN_EQ(LOG_SCAN_LOAD(p + off), LOG_SCAN_SET1(c));
+}
+
+/* bit i set when a full timestamp starts at p + i */
+static inline unsigned int log_scan_block (const char *p) {
+    log_scan_vec_t m;
+    /* the six delimiters rule out nearly every position, check them first */
+    m = LOG_SCAN_AND(log_scan_char(p, 2, '/'), log_scan_char(p, 5, ' '));
+    m = LOG_SCAN_AND(m, log_scan_char(p, 8, ':'));
+    m = LOG_SCAN_AND(m, log_scan_char(p, 11, ':'));
+    m = LOG_SCAN_AND(m, log_scan_char(p, 14, '.'));
+    m = LOG_SCAN_AND(m, log_scan_char(p, 18, ' '));
+    if (LOG_SCAN_MASK(m) == 0) {
+        return 0;
+    }
+    m = LOG_SCAN_AND(m, LOG_SCAN_AND(log_scan_digits(p, 0), log_scan_digits(p, 1)));
+    m = LOG_SCAN_AND(m, LOG_SCAN_AND(log_scan_digits(p, 3), log_scan_digits(p, 4)));
+    m = LOG_SCAN_AND(m, LOG_SCAN_AND(log_scan_digits(p, 6), log_scan_digits(p, 7)));
+    m = LOG_SCAN_AND(m, LOG_SCAN_AND(log_scan_digits(p, 9), log_scan_digits(p, 10)));
+    m = LOG_SCAN_AND(m, LOG_SCAN_AND(log_scan_digits(p, 12), log_scan_digits(p, 13)));
+    m = LOG_SCAN_AND(m, LOG_SCAN_AND(log_scan_digits(p, 15), log_scan_digits(p, 16)));
+    m = LOG_SCAN_AND(m, log_scan_digits(p, 17));
+    return LOG_SCAN_MASK(m);
+}
+
+#endif /* LOG_SCAN_WIDTH */
+
+/*
+ * First position p in [start, end - LOG_TS_LEN) where a record timestamp
+ * starts, or NULL.  Nothing at or beyond end is read.
+ */
+static inline const char * log_scan_ts (const char *start, const char *end) {
+    const char *p = start;
+    if (end - start < LOG_TS_SHAPE_LEN) {
+        return NULL;
+    }
+#ifdef LOG_SCAN_WIDTH
+    /* every lane reads up to LOG_TS_LEN bytes past the block */
+    while (end - p >= LOG_SCAN_WIDTH + LOG_TS_LEN) {
+        unsigned int mask = log_scan_block(p);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += LOG_SCAN_WIDTH;
+    }
+#endif
+    for (; p + LOG_TS_LEN < end; p++) {
+        if (log_ts_at(p)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#endif /* __LOG_SCAN_H__ */
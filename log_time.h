@@ -0,0 +1,348 @@
+/*
+ * log_time.h
+ *
+ * Timestamp parsers shared by msort_log.c and diff_logs.cpp.
+ *
+ * Every supported format has its own parser, and log_time_parse() picks
+ * one with a switch on the format a file was detected as, so each parser
+ * is compiled once and inlined into the loops that call it.  All of them
+ * turn a timestamp into nanoseconds since the epoch, which lets files in
+ * different formats merge on one key:
+ *
+ *   legacy    MM/DD HH:MM:SS.XXX           (WLC traces, no year)
+ *   iso8601   YYYY-MM-DD[T ]HH:MM:SS[.f][Z|+HH:MM]
+ *   syslog    Mmm dd HH:MM:SS              (RFC 3164, no year)
+ *   epoch     seconds[.fraction]           (10 digit seconds)
+ *
+ * Formats without a year take it from a reference time, normally the
+ * mtime of the file: the last record was written then, so a date later
+ * in the year than the reference belongs to the year before.  Times
+ * without a zone are local time, using one UTC offset for the whole run
+ * so that such files always agree with each other.
+ *
+ * A parser returns the length of the timestamp, or 0 when there is none
+ * at p.  It never reads at or beyond end, and it needs the delimiter that
+ * follows the timestamp, so a timestamp cut off by the end of the data
+ * is not taken.
+ */
+
+#ifndef __LOG_TIME_H__
+#define __LOG_TIME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "log_scan.h"
+
+typedef enum log_time_format_e {
+    LOG_TIME_UNKNOWN = 0,
+    LOG_TIME_LEGACY,
+    LOG_TIME_ISO8601,
+    LOG_TIME_SYSLOG,
+    LOG_TIME_EPOCH,
+    LOG_TIME_FORMATS
+} log_time_format_t;
+
+#define LOG_TIME_NS 1000000000LL
+#define LOG_TIME_DAY_NS (86400LL * LOG_TIME_NS)
+#define LOG_TIME_DETECT_SIZE (64 * 1024)
+
+typedef struct log_time_ctx_s {
+    log_time_format_t format;
+    int ref_year;           /* year inference for legacy and syslog */
+    int ref_mon;            /* 1..12 */
+    int ref_mday;
+    int64_t utc_offset;     /* seconds east of UTC for zone-less times */
+    int cache_md;           /* last month * 32 + day converted */
+    int64_t cache_day_ns;   /* and the start of that day */
+} log_time_ctx_t;
+
+/* days since 1970-01-01 of a proleptic Gregorian date */
+static inline int64_t log_time_days (int64_t y, int m, int d) {
+    int64_t era, yoe, doy, doe;
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+#define LOG_TIME_D(c) ((c) - '0')
+#define LOG_TIME_D2(p) (LOG_TIME_D((p)[0]) * 10 + LOG_TIME_D((p)[1]))
+
+static inline int log_time_digits (const char *p, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (!LOG_SCAN_IS_DIGIT(p[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int log_time_delim (char c) {
+    return c == ' ' || c == '\t';
+}
+
+/* start of the day month/day in the inferred year, local time */
+static inline int64_t log_time_yearless_day (log_time_ctx_t *ctx, int mon,
+    int mday) {
+    int md = mon * 32 + mday;
+    if (md != ctx->cache_md) {
+        /* a day of slack for the zone the file was written in */
+        int year = (md > ctx->ref_mon * 32 + ctx->ref_mday + 1) ?
+            ctx->ref_year - 1 : ctx->ref_year;
+        ctx->cache_md = md;
+        ctx->cache_day_ns = (log_time_days(year, mon, mday) * 86400 -
+            ctx->utc_offset) * LOG_TIME_NS;
+    }
+    return ctx->cache_day_ns;
+}
+
+static inline int64_t log_time_hms (const char *p) {
+    return ((int64_t)LOG_TIME_D2(p) * 3600 + LOG_TIME_D2(p + 3) * 60 +
+        LOG_TIME_D2(p + 6)) * LOG_TIME_NS;
+}
+
+/* [.,]digits after the seconds, returns the bytes used */
+static inline size_t log_time_fraction (const char *p, const char *end,
+    int64_t *ns) {
+    int64_t scale = LOG_TIME_NS / 10;
+    const char *q = p + 1;
+    *ns = 0;
+    if (p >= end || (*p != '.' && *p != ',')) {
+        return 0;
+    }
+    while (q < end && LOG_SCAN_IS_DIGIT(*q)) {
+        *ns += LOG_TIME_D(*q) * scale;
+        scale /= 10;
+        q++;
+    }
+    return q - p;
+}
+
+/* MM/DD HH:MM:SS.XXX */
+static inline size_t log_time_parse_legacy (log_time_ctx_t *ctx,
+    const char *p, const char *end, uint64_t *ns) {
+    if (end - p < LOG_TS_SHAPE_LEN || !log_ts_at(p)) {
+        return 0;
+    }
+    *ns = log_time_yearless_day(ctx, LOG_TIME_D2(p), LOG_TIME_D2(p + 3)) +
+        log_time_hms(p + 6) +
+        (LOG_TIME_D(p[15]) * 100 + LOG_TIME_D2(p + 16)) * 1000000LL;
+    return LOG_TS_LEN;
+}
+
+/* YYYY-MM-DD[T ]HH:MM:SS[.f][Z|+HH:MM|+HHMM] */
+static inline size_t log_time_parse_iso8601 (log_time_ctx_t *ctx,
+    const char *p, const char *end, uint64_t *ns) {
+    const char *q = p + 19;
+    int64_t frac, off = ctx->utc_offset;
+    if (end - p < 20 ||
+        !log_time_digits(p, 4) || p[4] != '-' ||
+        !log_time_digits(p + 5, 2) || p[7] != '-' ||
+        !log_time_digits(p + 8, 2) || (p[10] != 'T' && p[10] != ' ') ||
+        !log_time_digits(p + 11, 2) || p[13] != ':' ||
+        !log_time_digits(p + 14, 2) || p[16] != ':' ||
+        !log_time_digits(p + 17, 2)) {
+        return 0;
+    }
+    q += log_time_fraction(q, end, &frac);
+    if (q < end && *q == 'Z') {
+        off = 0;
+        q++;
+    } else if (q < end && (*q == '+' || *q == '-')) {
+        int sign = (*q == '-') ? -1 : 1;
+        if (end - q >= 6 && log_time_digits(q + 1, 2) && q[3] == ':' &&
+            log_time_digits(q + 4, 2)) {
+            off = sign * (LOG_TIME_D2(q + 1) * 3600 + LOG_TIME_D2(q + 4) * 60);
+            q += 6;
+        } else if (end - q >= 5 && log_time_digits(q + 1, 4)) {
+            off = sign * (LOG_TIME_D2(q + 1) * 3600 + LOG_TIME_D2(q + 3) * 60);
+            q += 5;
+        } else {
+            return 0;
+        }
+    }
+    if (q >= end || !log_time_delim(*q)) {
+        return 0;
+    }
+    *ns = (log_time_days(LOG_TIME_D2(p) * 100 + LOG_TIME_D2(p + 2),
+        LOG_TIME_D2(p + 5), LOG_TIME_D2(p + 8)) * 86400 - off) * LOG_TIME_NS +
+        log_time_hms(p + 11) + frac;
+    return q - p;
+}
+
+/* month number of a three letter English abbreviation, 0 if none */
+static inline int log_time_month (const char *p) {
+    static const char names[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    int m;
+    for (m = 0; m < 12; m++) {
+        if (memcmp(p, names + 3 * m, 3) == 0) {
+            return m + 1;
+        }
+    }
+    return 0;
+}
+
+/* Mmm dd HH:MM:SS, the day padded with a space or a zero */
+static inline size_t log_time_parse_syslog (log_time_ctx_t *ctx,
+    const char *p, const char *end, uint64_t *ns) {
+    int mon, mday;
+    if (end - p < 16 || p[3] != ' ' ||
+        (p[4] != ' ' && !LOG_SCAN_IS_DIGIT(p[4])) ||
+        !LOG_SCAN_IS_DIGIT(p[5]) || p[6] != ' ' ||
+        !log_time_digits(p + 7, 2) || p[9] != ':' ||
+        !log_time_digits(p + 10, 2) || p[12] != ':' ||
+        !log_time_digits(p + 13, 2) || !log_time_delim(p[15]) ||
+        (mon = log_time_month(p)) == 0) {
+        return 0;
+    }
+    mday = (p[4] == ' ' ? 0 : LOG_TIME_D(p[4]) * 10) + LOG_TIME_D(p[5]);
+    *ns = log_time_yearless_day(ctx, mon, mday) + log_time_hms(p + 7);
+    return 15;
+}
+
+/* seconds since the epoch, ten digits, with an optional fraction */
+static inline size_t log_time_parse_epoch (log_time_ctx_t *ctx,
+    const char *p, const char *end, uint64_t *ns) {
+    const char *q = p + 10;
+    int64_t secs = 0, frac;
+    int i;
+    (void)ctx;
+    if (end - p < 11 || !log_time_digits(p, 10)) {
+        return 0;
+    }
+    for (i = 0; i < 10; i++) {
+        secs = secs * 10 + LOG_TIME_D(p[i]);
+    }
+    q += log_time_fraction(q, end, &frac);
+    if (q >= end || !log_time_delim(*q)) {
+        return 0;
+    }
+    *ns = secs * LOG_TIME_NS + frac;
+    return q - p;
+}
+
+static inline size_t log_time_parse (log_time_ctx_t *ctx, const char *p,
+    const char *end, uint64_t *ns) {
+    switch (ctx->format) {
+    case LOG_TIME_LEGACY:
+        return log_time_parse_legacy(ctx, p, end, ns);
+    case LOG_TIME_ISO8601:
+        return log_time_parse_iso8601(ctx, p, end, ns);
+    case LOG_TIME_SYSLOG:
+        return log_time_parse_syslog(ctx, p, end, ns);
+    case LOG_TIME_EPOCH:
+        return log_time_parse_epoch(ctx, p, end, ns);
+    default:
+        return 0;
+    }
+}
+
+static const char * const log_time_format_names[LOG_TIME_FORMATS] = {
+    "auto", "legacy", "iso8601", "syslog", "epoch"
+};
+
+/* format by name, LOG_TIME_UNKNOWN for "auto", -1 if not known */
+static inline int log_time_format_by_name (const char *name) {
+    int f;
+    for (f = 0; f < LOG_TIME_FORMATS; f++) {
+        if (strcmp(name, log_time_format_names[f]) == 0) {
+            return f;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Set up year inference from ref (usually the file's mtime) and the UTC
+ * offset used for times without a zone.  format may be LOG_TIME_UNKNOWN
+ * to have log_time_detect() pick it.
+ */
+static inline void log_time_init (log_time_ctx_t *ctx, log_time_format_t format,
+    time_t ref, int64_t utc_offset) {
+    struct tm tm;
+    memset(ctx, 0, sizeof(*ctx));
+    localtime_r(&ref, &tm);
+    ctx->format = format;
+    ctx->ref_year = tm.tm_year + 1900;
+    ctx->ref_mon = tm.tm_mon + 1;
+    ctx->ref_mday = tm.tm_mday;
+    ctx->utc_offset = utc_offset;
+    ctx->cache_md = -1;
+}
+
+/* the local UTC offset, taken once so that every file uses the same one */
+static inline int64_t log_time_local_offset (void) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    return tm.tm_gmtoff;
+}
+
+/*
+ * Detect the format from the first lines of data: the first line that
+ * starts with a timestamp decides.  Traces in the legacy format do not
+ * always start records at a line start, so failing that, a legacy
+ * timestamp anywhere will do.  Returns LOG_TIME_UNKNOWN if nothing was
+ * found yet.
+ */
+static inline log_time_format_t log_time_detect (log_time_ctx_t *ctx,
+    const char *data, const char *end) {
+    const char *p = data;
+    uint64_t ns;
+    int f;
+    if (end - data > LOG_TIME_DETECT_SIZE) {
+        end = data + LOG_TIME_DETECT_SIZE;
+    }
+    while (p < end) {
+        const char *nl;
+        for (f = LOG_TIME_LEGACY; f < LOG_TIME_FORMATS; f++) {
+            ctx->format = (log_time_format_t)f;
+            if (log_time_parse(ctx, p, end, &ns)) {
+                return ctx->format;
+            }
+        }
+        nl = (const char *)memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            break;
+        }
+        p = nl + 1;
+    }
+    ctx->format = log_scan_ts(data, end) ? LOG_TIME_LEGACY : LOG_TIME_UNKNOWN;
+    return ctx->format;
+}
+
+/*
+ * First record start in [start, end) for the line oriented formats: a
+ * line start (data itself or just after a newline) with a timestamp.  On
+ * a miss returns NULL and sets *resume to where a later scan over more
+ * data must start: the last newline seen, or start if there was none.
+ */
+static inline const char * log_time_next_line (log_time_ctx_t *ctx,
+    const char *data, const char *start, const char *end,
+    const char **resume) {
+    const char *p = start;
+    uint64_t ns;
+    *resume = start;
+    if (p != data && p[-1] != '\n') {
+        goto next_line;
+    }
+    while (p < end) {
+        if (log_time_parse(ctx, p, end, &ns)) {
+            return p;
+        }
+    next_line:
+        p = (const char *)memchr(p, '\n', end - p);
+        if (p == NULL) {
+            break;
+        }
+        *resume = p++;
+    }
+    return NULL;
+}
+
+#endif /* __LOG_TIME_H__ */
@@ -0,0 +1,858 @@
+/*
+ * msort_bench.c
+ *
+ * Benchmark and regression harness for msort_log.
+ *
+ * Generates a deterministic set of WLC style traces modeled on ra.txt,
+ * runs the merger over them in a few scenarios and reports wall and CPU
+ * time, peak RSS, MB/s and records/s for every stage.  The generator
+ * knows how many records each scenario must output, so every run is also
+ * checked: record count, timestamp order, identical output wherever two
+ * scenarios must agree, and the record counts --stats reports per stage.
+ * The exit status is non-zero when a check fails.
+ *
+ *   gcc -O2 -DZLIB_SUPPORTED msort_bench.c -o msort_bench -lz -lm
+ *   ./msort_bench -x ./msort_log -n 16 -S 32 -- -t 4
+ *
+ * Arguments after -- are passed to every msort_log run.
+ */
+
+#define _GNU_SOURCE 1
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#ifdef ZLIB_SUPPORTED
+#include <zlib.h>
+#endif
+
+#define BENCH_FILES 8
+#define BENCH_FILE_MB 16
+#define BENCH_HIT_RATE 0.01
+#define BENCH_SEED 1
+#define BENCH_REPEAT 1
+#define BENCH_MAX_FILES 4096
+#define BENCH_MAX_ARGS 64
+#define BENCH_SESSIONS 64           /* UUIDs active at once per file */
+#define BENCH_SESSION_LEN 40        /* mean records per UUID */
+#define BENCH_DAY_MS (24L * 3600 * 1000)
+#define BENCH_FILTER_MAC "0:44:8:15:0:2"
+#define TS_LEN 18                   /* MM/DD HH:MM:SS.XXX */
+
+/*
+ * xorshift64*, so a seed gives the same traces on every machine
+ */
+static u_int64_t rng_state;
+
+static inline u_int64_t rng_next (void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static inline u_int32_t rng_below (u_int32_t n) {
+    return (u_int32_t)(((rng_next() >> 32) * n) >> 32);
+}
+
+static inline double rng_unit (void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* command line option flags */
+static char *msort_path = "./msort_log";
+static char *bench_dir = NULL;
+static int num_files = BENCH_FILES;
+static double file_mb = BENCH_FILE_MB;
+static double size_skew = 0;
+#ifdef ZLIB_SUPPORTED
+static double gzip_share = 0;
+#endif
+static double hit_rate = BENCH_HIT_RATE;
+static u_int64_t seed = BENCH_SEED;
+static int repeat = BENCH_REPEAT;
+static int json = 0;
+static int keep = 0;
+static char *extra_args[BENCH_MAX_ARGS];
+static int num_extra_args = 0;
+
+struct gen_file_s {
+    char *path;
+    size_t bytes;           /* uncompressed */
+    size_t stored;          /* on disk */
+    size_t records;
+    size_t filter_hits;     /* records the -f run must output */
+    int gzipped;
+};
+
+typedef struct gen_file_s gen_file_t;
+
+struct session_s {
+    u_int64_t uuid;
+    int hit;                /* announced for BENCH_FILTER_MAC */
+    int fresh;              /* appctx record not written yet */
+    u_int32_t pid;
+};
+
+typedef struct session_s session_t;
+
+struct stage_s {
+    const char *name;
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    long rss_kb;
+    size_t bytes;           /* input bytes the rates are computed over */
+    size_t records;
+    const char *check;      /* "ok", "FAIL ..." or "-" */
+};
+
+typedef struct stage_s stage_t;
+
+static const char *modules[] = {
+    "wcm", "ft", "rf-profile", "apf-mobile", "avc", "pem-state",
+    "dot11", "auth-mgr", "client-orch-sm", "ewlc-qos-client"
+};
+
+static const char *levels[] = { "info", "debug", "error" };
+
+static double elapsed_ms (struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 +
+        (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static double tv_ms (struct timeval *tv) {
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+/* CPU time of this process since *from, for the stages run in-process */
+static void self_usage (stage_t *st, struct rusage *from) {
+    struct rusage now;
+    getrusage(RUSAGE_SELF, &now);
+    st->user_ms = tv_ms(&now.ru_utime) - tv_ms(&from->ru_utime);
+    st->sys_ms = tv_ms(&now.ru_stime) - tv_ms(&from->ru_stime);
+    st->rss_kb = now.ru_maxrss;
+}
+
+static void format_ts (char *buf, size_t size, unsigned long ms) {
+    /* March 10 onwards, as the sample traces */
+    unsigned long day = ms / BENCH_DAY_MS;
+    ms %= BENCH_DAY_MS;
+    snprintf(buf, size, "03/%02lu %02lu:%02lu:%02lu.%03lu", 10 + day,
+        ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+}
+
+/* a MAC as the traces write it: one or two hex digits per byte */
+static void format_colon_mac (char *buf, u_int64_t mac) {
+    sprintf(buf, "%x:%x:%x:%x:%x:%x", (int)(mac >> 40) & 0xff,
+        (int)(mac >> 32) & 0xff, (int)(mac >> 24) & 0xff,
+        (int)(mac >> 16) & 0xff, (int)(mac >> 8) & 0xff, (int)mac & 0xff);
+}
+
+static void format_dotted_mac (char *buf, u_int64_t mac) {
+    sprintf(buf, "%04x.%04x.%04x", (int)(mac >> 32) & 0xffff,
+        (int)(mac >> 16) & 0xffff, (int)mac & 0xffff);
+}
+
+static void session_start (session_t *s, int file, u_int64_t *next_uuid) {
+    s->uuid = ((u_int64_t)0x8c << 44) | ((u_int64_t)file << 28) |
+        (*next_uuid)++;
+    s->hit = rng_unit() < hit_rate;
+    s->fresh = 1;
+    s->pid = 32000 + rng_below(1000);
+}
+
+/*
+ * One record: the appctx announcement for a new UUID, otherwise a
+ * message of the UUID's conversation with MACs in both spellings and now
+ * and then a continuation line.  Returns its length.
+ */
+static int format_record (char *buf, long ms, session_t *s,
+    u_int64_t station) {
+    char ts[32], mac[32], dotted[32];
+    int n;
+    format_ts(ts, sizeof(ts), ms);
+    if (s->fresh) {
+        if (s->hit) {
+            strcpy(mac, BENCH_FILTER_MAC);
+        } else {
+            /* never equal to the filter MAC, its first byte is 0 */
+            format_colon_mac(mac, station | (1ULL << 40));
+        }
+        s->fresh = 0;
+        return sprintf(buf, "%s {1} {wcm} [wcm] [%u]: UUID: %" PRIx64
+            ", ra: 7 (appctx): mac  %s \n", ts, s->pid, s->uuid, mac);
+    }
+    format_dotted_mac(dotted, station);
+    n = sprintf(buf, "%s {1} {wcm} [%s] [%u]: UUID: %" PRIx64 ", ra: 7 "
+        "(%s): %s ", ts, modules[rng_below(10)], s->pid, s->uuid,
+        levels[rng_below(3)], dotted);
+    switch (rng_below(4)) {
+    case 0:
+        n += sprintf(buf + n, "Processing assoc-req station: %s  AP: "
+            "a293.b900.%04x -01 thread:0x%08x\n", dotted, rng_below(65536),
+            (unsigned)rng_next());
+        break;
+    case 1:
+        n += sprintf(buf + n, "Change state to %s (%u) last state START (0)\n",
+            (rng_below(2) ? "L2_AUTH" : "RUN"), rng_below(20));
+        break;
+    case 2:
+        format_colon_mac(mac, station);
+        n += sprintf(buf + n, "Client %s entry not found in the TRANS List.\n",
+            mac);
+        break;
+    default:
+        n += sprintf(buf + n, "1:abcdefghijklmnopabcdefghijk: Set "
+            "isAvcEnabled to FALSE, New Client\n");
+        break;
+    }
+    if (rng_below(20) == 0) {
+        n += sprintf(buf + n, "    at frame %u of %u\n", rng_below(16), 16);
+    }
+    return n;
+}
+
+/*
+ * Write one trace of about target bytes.  Timestamps cover the same day
+ * in every file, so the merge interleaves all of them.
+ */
+static void generate_file (gen_file_t *gf, int file, size_t target) {
+    session_t sessions[BENCH_SESSIONS];
+    u_int64_t stations[BENCH_SESSIONS], next_uuid = 1;
+    char buf[1024];
+    size_t est_records = target / 150 + 1;
+    double step = (double)BENCH_DAY_MS / est_records;
+    double ms = rng_below(1000);
+    FILE *fp;
+    int i;
+
+    fp = fopen(gf->path, "w");
+    if (fp == NULL) {
+        printf("could not create %s - %s\n", gf->path, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < BENCH_SESSIONS; i++) {
+        session_start(&sessions[i], file, &next_uuid);
+        stations[i] = rng_next() & 0xffffffffffffULL;
+    }
+    while (gf->bytes < target) {
+        int slot = rng_below(BENCH_SESSIONS);
+        session_t *s = &sessions[slot];
+        int n;
+        if (!s->fresh && rng_below(BENCH_SESSION_LEN) == 0) {
+            session_start(s, file, &next_uuid);
+            stations[slot] = rng_next() & 0xffffffffffffULL;
+        }
+        n = format_record(buf, (long)ms, s, stations[slot]);
+        if (fwrite(buf, 1, n, fp) != (size_t)n) {
+            printf("write to %s failed - %s\n", gf->path, strerror(errno));
+            exit(1);
+        }
+        gf->bytes += n;
+        gf->records++;
+        gf->filter_hits += s->hit;
+        ms += step * 2 * rng_unit();
+    }
+    fclose(fp);
+    gf->stored = gf->bytes;
+}
+
+#ifdef ZLIB_SUPPORTED
+static void gzip_file (gen_file_t *gf) {
+    char *gz_path, buf[64 * 1024];
+    size_t n;
+    struct stat st;
+    FILE *in;
+    gzFile out;
+
+    if (asprintf(&gz_path, "%s.gz", gf->path) < 0) {
+        exit(1);
+    }
+    in = fopen(gf->path, "r");
+    out = gzopen(gz_path, "wb6");
+    if (in == NULL || out == NULL) {
+        printf("could not compress %s\n", gf->path);
+        exit(1);
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (gzwrite(out, buf, n) != (int)n) {
+            printf("could not compress %s\n", gf->path);
+            exit(1);
+        }
+    }
+    fclose(in);
+    gzclose(out);
+    unlink(gf->path);
+    free(gf->path);
+    gf->path = gz_path;
+    gf->gzipped = 1;
+    if (stat(gf->path, &st) == 0) {
+        gf->stored = st.st_size;
+    }
+}
+#endif
+
+/*
+ * File sizes follow weights 1/(i+1)^skew, so skew 0 gives equal files
+ * and skew 1 a Zipf spread, the total staying num_files * file_mb.
+ */
+static gen_file_t * generate_inputs (stage_t *gen, stage_t *gz) {
+    gen_file_t *files = calloc(num_files, sizeof(gen_file_t));
+    double *weight = calloc(num_files, sizeof(double)), total = 0;
+    struct timespec t0, t1;
+    struct rusage ru;
+    int f;
+
+    if (files == NULL || weight == NULL) {
+        printf("could not allocate %d inputs\n", num_files);
+        exit(1);
+    }
+    for (f = 0; f < num_files; f++) {
+        weight[f] = pow(f + 1, -size_skew);
+        total += weight[f];
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (f = 0; f < num_files; f++) {
+        size_t target = (size_t)(file_mb * 1024 * 1024 * num_files *
+            weight[f] / total);
+        if (asprintf(&files[f].path, "%s/trace%04d.log", bench_dir, f) < 0) {
+            exit(1);
+        }
+        generate_file(&files[f], f, target ? target : 1);
+        gen->bytes += files[f].bytes;
+        gen->records += files[f].records;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    gen->wall_ms = elapsed_ms(&t0, &t1);
+    self_usage(gen, &ru);
+    free(weight);
+
+    gz->bytes = 0;
+#ifdef ZLIB_SUPPORTED
+    getrusage(RUSAGE_SELF, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (f = 0; f < num_files; f++) {
+        /* spread the compressed inputs evenly over the file list */
+        if ((int)((f + 1) * gzip_share) != (int)(f * gzip_share)) {
+            gz->bytes += files[f].bytes;
+            gz->records += files[f].records;
+            gzip_file(&files[f]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    gz->wall_ms = elapsed_ms(&t0, &t1);
+    self_usage(gz, &ru);
+#endif
+    return files;
+}
+
+/*
+ * Run msort_log once over the inputs, with scenario flags and the extra
+ * arguments, output to out and stderr to err (or /dev/null).  Times the
+ * child and takes its peak RSS.
+ */
+static void run_msort (stage_t *st, gen_file_t *files, char **flags,
+    int num_flags, const char *out, const char *err) {
+    char **argv = calloc(num_files + num_flags + num_extra_args + 4,
+        sizeof(char *));
+    struct timespec t0, t1;
+    struct rusage ru;
+    int argc = 0, i, status;
+    pid_t pid;
+
+    if (argv == NULL) {
+        printf("could not allocate arguments\n");
+        exit(1);
+    }
+    argv[argc++] = msort_path;
+    for (i = 0; i < num_extra_args; i++) {
+        argv[argc++] = extra_args[i];
+    }
+    for (i = 0; i < num_flags; i++) {
+        argv[argc++] = flags[i];
+    }
+    argv[argc++] = "-o";
+    argv[argc++] = (char *)out;
+    for (i = 0; i < num_files; i++) {
+        argv[argc++] = files[i].path;
+    }
+    unlink(out);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        int efd = err ? open(err, O_WRONLY | O_CREAT | O_TRUNC, 0644) : null;
+        if (null >= 0) {
+            dup2(null, 1);
+        }
+        if (efd >= 0) {
+            dup2(efd, 2);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait failed");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(argv);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s exited with status %d in %s\n", msort_path,
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1, st->name);
+        exit(1);
+    }
+    st->wall_ms = elapsed_ms(&t0, &t1);
+    st->user_ms = tv_ms(&ru.ru_utime);
+    st->sys_ms = tv_ms(&ru.ru_stime);
+    st->rss_kb = ru.ru_maxrss;
+}
+
+static int ts_at (const char *p) {
+    static const char shape[] = "00/00 00:00:00.000 ";
+    int i;
+    for (i = 0; i <= TS_LEN; i++) {
+        if (shape[i] == '0' ? (unsigned char)(p[i] - '0') > 9 : 
+            p[i] != shape[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Check a merge output: records (lines starting with a timestamp) in
+ * timestamp order, and as many as expected.  *sum fingerprints the whole
+ * output for comparing scenarios.
+ */
+static const char * check_output (const char *out, size_t expect,
+    u_int64_t *sum) {
+    static char msg[128];
+    struct stat st;
+    const char *base, *p, *end, *prev = NULL;
+    size_t records = 0;
+    u_int64_t h = 0xcbf29ce484222325ULL;
+    int fd = open(out, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        return "FAIL no output";
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        *sum = h;
+        return expect ? "FAIL empty output" : "ok";
+    }
+    base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return "FAIL could not map output";
+    }
+    end = base + st.st_size;
+    for (p = base; p < end; ) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (end - p > TS_LEN && ts_at(p)) {
+            if (prev && memcmp(prev, p, TS_LEN) > 0) {
+                snprintf(msg, sizeof(msg), "FAIL order at byte %zu", 
+                    (size_t)(p - base));
+                munmap((void *)base, st.st_size);
+                return msg;
+            }
+            prev = p;
+            records++;
+        }
+        p = nl ? nl + 1 : end;
+    }
+    for (p = base; p < end; p++) {
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    munmap((void *)base, st.st_size);
+    *sum = h;
+    if (records != expect) {
+        snprintf(msg, sizeof(msg), "FAIL %zu records, expected %zu", 
+            records, expect);
+        return msg;
+    }
+    return "ok";
+}
+
+static void remove_indexes (gen_file_t *files) {
+    char path[4096];
+    int f;
+    for (f = 0; f < num_files; f++) {
+        snprintf(path, sizeof(path), "%s.msidx", files[f].path);
+        unlink(path);
+    }
+}
+
+static int stage_compare (const void *a, const void *b) {
+    const stage_t *x = a, *y = b;
+    return (x->wall_ms > y->wall_ms) - (x->wall_ms < y->wall_ms);
+}
+
+/*
+ * One scenario, repeat times, keeping the run with the median wall time.
+ * A check failure in any run is what gets reported.
+ */
+static void run_scenario (stage_t *st, gen_file_t *files, char **flags,
+    int num_flags, int fresh_index, size_t expect, u_int64_t *sum) {
+    stage_t *runs = calloc(repeat, sizeof(stage_t));
+    const char *check = "ok";
+    char *out;
+    int r;
+
+    if (runs == NULL || asprintf(&out, "%s/%s.out", bench_dir, 
+            st->name) < 0) {
+        printf("could not allocate %s runs\n", st->name);
+        exit(1);
+    }
+    for (r = 0; r < repeat; r++) {
+        runs[r] = *st;
+        if (fresh_index) {
+            remove_indexes(files);
+        }
+        run_msort(&runs[r], files, flags, num_flags, out, NULL);
+        if (strcmp(check, "ok") == 0) {
+            check = check_output(out, expect, sum);
+        }
+    }
+    qsort(runs, repeat, sizeof(stage_t), stage_compare);
+    *st = runs[repeat / 2];
+    st->check = strdup(check);
+    if (!keep) {
+        unlink(out);
+    }
+    free(out);
+    free(runs);
+}
+
+/*
+ * --stats=json of a run against what the generator knows: the records
+ * every stage in expect must report in the totals, (size_t)-1 to skip a
+ * stage.  Each event is counted at one point, so a record counted twice
+ * or not at all shows up here.
+ */
+#define STATS_CHECKED 4
+
+static const char *stats_checked[STATS_CHECKED] = {
+    "scan", "match", "merge", "output"
+};
+
+static void run_stats (stage_t *st, gen_file_t *files, char **flags,
+    int num_flags, const size_t *expect) {
+    static char msg[128];
+    char *out, *err, buf[4096];
+    size_t len;
+    int i;
+    FILE *f;
+
+    if (asprintf(&out, "%s/%s.out", bench_dir, st->name) < 0 ||
+        asprintf(&err, "%s/%s.json", bench_dir, st->name) < 0) {
+        printf("could not allocate %s paths\n", st->name);
+        exit(1);
+    }
+    /* a reused sidecar index would leave nothing to scan */
+    remove_indexes(files);
+    run_msort(st, files, flags, num_flags, out, err);
+    st->check = "ok";
+    f = fopen(err, "r");
+    len = f ? fread(buf, 1, sizeof(buf) - 1, f) : 0;
+    buf[len] = '\0';
+    if (f) {
+        fclose(f);
+    }
+    /* the totals come before the per file stages */
+    char *totals = strstr(buf, "\"stages\": {");
+    char *files_at = totals ? strstr(totals, "\"files\"") : NULL;
+    if (files_at == NULL) {
+        st->check = "FAIL no --stats=json report";
+    }
+    for (i = 0; files_at && i < STATS_CHECKED; i++) {
+        char key[32], *at;
+        unsigned long long records;
+        if (expect[i] == (size_t)-1) {
+            continue;
+        }
+        snprintf(key, sizeof(key), "\"%s\": {", stats_checked[i]);
+        at = strstr(totals, key);
+        at = (at && at < files_at) ? strstr(at, "\"records\": ") : NULL;
+        if (at == NULL || sscanf(at, "\"records\": %llu", &records) != 1) {
+            snprintf(msg, sizeof(msg), "FAIL no %s records", 
+                stats_checked[i]);
+            st->check = msg;
+            break;
+        }
+        if (records != expect[i]) {
+            snprintf(msg, sizeof(msg), "FAIL %s %llu records, expected %zu", 
+                stats_checked[i], records, expect[i]);
+            st->check = msg;
+            break;
+        }
+    }
+    st->check = strdup(st->check);
+    if (!keep) {
+        unlink(out);
+        unlink(err);
+    }
+    free(out);
+    free(err);
+}
+
+static void print_stages (stage_t *stages, int n) {
+    int i;
+    if (json) {
+        printf("{\"files\": %d, \"seed\": %" PRIu64 ", \"stages\": [\n", 
+            num_files, seed);
+        for (i = 0; i < n; i++) {
+            stage_t *st = &stages[i];
+            double secs = st->wall_ms / 1000;
+            printf("  {\"stage\": \"%s\", \"wall_ms\": %.1f, \"user_ms\": %.1f, "
+                "\"sys_ms\": %.1f, \"rss_kb\": %ld, \"bytes\": %zu, "
+                "\"records\": %zu, \"mb_per_s\": %.1f, \"records_per_s\": %.0f, "
+                "\"check\": \"%s\"}%s\n", st->name, st->wall_ms, st->user_ms, 
+                st->sys_ms, st->rss_kb, st->bytes, st->records, 
+                secs > 0 ? st->bytes / 1048576.0 / secs : 0,
+                secs > 0 ? st->records / secs : 0, st->check, 
+                (i + 1 < n) ? "," : "");
+        }
+        printf("]}\n");
+        return;
+    }
+    printf("%-12s %10s %10s %10s %9s %9s %12s  %s\n", "stage", "wall ms", 
+        "user ms", "sys ms", "rss MB", "MB/s", "records/s", "check");
+    for (i = 0; i < n; i++) {
+        stage_t *st = &stages[i];
+        double secs = st->wall_ms / 1000;
+        printf("%-12s %10.1f %10.1f %10.1f %9.1f %9.1f %12.0f  %s\n", 
+            st->name, st->wall_ms, st->user_ms, st->sys_ms, 
+            st->rss_kb / 1024.0, 
+            secs > 0 ? st->bytes / 1048576.0 / secs : 0,
+            secs > 0 ? st->records / secs : 0, st->check);
+    }
+}
+
+int
+main (int argc, char **argv) {
+    char *filter_flags[] = { "-f", BENCH_FILTER_MAC };
+    char *index_flags[] = { "-i" };
+    char *stats_flags[] = { "--stats=json" };
+    char *stats_filter_flags[] = { "--stats=json", "-f", BENCH_FILTER_MAC };
+    stage_t stages[10];
+    gen_file_t *files;
+    size_t total_records = 0, total_hits = 0, total_bytes = 0;
+    u_int64_t merge_sum = 0, sum = 0;
+    int c, f, n = 0, created_dir = 0, failed = 0;
+
+    while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+        {"msort", 1, 0, 'x'},
+        {"dir", 1, 0, 'd'},
+        {"files", 1, 0, 'n'},
+        {"size", 1, 0, 'S'},
+        {"skew", 1, 0, 'k'},
+#ifdef ZLIB_SUPPORTED
+        {"gzip", 1, 0, 'z'},
+#endif
+        {"hit-rate", 1, 0, 'H'},
+        {"seed", 1, 0, 's'},
+        {"repeat", 1, 0, 'r'},
+        {"json", 0, 0, 'j'},
+        {"keep", 0, 0, 'K'},
+        {0, 0, 0, 0}
+    };
+
+    c = getopt_long (argc, argv, "x:d:n:S:k:z:H:s:r:jK",
+             long_options, &option_index);
+    if (c == -1)
+        break;
+
+    switch (c) {
+    case 'x':
+        msort_path = strdup(optarg);
+        break;
+    case 'd':
+        bench_dir = strdup(optarg);
+        break;
+    case 'n':
+        num_files = atoi(optarg);
+        if (num_files < 1 || num_files > BENCH_MAX_FILES) {
+            printf("files must be between 1 and %d\n", BENCH_MAX_FILES);
+            exit(1);
+        }
+        break;
+    case 'S':
+        /* average MB per file */
+        file_mb = strtod(optarg, NULL);
+        if (file_mb <= 0) {
+            printf("size must be positive\n");
+            exit(1);
+        }
+        break;
+    case 'k':
+        /* file sizes spread as 1/(i+1)^skew */
+        size_skew = strtod(optarg, NULL);
+        break;
+#ifdef ZLIB_SUPPORTED
+    case 'z':
+        /* share of the inputs stored gzipped */
+        gzip_share = strtod(optarg, NULL);
+        if (gzip_share < 0 || gzip_share > 1) {
+            printf("gzip share must be between 0 and 1\n");
+            exit(1);
+        }
+        break;
+#endif
+    case 'H':
+        /* share of the UUIDs announced for the filter MAC */
+        hit_rate = strtod(optarg, NULL);
+        if (hit_rate < 0 || hit_rate > 1) {
+            printf("hit rate must be between 0 and 1\n");
+            exit(1);
+        }
+        break;
+    case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+    case 'r':
+        repeat = atoi(optarg);
+        if (repeat < 1) {
+            repeat = 1;
+        }
+        break;
+    case 'j':
+        json = 1;
+        break;
+    case 'K':
+        keep = 1;
+        break;
+    default:
+        printf("usage: %s [-x msort_log] [-d dir] [-n files] [-S MB] "
+            "[-k skew] [-z gzip share] [-H hit rate] [-s seed] [-r repeat] "
+            "[-j] [-K] [-- msort_log args]\n", argv[0]);
+        exit(1);
+    }
+    }
+    while (optind < argc && num_extra_args < BENCH_MAX_ARGS) {
+        extra_args[num_extra_args++] = argv[optind++];
+    }
+
+    rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+    if (bench_dir == NULL) {
+        const char *tmpdir = getenv("TMPDIR");
+        if (asprintf(&bench_dir, "%s/msort_bench.XXXXXX", 
+                (tmpdir && *tmpdir) ? tmpdir : "/tmp") < 0 ||
+            mkdtemp(bench_dir) == NULL) {
+            printf("could not create a bench directory\n");
+            exit(1);
+        }
+        created_dir = 1;
+    }
+
+    memset(stages, 0, sizeof(stages));
+    stages[0].name = "generate";
+    stages[1].name = "gzip";
+    files = generate_inputs(&stages[0], &stages[1]);
+    stages[0].check = stages[1].check = "-";
+    for (f = 0; f < num_files; f++) {
+        total_records += files[f].records;
+        total_hits += files[f].filter_hits;
+        total_bytes += files[f].bytes;
+    }
+    /* no gzip row unless some inputs were compressed */
+    n = (stages[1].bytes > 0) ? 2 : 1;
+
+    stages[n].name = "merge";
+    stages[n].bytes = total_bytes;
+    stages[n].records = total_records;
+    run_scenario(&stages[n], files, NULL, 0, 0, total_records, &merge_sum);
+    n++;
+
+    stages[n].name = "filter";
+    stages[n].bytes = total_bytes;
+    stages[n].records = total_records;
+    run_scenario(&stages[n], files, filter_flags, 2, 0, total_hits, &sum);
+    n++;
+
+    /* every record scanned, merged and written once */
+    stages[n].name = "stats";
+    stages[n].bytes = total_bytes;
+    stages[n].records = total_records;
+    {
+        size_t expect[STATS_CHECKED] = { 
+            total_records, (size_t)-1, total_records, total_records 
+        };
+        run_stats(&stages[n], files, stats_flags, 1, expect);
+    }
+    n++;
+
+    /* a filter matches every record once, the merge depends on the path */
+    stages[n].name = "stats-filter";
+    stages[n].bytes = total_bytes;
+    stages[n].records = total_records;
+    {
+        size_t expect[STATS_CHECKED] = { 
+            total_records, total_records, (size_t)-1, total_hits 
+        };
+        run_stats(&stages[n], files, stats_filter_flags, 3, expect);
+    }
+    n++;
+
+    stages[n].name = "index-build";
+    stages[n].bytes = total_bytes;
+    stages[n].records = total_records;
+    run_scenario(&stages[n], files, index_flags, 1, 1, total_records, &sum);
+    if (strcmp(stages[n].check, "ok") == 0 && sum != merge_sum) {
+        stages[n].check = "FAIL differs from merge";
+    }
+    n++;
+
+    stages[n].name = "index-reuse";
+    stages[n].bytes = total_bytes;
+    stages[n].records = total_records;
+    run_scenario(&stages[n], files, index_flags, 1, 0, total_records, &sum);
+    if (strcmp(stages[n].check, "ok") == 0 && sum != merge_sum) {
+        stages[n].check = "FAIL differs from merge";
+    }
+    n++;
+
+    if (!json) {
+        printf("%d files, %.1f MB, %zu records, %zu filter hits, seed %" 
+            PRIu64 "\n", num_files, total_bytes / 1048576.0, total_records, 
+            total_hits, seed);
+    }
+    print_stages(stages, n);
+
+    for (f = 0; f < n; f++) {
+        failed |= strncmp(stages[f].check, "FAIL", 4) == 0;
+    }
+    if (!keep) {
+        remove_indexes(files);
+        for (f = 0; f < num_files; f++) {
+            unlink(files[f].path);
+        }
+        if (created_dir) {
+            rmdir(bench_dir);
+        }
+    } else if (!json) {
+        printf("inputs kept in %s\n", bench_dir);
+    }
+    return failed ? 2 : 0;
+}
@@ -25,12 +25,27 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #ifdef ZLIB_SUPPORTED
 #include <zlib.h>
 #endif
+#ifdef ZSTD_SUPPORTED
+#include <zstd.h>
+#endif
+#if defined(ZLIB_SUPPORTED) || defined(ZSTD_SUPPORTED)
+#define CODEC_SUPPORTED 1
+#endif
 #include <bsdlib/queue_macros.h>
 
-#include "priv_hash.h"
+#include "log_scan.h"
+#include "log_time.h"
 
 #ifndef STANDALONE
 #include <binos/berror.h>
@@ -47,13 +62,25 @@ typedef int bstatus_t;
 
 /* START_EXPANSION */ 
 
-#define MAX_FILES 8192
+#define MAX_OPEN_FILES 4096
+#define OPEN_FILES_RESERVE 64
 #define MAX_FILENAME_SIZE 256
-#define BASE_SIZE (8L * 1024 * 1024)
-#define GROWTH_SIZE (4L * 1024 * 1024)
+#define OUT_IOV_MAX 1024
+#define OUT_BATCH_SIZE (4L * 1024 * 1024)
+#define OUT_COPY_SIZE (1L * 1024 * 1024)
+#define OUT_PIPE_SIZE (1L * 1024 * 1024)
 #define MAX_COMPRESSION_RATIO 16L
+#define STREAM_CHUNK_SIZE (1L * 1024 * 1024)
 #define TS_LEN 18 /* MM/DD HH:MM:SS.XXX */
 #define UUID_STR_LEN 64
+#define AC_MAX_PATTERNS 64
+#define TS_SEEK_LINEAR (64L * 1024)
+#define FOLLOW_LATENCY_MS 1000
+#define MAX_THREADS 256
+#define SLICES_PER_THREAD 4
+#define SLICE_TARGET_SIZE (64L * 1024 * 1024)
+#define MAX_SLICE_BOUNDS (4L * 1024 * 1024)
+#define SLICE_STAGE_SIZE (1L * 1024 * 1024)
 
 /*
  *
@@ -129,92 +156,346 @@ hash_log2 (u_int32_t v)
 
 
 /*
- * A hash compare function pointer definition
+ * Tournament (loser) tree for the k-way merge
+ *
+ * Every input is a leaf holding the 64 bit key of its next record.  Each
+ * internal node remembers the loser of the match played there and node 0
+ * the overall winner, so replacing the winner's key only replays the
+ * matches on its path to the root: log2(k) integer compares, no calls
+ * through a compare function.  Ties go to the lower leaf, which keeps the
+ * merge order stable across runs and between the sliced and plain merges.
  */
-typedef int (*binheap_compare_t)(void *node_one, void *node_two);
+#define LT_KEY_EOF UINT64_MAX
+
+typedef struct losertree_s {
+    u_int32_t leaves;       /* inputs, rounded up to a power of two */
+    u_int32_t *tree;        /* tree[0] winner, tree[1..leaves-1] losers */
+    u_int64_t *keys;        /* current key per leaf, LT_KEY_EOF when done */
+    void **items;
+} losertree_t;
 
 /*
- * The base type for the binary heap
- *
- * Used to reference any binary heap generically.
- * specific heaps will have correctly sized arrays
+ * UUID set
  *
- * We are allocating bin heaps separate from the 
- * hash table deliberately, since the hash table is
- * used in places where the ordered traversal is not
- * needed.
+ * Open addressing in the style of a Swiss table: a control byte per slot
+ * holds 7 bits of the slot's hash (or UUID_CTRL_EMPTY), and lookups scan
+ * an aligned group of UUID_GROUP control bytes at once, SSE2 when there
+ * is, touching an entry only when its control byte matches.  The full
+ * hash is kept in the entry, so growing never rehashes a key, and the
+ * keys themselves are interned in an arena instead of a malloc each.
+ * Entries move when the table grows; nothing holds on to one across an
+ * insert.  The set only grows, so there are no tombstones.
  */
+#define UUID_GROUP 16
+#define UUID_CTRL_EMPTY 0x80
+#define UUID_SET_MIN (4 * UUID_GROUP)
+#define UUID_ARENA_CHUNK (64 * 1024)
 
-#define VS_HASH_BINHEAP_BASE            \
-    binheap_compare_t compare_fn;       \
-    u_int32_t capacity;                 \
-    u_int32_t size;                     \
-    
-typedef struct binheap_s {
-    VS_HASH_BINHEAP_BASE
-    void *array[MAX_FILES];
-} binheap_t;
+struct uuid_entry_s {
+    u_int64_t hash;
+    const char *uuid;       /* in the arena, not NUL terminated */
+    size_t uuid_len;
+    /* where --prefilter first saw it announced, in merge order */
+    u_int64_t first_key;
+    int first_file;
+    size_t first_rec;
+};
 
-binheap_t filenode_binheap;
+typedef struct uuid_entry_s uuid_entry_t;
 
-struct uuid_entry_s {
-    HASH_ENTRY(uuid_entry_s) uuid_hash_entry;
-                 char uuid[UUID_STR_LEN];
-                 size_t uuid_len;
+struct uuid_set_s {
+    u_int8_t *ctrl;         /* cap control bytes */
+    uuid_entry_t *slots;
+    size_t cap;             /* power of two, multiple of UUID_GROUP */
+    size_t count;
+    char *arena;            /* current key chunk */
+    size_t arena_used;
+    size_t arena_size;
 };
 
-#define uuid_NODE_OFFSET offsetof(struct uuid_entry_s, uuid_hash_entry)
+typedef struct uuid_set_s uuid_set_t;
 
-typedef struct uuid_entry_s uuid_entry_t;
+static uuid_set_t uuid_set;
+
+/* word at a time mix, every input byte reaches every hash bit */
+static inline u_int64_t uuid_hash (const char *p, size_t len) {
+    u_int64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+        p += 8;
+        len -= 8;
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, p, len);
+        h = (h ^ w) * 0x94d049bb133111ebULL;
+        h ^= h >> 29;
+    }
+    h *= 0xd6e8feb86659fd93ULL;
+    return h ^ (h >> 32);
+}
 
-HASHTABLE_STRUCT(uuid_hash , uuid_entry_s)
+#define UUID_H1(h) ((h) >> 7)
+#define UUID_H2(h) ((u_int8_t)((h) & 0x7f))
 
-HASH_HEAD(uuid_hash , uuid_entry_s) uuid_hash_head;
+/* bit i set when ctrl[i] of the group equals c */
+static inline unsigned int uuid_group_match (const u_int8_t *ctrl, u_int8_t c) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_load_si128((const __m128i *)ctrl), _mm_set1_epi8(c)));
+#else
+    unsigned int mask = 0;
+    int i;
+    for (i = 0; i < UUID_GROUP; i++) {
+        mask |= (unsigned int)(ctrl[i] == c) << i;
+    }
+    return mask;
+#endif
+}
 
-HASH_PROTOTYPE(uuid_hash, uuid_entry_s, uuid_hash_entry, uuid_hash_compare, 
-    uuid_hash_internal)
+static void uuid_set_alloc (uuid_set_t *set, size_t cap) {
+    set->ctrl = aligned_alloc(UUID_GROUP, cap);
+    set->slots = malloc(cap * sizeof(uuid_entry_t));
+    if (set->ctrl == NULL || set->slots == NULL) {
+        printf("could not allocate UUID set of %zu slots\n", cap);
+        exit(1);
+    }
+    memset(set->ctrl, UUID_CTRL_EMPTY, cap);
+    set->cap = cap;
+}
 
-static u_int32_t 
-uuid_hash_internal (void *node) {
-    u_int32_t hash = 13;
-    if (node == NULL) return 0;
+/*
+ * Slot for hash: the matching entry if there is one, else the first free
+ * slot on its probe sequence (groups in triangular order, which visits
+ * every group of a power of two table).  With uuid NULL only a free slot
+ * is looked for.
+ */
+static size_t uuid_set_probe (uuid_set_t *set, u_int64_t hash, 
+    const char *uuid, size_t uuid_len, int *found) {
+    size_t groups = set->cap / UUID_GROUP, mask = groups - 1;
+    size_t g = UUID_H1(hash) & mask, step = 0;
+    u_int8_t h2 = UUID_H2(hash);
+    for (;;) {
+        const u_int8_t *ctrl = set->ctrl + g * UUID_GROUP;
+        unsigned int m = uuid ? uuid_group_match(ctrl, h2) : 0;
+        while (m) {
+            size_t i = g * UUID_GROUP + __builtin_ctz(m);
+            uuid_entry_t *e = &set->slots[i];
+            if (e->hash == hash && e->uuid_len == uuid_len && 
+                memcmp(e->uuid, uuid, uuid_len) == 0) {
+                *found = 1;
+                return i;
+            }
+            m &= m - 1;
+        }
+        m = uuid_group_match(ctrl, UUID_CTRL_EMPTY);
+        if (m) {
+            *found = 0;
+            return g * UUID_GROUP + __builtin_ctz(m);
+        }
+        g = (g + ++step) & mask;
+    }
+}
 
-    uuid_entry_t *a = (uuid_entry_t *)((caddr_t *) node - uuid_NODE_OFFSET);
-    hash = HASH_FUNC(a->uuid, a->uuid_len, hash);
-    return hash;
+/* double the table, moving entries by their stored hash */
+static void uuid_set_grow (uuid_set_t *set) {
+    uuid_set_t old = *set;
+    size_t i;
+    int found;
+    uuid_set_alloc(set, old.cap ? 2 * old.cap : UUID_SET_MIN);
+    for (i = 0; i < old.cap; i++) {
+        if (old.ctrl[i] != UUID_CTRL_EMPTY) {
+            uuid_entry_t *e = &old.slots[i];
+            size_t s = uuid_set_probe(set, e->hash, NULL, 0, &found);
+            set->ctrl[s] = UUID_H2(e->hash);
+            set->slots[s] = *e;
+        }
+    }
+    free(old.ctrl);
+    free(old.slots);
 }
 
-static int
-uuid_hash_compare (uuid_entry_t *a, uuid_entry_t *b) {
-    if (a && b) {
-        size_t s = (b->uuid_len < a->uuid_len) ? b->uuid_len : a->uuid_len;
-        return strncmp(a->uuid, b->uuid, s);
+static const char * uuid_arena_intern (uuid_set_t *set, const char *uuid, 
+    size_t uuid_len) {
+    char *p;
+    if (set->arena_used + uuid_len > set->arena_size) {
+        /* the tail of the old chunk is given up, keys are short */
+        set->arena_size = (uuid_len > UUID_ARENA_CHUNK) ? uuid_len 
+            : UUID_ARENA_CHUNK;
+        set->arena = malloc(set->arena_size);
+        set->arena_used = 0;
+        if (set->arena == NULL) {
+            printf("could not allocate UUID arena\n");
+            exit(1);
+        }
     }
-    /* one of a/b or both are NULL */
-    if (a) {
-        return 1;
+    p = set->arena + set->arena_used;
+    memcpy(p, uuid, uuid_len);
+    set->arena_used += uuid_len;
+    return p;
+}
+
+/*
+ * Blocked Bloom filter in front of the UUID set (--bloom)
+ *
+ * Nearly every record of a filtered merge carries a UUID that is not in
+ * the set.  The filter answers most of those from one 64 byte block: the
+ * key's hash picks the block, and k bits inside it by double hashing.  It
+ * is sized for twice the UUIDs in the set and rebuilt from the stored
+ * hashes when the set outgrows it, within --bloom-mem bytes.
+ */
+#define BLOOM_BLOCK_WORDS 8     /* 512 bits, a cache line */
+#define BLOOM_FPR 0.01
+#define BLOOM_MIN_KEYS 1024
+#define BLOOM_MAX_K 16
+#define BLOOM_MAX_MEM (64L * 1024 * 1024)
+
+struct bloom_s {
+    u_int64_t *blocks;      /* nblocks * BLOOM_BLOCK_WORDS */
+    size_t nblocks;         /* power of two */
+    int shift;              /* 64 - log2(nblocks) */
+    int k;
+    size_t capacity;        /* keys it was sized for, 0 before the first */
+};
+
+typedef struct bloom_s bloom_t;
+
+static bloom_t uuid_bloom;
+static double bloom_fpr = 0;                /* 0 without --bloom */
+static size_t bloom_max_mem = BLOOM_MAX_MEM;
+
+static inline u_int64_t * bloom_block (bloom_t *bf, u_int64_t hash) {
+    /* remixed, the set already uses the low bits of hash */
+    u_int64_t x = (hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9ULL;
+    return bf->blocks + (bf->shift < 64 ? (x >> bf->shift) : 0) * 
+        BLOOM_BLOCK_WORDS;
+}
+
+static inline void bloom_add (bloom_t *bf, u_int64_t hash) {
+    u_int64_t *block = bloom_block(bf, hash);
+    u_int32_t a = (u_int32_t)hash, b = (u_int32_t)(hash >> 32) | 1;
+    int i;
+    for (i = 0; i < bf->k; i++, a += b) {
+        block[a >> 29] |= 1ULL << ((a >> 23) & 63);
     }
-    if (b) {
-        return -1;
+}
+
+static inline int bloom_maybe (bloom_t *bf, u_int64_t hash) {
+    const u_int64_t *block = bloom_block(bf, hash);
+    u_int32_t a = (u_int32_t)hash, b = (u_int32_t)(hash >> 32) | 1;
+    int i;
+    for (i = 0; i < bf->k; i++, a += b) {
+        if (!(block[a >> 29] & (1ULL << ((a >> 23) & 63)))) {
+            return 0;
+        }
     }
-    /* both NULL */
-    return 0;
+    return 1;
 }
 
-HASH_GENERATE(uuid_hash, uuid_entry_s, uuid_hash_entry, 
-          uuid_hash_compare, uuid_hash_internal)
+/* size bf for keys at bloom_fpr, as far as bloom_max_mem allows */
+static void bloom_size (bloom_t *bf, size_t keys) {
+    size_t bits_per_key, nblocks = 1, max_blocks;
+    int log2_fpr = 0;
+    double p = bloom_fpr;
+    /* about 1.44 log2(1/p) bits per key, one more for the blocking */
+    while (p < 1 && log2_fpr < 32) {
+        p *= 2;
+        log2_fpr++;
+    }
+    bits_per_key = (log2_fpr * 144 + 99) / 100 + 1;
+    bf->k = (int)((bits_per_key - 1) * 69 / 100);
+    if (bf->k < 1) {
+        bf->k = 1;
+    } else if (bf->k > BLOOM_MAX_K) {
+        bf->k = BLOOM_MAX_K;
+    }
+    max_blocks = bloom_max_mem / (BLOOM_BLOCK_WORDS * sizeof(u_int64_t));
+    while (nblocks * BLOOM_BLOCK_WORDS * 64 < keys * bits_per_key &&
+           nblocks * 2 <= max_blocks) {
+        nblocks *= 2;
+    }
+    free(bf->blocks);
+    bf->blocks = aligned_alloc(BLOOM_BLOCK_WORDS * sizeof(u_int64_t), 
+        nblocks * BLOOM_BLOCK_WORDS * sizeof(u_int64_t));
+    if (bf->blocks == NULL) {
+        printf("could not allocate %zu byte UUID bloom filter\n", 
+            nblocks * BLOOM_BLOCK_WORDS * sizeof(u_int64_t));
+        exit(1);
+    }
+    memset(bf->blocks, 0, nblocks * BLOOM_BLOCK_WORDS * sizeof(u_int64_t));
+    bf->nblocks = nblocks;
+    bf->shift = 64 - hash_log2(nblocks);
+    bf->capacity = keys;
+}
 
 
 struct output_file_state_s {
     char *filename;
     int data_fd;
-    char *base_ptr;
     size_t write_offset;
-    size_t size;
+    size_t size;            /* bytes reserved with fallocate */
 };
 
 typedef struct output_file_state_s output_file_state_t;
 
+/*
+ * Per record tokens kept in the sidecar index, so a filtered re-merge does
+ * not have to scan every record again.  uuid_off is relative to the record
+ * start and is 0 when the record carries no UUID.
+ */
+#define REC_F_APPCTX 0x1
+
+struct rec_token_s {
+    u_int32_t uuid_off;
+    u_int16_t uuid_len;
+    u_int16_t flags;
+};
+
+typedef struct rec_token_s rec_token_t;
+
+/*
+ * Sidecar index layout: this header, then rec_count u64 offsets, rec_count
+ * u64 record keys (ns) and, with MSIDX_F_TOKENS, rec_count rec_token_t.
+ * The index is only trusted while the log's size and mtime still match.
+ */
+#define MSIDX_MAGIC 0x3258444954524f53ULL  /* "SORTIDX2" */
+#define MSIDX_SUFFIX ".msidx"
+#define MSIDX_F_TOKENS 0x1
+
+struct msidx_header_s {
+    u_int64_t magic;
+    u_int64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    u_int64_t data_size;    /* inflated size the offsets refer to */
+    u_int64_t rec_count;
+    u_int64_t flags;
+    u_int64_t time_format;  /* log_time_format_t the keys were parsed as */
+    int64_t utc_offset;     /* and the offset of zone-less times */
+    u_int64_t reserved;
+};
+
+typedef struct msidx_header_s msidx_header_t;
+
+/* stages counted by --stats, see stat_add() */
+#define STAT_INFLATE 0      /* gzip inputs, whole or streamed */
+#define STAT_SCAN 1         /* record boundaries and timestamp keys */
+#define STAT_MATCH 2        /* appctx, UUID, MAC and --grep matching */
+#define STAT_MERGE 3        /* loser tree replays */
+#define STAT_HASH 4         /* UUID set and bloom filter */
+#define STAT_OUTPUT 5       /* writes, and the records and bytes emitted */
+#define STAT_STAGES 6
+
+struct stage_stat_s {
+    u_int64_t cycles;
+    u_int64_t bytes;
+    u_int64_t records;
+};
+
+typedef struct stage_stat_s stage_stat_t;
+
 struct file_state_s {
     char *basename;
     size_t basename_len;
@@ -227,116 +508,237 @@ struct file_state_s {
     char *end_payload;
     size_t written_size;
     size_t size;
+    time_t mtime;
+    log_time_ctx_t tctx;    /* time format and year inference */
+    stage_stat_t stats[STAT_STAGES];    /* --stats counters of this input */
 #ifdef ZLIB_SUPPORTED
     char *zlib_ptr;
     size_t zlib_size;
+    z_stream *zstrm;        /* streaming inflate, base_ptr is the window */
+    size_t zlib_released;   /* compressed bytes already dropped from RSS */
+    size_t scan_offset;     /* where the boundary scan resumes in the window */
+    int stream_end;
 #endif
+    u_int64_t *rec_offsets; /* record start offsets, built by index_file() */
+    u_int64_t *rec_keys;    /* timestamp key (ns) of every record */
+    struct rec_token_s *rec_tokens;
+    size_t rec_count;
+    size_t rec_next;
+    size_t rec_cur;         /* record in start_payload .. end_payload */
+    size_t rec_first;       /* --from/--to window, rec_first .. rec_end-1 */
+    size_t rec_end;
+    char *idx_map;          /* sidecar index mapping backing the arrays */
+    size_t idx_map_size;
+    size_t *sel;            /* records kept by --prefilter, NULL for all */
+    size_t sel_count;
+    struct file_state_s *lru_prev; /* open file pool, see pool_acquire() */
+    struct file_state_s *lru_next;
+    int in_pool;
+    int parked;             /* unmapped and closed, offsets below kept */
+    size_t park_start_ts;
+    size_t park_start_payload;
+    size_t park_end_payload;
     int used;
     int eof;
+    int keyed;              /* a merge run, records lead with their key */
 };
 
 typedef struct file_state_s file_state_t;
 
-static int filenode_binheap_compare (void *node_one, void *node_two) {
-    file_state_t *f1 = node_one;
-    file_state_t *f2 = node_two;
-    int ret;
-    ret = strncmp(f1->start_payload, f2->start_payload, TS_LEN);
-    return ret;
-}
-
-
 static int next_file_state = 0;
-static file_state_t file_states[MAX_FILES];
+static int file_states_cap = 0;
+static file_state_t *file_states = NULL;
 
 /* command line option flags */
 static int addfilename = 0;
 static int emit_line_always = 1;
 static char *mac_address_filter = NULL;
+static int num_threads = 1;
+static size_t stream_chunk_size = 0;
+static int use_index = 0;
+static char *index_dir = NULL;
+static int num_greps = 0;
+static int prefilter = 0;
+static int use_window = 0;
+static int max_open = 0;                    /* inputs mapped at once */
+static int follow_ms = 0;                   /* --follow latency bound */
+static u_int64_t window_from = 0;           /* --from key, inclusive */
+static u_int64_t window_to = UINT64_MAX;    /* --to key, inclusive */
+static char *window_from_str = NULL;
+static char *window_to_str = NULL;
+static log_time_format_t time_format = LOG_TIME_UNKNOWN; /* or detect */
+static int64_t time_utc_offset = 0;
+static int out_codec = 0;                   /* OUT_CODEC_NONE */
+#ifdef CODEC_SUPPORTED
+static int out_level = 0;                   /* compression level */
+#endif
+static int codec_threads = 0;               /* 0: one per CPU */
+static int write_run_keys = 0;              /* output is a merge run */
+
+/*
+ * Instrumentation (--stats)
+ *
+ * Each stage of the merge counts the cycles spent in it (the TSC where
+ * there is one, nanoseconds elsewhere), the bytes it went over and the
+ * records it handled, in total and per input.  Without --stats a stage
+ * pays one predictable branch on stats_mode and never reads the clock.
+ * Totals are kept per thread and folded into stage_totals when a worker
+ * finishes; an input's own counters only ever have one writer at a time,
+ * except for the sliced merge's output, which is added per slice.
+ * Cycles are summed over threads, so stages can add up past the wall time.
+ * Bytes and records count every record once per stage; a stage that sees
+ * records again (merge runs being read back) only adds its cycles.
+ */
+#define STATS_OFF 0
+#define STATS_TABLE 1
+#define STATS_JSON 2
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STAT_CLOCK() __rdtsc()
+#else
+#define STAT_CLOCK() stat_clock_ns()
+#endif
 
-#define BINHEAP_LT(a, b)                        \
-    ((binheap->compare_fn((a), (b)) <= -1 ? 1 : 0))
+static const char *stat_names[STAT_STAGES] = {
+    "inflate", "scan", "match", "merge", "hash", "output"
+};
 
+static int stats_mode = STATS_OFF;
+static int stats_uncounted = 0;     /* stages counting cycles only, a mask */
+static stage_stat_t stage_totals[STAT_STAGES];
+static __thread stage_stat_t stage_local[STAT_STAGES];
+static u_int64_t stats_start_cycles;
+static u_int64_t stats_start_ns;
 
-static void binheap_init(binheap_t *binheap, binheap_compare_t comp_func) {
-    memset(binheap, 0, sizeof(binheap_t));
-    binheap->compare_fn = comp_func;
-    binheap->capacity = MAX_FILES;
+static u_int64_t stat_clock_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static void 
-binheap_sift_down (binheap_t *binheap, 
-           u_int32_t ndx) 
-{
-    u_int32_t child;
-    void *tmp = binheap->array[ndx];
-
-    for( ; ndx * 2 <= binheap->size; ndx = child) {
-    child = ndx * 2;
-        if( child != binheap->size 
-        && BINHEAP_LT(binheap->array[child + 1], 
-              binheap->array[child])) {
-        child++;
-    }
-    if( BINHEAP_LT(binheap->array[child],  tmp)) {
-        binheap->array[ndx] = binheap->array[child];
-    } else {
-        break;
+/* clock reading a stage starts at, 0 when not counting */
+#define STAT_START() (stats_mode ? STAT_CLOCK() : 0)
+
+/* account a stage entered at since (0: counts only) to fs, which may be NULL */
+#define STAT_ADD(fs, stage, since, nbytes, nrecs)                       \
+    do {                                                                \
+        if (stats_mode) {                                               \
+            stat_add((fs), (stage), (since), (nbytes), (nrecs));        \
+        }                                                               \
+    } while (0)
+
+static void stat_add (file_state_t *fs, int stage, u_int64_t since, 
+    u_int64_t bytes, u_int64_t records) {
+    u_int64_t cycles = since ? STAT_CLOCK() - since : 0;
+    if (stats_uncounted & (1 << stage)) {
+        /* the records are counted at another point */
+        bytes = records = 0;
     }
+    stage_local[stage].cycles += cycles;
+    stage_local[stage].bytes += bytes;
+    stage_local[stage].records += records;
+    if (fs) {
+        fs->stats[stage].cycles += cycles;
+        fs->stats[stage].bytes += bytes;
+        fs->stats[stage].records += records;
     }
-
-    binheap->array[ndx] = tmp;
 }
 
-static bstatus_t 
-insert_binheap (binheap_t *binheap, void *item)
-{
-    if ( binheap->size >= binheap->capacity) {
-    return ENOSPC;
+/* fold this thread's counts into the totals, as a worker finishes */
+static void stats_flush_thread (void) {
+    int i;
+    if (!stats_mode) {
+        return;
     }
-
-    /* sift up */
-    int ndx = ++binheap->size;
-    for( ; ndx > 1 
-         && BINHEAP_LT(item , binheap->array[ndx/2]); 
-     ndx /= 2) {
-    binheap->array[ndx] = binheap->array[ndx/2];
+    for (i = 0; i < STAT_STAGES; i++) {
+        __sync_fetch_and_add(&stage_totals[i].cycles, stage_local[i].cycles);
+        __sync_fetch_and_add(&stage_totals[i].bytes, stage_local[i].bytes);
+        __sync_fetch_and_add(&stage_totals[i].records, 
+            stage_local[i].records);
     }
-    binheap->array[ndx] = item;
-    return (EOK);
+    memset(stage_local, 0, sizeof(stage_local));
 }
 
-static bstatus_t 
-pop_binheap (binheap_t *binheap, void **item) 
-{
-    if( binheap->size == 0) {
-    return ENOENT;
+#define LT_LESS(lt, a, b)                                       \
+    ((lt)->keys[(a)] < (lt)->keys[(b)] ||                           \
+     ((lt)->keys[(a)] == (lt)->keys[(b)] && (a) < (b)))
+
+static void losertree_init (losertree_t *lt, u_int32_t n) {
+    u_int32_t i;
+    lt->leaves = hash_pow2_larger(n ? n - 1 : 0);
+    if (lt->leaves < 2) {
+        lt->leaves = 2;
+    }
+    lt->tree = calloc(lt->leaves, sizeof(u_int32_t));
+    lt->keys = malloc(lt->leaves * sizeof(u_int64_t));
+    lt->items = calloc(lt->leaves, sizeof(void *));
+    if (!lt->tree || !lt->keys || !lt->items) {
+        printf("could not allocate merge tree for %u inputs\n", n);
+        exit(1);
+    }
+    for (i = 0; i < lt->leaves; i++) {
+        lt->keys[i] = LT_KEY_EOF;
     }
-    *item = binheap->array[1];
-    binheap->array[1] = binheap->array[binheap->size--];
-    binheap_sift_down( binheap, 1);
-    return (EOK);
 }
 
-static bstatus_t 
-add_array_binheap (binheap_t *binheap, void *item) 
-{
-    if ( binheap->size >= binheap->capacity) {
-    return ENOSPC;
+static void losertree_free (losertree_t *lt) {
+    free(lt->tree);
+    free(lt->keys);
+    free(lt->items);
+}
+
+static inline void losertree_set (losertree_t *lt, u_int32_t leaf, 
+    void *item, u_int64_t key) {
+    lt->items[leaf] = item;
+    lt->keys[leaf] = key;
+}
+
+/* play the whole tournament once all leaves are set */
+static void losertree_build (losertree_t *lt) {
+    u_int32_t *winner = malloc(2 * lt->leaves * sizeof(u_int32_t));
+    u_int32_t node;
+    if (winner == NULL) {
+        printf("could not allocate merge tree\n");
+        exit(1);
     }
-    
-    int ndx = ++binheap->size;
-    binheap->array[ndx] = item;
-    return (EOK);
+    for (node = 0; node < lt->leaves; node++) {
+        winner[lt->leaves + node] = node;
+    }
+    for (node = lt->leaves - 1; node > 0; node--) {
+        u_int32_t l = winner[2 * node], r = winner[2 * node + 1];
+        if (LT_LESS(lt, r, l)) {
+            winner[node] = r;
+            lt->tree[node] = l;
+        } else {
+            winner[node] = l;
+            lt->tree[node] = r;
+        }
+    }
+    lt->tree[0] = winner[1];
+    free(winner);
 }
 
-static void 
-heapify_binheap (binheap_t *binheap) 
-{
-    int i;
-    for( i = binheap->size/2; i > 0; i--) {
-    binheap_sift_down(binheap,  i);
+static inline u_int32_t losertree_winner (losertree_t *lt) {
+    return lt->tree[0];
+}
+
+static inline int losertree_empty (losertree_t *lt) {
+    return lt->keys[lt->tree[0]] == LT_KEY_EOF;
+}
+
+/* give the current winner a new key (LT_KEY_EOF retires it) and replay */
+static inline void losertree_update (losertree_t *lt, u_int64_t key) {
+    u_int32_t winner = lt->tree[0];
+    u_int32_t node = (winner + lt->leaves) >> 1;
+    lt->keys[winner] = key;
+    for (; node > 0; node >>= 1) {
+        u_int32_t loser = lt->tree[node];
+        if (LT_LESS(lt, loser, winner)) {
+            lt->tree[node] = winner;
+            winner = loser;
+        }
     }
+    lt->tree[0] = winner;
 }
 
 static output_file_state_t * open_output_file (char *name) {
@@ -349,58 +751,31 @@ static output_file_state_t * open_output_file (char *name) {
         perror("file open error");
         exit(1);
     }
-    if (ftruncate(fs->data_fd, BASE_SIZE) == 0) {
-        fs->base_ptr = mmap(0, BASE_SIZE,
-                PROT_WRITE, 
-                MAP_SHARED,
-                fs->data_fd, 0);
-        if (fs->base_ptr ==  MAP_FAILED) {
-            printf("mmap of file %s of size %ld failed", fs->filename, 
-                BASE_SIZE);
-            perror("mmap failed");
-            exit(1);
-        }
-    } else {
-        printf("ftruncate failed to initial size\n");
-        perror("ftruncate failed");
-        exit(1);
-    }
-    fs->size = BASE_SIZE;
     fs->write_offset = 0;
     return fs;
 }
 
-static void write_output_file (output_file_state_t *fs, char *data, 
-    size_t size) {
-    if ((fs->base_ptr + fs->write_offset + size) > (fs->base_ptr + fs->size)) {
-    /* grow_output_file */
-        if (ftruncate(fs->data_fd, fs->size + GROWTH_SIZE) == 0) {
-            munmap(fs->base_ptr, fs->size);
-            fs->base_ptr = mmap(0, fs->size + GROWTH_SIZE, PROT_WRITE, 
-                MAP_SHARED, fs->data_fd, 0);
-            if (fs->base_ptr ==  MAP_FAILED) {
-                printf("mmap grow operation failed! - %s", strerror(errno));
-                exit(4);
-            } else {
-                fs->size = fs->size + GROWTH_SIZE;
-            }   
-        } else {
-            printf("ftruncate failed!");
-        }
+/*
+ * Reserve the expected output size up front so the file system can lay
+ * the output out in one go.  Only a hint: a failure (or a file system
+ * without fallocate) just means the blocks are allocated as written.
+ */
+static void presize_output_file (output_file_state_t *fs, size_t size) {
+    if (size > fs->size && fallocate(fs->data_fd, 0, 0, size) == 0) {
+        fs->size = size;
     }
-    memcpy(fs->base_ptr + fs->write_offset, data, size);
-    fs->write_offset = fs->write_offset + size;
 }
 
 static void close_output_file (output_file_state_t *fs) {
-    if ((fs->base_ptr + fs->write_offset) < (fs->base_ptr + fs->size)) {
-        /* our file is longer than needed, unmap and ftruncate to correct size */
+    if (fs->write_offset < fs->size) {
+        /* the reservation was longer than needed, cut it to the data */
         if (ftruncate(fs->data_fd, fs->write_offset) != 0) {
             printf("ftruncate on close failed:");
             exit(5);
         }
     }
-    munmap(fs->base_ptr, fs->size);
+    close(fs->data_fd);
+    free(fs->filename);
     free(fs);
 }   
 
@@ -434,23 +809,30 @@ static int zlib_inflate(file_state_t *fs)
             break;
         strm.next_in = fs->zlib_ptr;
 
+        strm.avail_out = fs->size;
+        strm.next_out = fs->base_ptr;
+
         /* run inflate() on input until output buffer not full */
         do {
-            strm.avail_out = fs->size;
-            strm.next_out = fs->base_ptr;
             ret = inflate(&strm, Z_NO_FLUSH);
             assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
             switch (ret) {
             case Z_NEED_DICT:
-                ret = Z_DATA_ERROR;     /* and fall through */
+                ret = Z_DATA_ERROR;
+                /* fallthrough */
             case Z_DATA_ERROR:
             case Z_MEM_ERROR:
                 (void)inflateEnd(&strm);
                 return ret;
-        default:
-        return ret;
+            default:
+                break;
             }
             fs->written_size = fs->size - strm.avail_out;       
+            if (strm.avail_out == 0 && ret != Z_STREAM_END) {
+                /* more data than the buffer, do not wrap around over it */
+                (void)inflateEnd(&strm);
+                return Z_BUF_ERROR;
+            }
         } while (strm.avail_out == 0);
 
         /* done when inflate() says it's done */
@@ -484,6 +866,9 @@ static void zerr(int ret)
     case Z_VERSION_ERROR:
         fputs("zlib version mismatch!\n", stderr);
     break;
+    case Z_BUF_ERROR:
+        fputs("inflated data too large, try --stream\n", stderr);
+    break;
     default:
     fputs("unknown error!\n", stderr);
     break;
@@ -491,6 +876,149 @@ static void zerr(int ret)
 }
 #endif
 
+#ifdef ZLIB_SUPPORTED
+static char * record_matcher (file_state_t *fs, char *start, size_t size, 
+    int *matched);
+
+/*
+ * Streaming inflate
+ *
+ * Rather than inflating a whole .gz input up front, base_ptr is a small
+ * heap window that holds the record currently in the merge plus whatever
+ * has been inflated after it.  When the boundary scan runs off the end of
+ * the window, the current record is slid to the front and the next chunk
+ * is inflated behind it.  The window only grows for a record that does
+ * not fit, so memory is bounded by the open files times the chunk size.
+ */
+static void stream_open (file_state_t *fs) {
+    fs->zstrm = calloc(1, sizeof(z_stream));
+    if (fs->zstrm == NULL) {
+        printf("could not allocate inflate state for %s\n", fs->filename);
+        exit(1);
+    }
+    int ze = inflateInit2(fs->zstrm, 16+15);
+    if (ze != Z_OK) {
+        zerr(ze);
+        exit(1);
+    }
+    fs->zstrm->next_in = (Bytef *)fs->zlib_ptr;
+    fs->zstrm->avail_in = fs->zlib_size;
+    madvise(fs->zlib_ptr, fs->zlib_size, MADV_SEQUENTIAL);
+    fs->size = 2 * stream_chunk_size;
+    fs->base_ptr = malloc(fs->size);
+    if (fs->base_ptr == NULL) {
+        printf("could not allocate stream window for %s\n", fs->filename);
+        exit(1);
+    }
+    fs->written_size = 0;
+    fs->scan_offset = 0;
+    fs->stream_end = 0;
+}
+
+static void stream_fill (file_state_t *fs) {
+    char *keep = fs->start_ts_ptr ? fs->start_ts_ptr 
+        : fs->base_ptr + fs->scan_offset;
+    size_t shift = keep - fs->base_ptr;
+
+    /* slide the record in progress to the front of the window */
+    if (shift) {
+        memmove(fs->base_ptr, keep, fs->written_size - shift);
+        fs->written_size -= shift;
+        fs->scan_offset -= shift;
+        if (fs->start_ts_ptr) {
+            fs->start_ts_ptr -= shift;
+            fs->end_ts_ptr -= shift;
+        }
+    }
+    /* a single record larger than the window, grow it */
+    if (fs->written_size + stream_chunk_size > fs->size) {
+        size_t start_off = fs->start_ts_ptr ? fs->start_ts_ptr - fs->base_ptr : 0;
+        size_t end_off = fs->start_ts_ptr ? fs->end_ts_ptr - fs->base_ptr : 0;
+        fs->size = fs->written_size + stream_chunk_size;
+        fs->base_ptr = realloc(fs->base_ptr, fs->size);
+        if (fs->base_ptr == NULL) {
+            printf("could not grow stream window for %s to %zu\n", 
+                fs->filename, fs->size);
+            exit(1);
+        }
+        if (fs->start_ts_ptr) {
+            fs->start_ts_ptr = fs->base_ptr + start_off;
+            fs->end_ts_ptr = fs->base_ptr + end_off;
+        }
+    }
+    z_stream *strm = fs->zstrm;
+    size_t inflated = fs->written_size;
+    u_int64_t t0 = STAT_START();
+    strm->next_out = (Bytef *)fs->base_ptr + fs->written_size;
+    strm->avail_out = stream_chunk_size;
+    int ret = inflate(strm, Z_NO_FLUSH);
+    switch (ret) {
+    case Z_NEED_DICT:
+        ret = Z_DATA_ERROR;
+        /* fallthrough */
+    case Z_DATA_ERROR:
+    case Z_MEM_ERROR:
+    case Z_STREAM_ERROR:
+        zerr(ret);
+        exit(1);
+    case Z_BUF_ERROR:
+        /* no progress possible, input is truncated */
+        fs->stream_end = 1;
+        break;
+    case Z_STREAM_END:
+        fs->stream_end = 1;
+        break;
+    default:
+        break;
+    }
+    fs->written_size = (char *)strm->next_out - fs->base_ptr;
+    STAT_ADD(fs, STAT_INFLATE, t0, fs->written_size - inflated, 0);
+
+    /* compressed pages already consumed need not stay resident */
+    size_t consumed = ((char *)strm->next_in - fs->zlib_ptr) & 
+        ~((size_t)getpagesize() - 1);
+    if (consumed > fs->zlib_released) {
+        madvise(fs->zlib_ptr + fs->zlib_released, 
+            consumed - fs->zlib_released, MADV_DONTNEED);
+        fs->zlib_released = consumed;
+    }
+}
+
+/*
+ * record_matcher over the stream, inflating more as needed.  The scan
+ * resumes where the previous one gave up, and once the stream has ended a
+ * last pass over the remainder behaves exactly like the mapped case.
+ */
+static char * stream_next_ts (file_state_t *fs, int *matched) {
+    char *cp;
+    size_t from;
+    u_int64_t t0;
+    for (;;) {
+        from = fs->end_ts_ptr ? (size_t)(fs->end_ts_ptr - fs->base_ptr) : 0;
+        if (fs->stream_end) {
+            t0 = STAT_START();
+            cp = record_matcher(fs, fs->base_ptr + from, 
+                fs->written_size - from, matched);
+            STAT_ADD(fs, STAT_SCAN, t0, cp - (fs->base_ptr + from), *matched);
+            return cp;
+        }
+        if (fs->scan_offset < from) {
+            fs->scan_offset = from;
+        }
+        t0 = STAT_START();
+        cp = record_matcher(fs, fs->base_ptr + fs->scan_offset, 
+            fs->written_size - fs->scan_offset, matched);
+        STAT_ADD(fs, STAT_SCAN, t0, 
+            cp - (fs->base_ptr + fs->scan_offset), *matched);
+        if (*matched) {
+            return cp;
+        }
+        fs->scan_offset = cp - fs->base_ptr;
+        stream_fill(fs);
+    }
+}
+#endif
+
 static void open_file (file_state_t *fs) {
     struct stat fbuf;
     fs->data_fd = open(fs->filename, O_RDONLY, 0777);
@@ -504,6 +1032,10 @@ static void open_file (file_state_t *fs) {
         perror("file stat error");
         exit(1);
     }
+    fs->mtime = fbuf.st_mtime;
+    if (fs->tctx.ref_year == 0) {
+        log_time_init(&fs->tctx, time_format, fs->mtime, time_utc_offset);
+    }
     fs->base_ptr = mmap(0, fbuf.st_size,
              PROT_READ, 
              MAP_SHARED,
@@ -518,20 +1050,35 @@ static void open_file (file_state_t *fs) {
     fs->written_size = fs->size;
     /* check if it is a zlib compressed file  */
 #ifdef ZLIB_SUPPORTED
-    if ((*fs->base_ptr == 0x1f) && (*((unsigned char *)fs->base_ptr + 1) 
+    if ((fs->base_ptr != MAP_FAILED) && (fs->size >= 2) &&
+        (*fs->base_ptr == 0x1f) && (*((unsigned char *)fs->base_ptr + 1) 
         == 0x8b)) {
     fs->zlib_ptr = fs->base_ptr;
     fs->zlib_size = fs->size;
-    fs->base_ptr = mmap(0, fs->size * MAX_COMPRESSION_RATIO, PROT_WRITE, 
+    if (stream_chunk_size) {
+        stream_open(fs);
+        return;
+    }
+    /* the gzip trailer has the inflated size (mod 4G) of the last member */
+    size_t out_size = fs->size * MAX_COMPRESSION_RATIO;
+    const unsigned char *tr = (unsigned char *)fs->zlib_ptr + fs->zlib_size - 4;
+    size_t isize = fs->zlib_size >= 18 ? 
+        (tr[0] | (tr[1] << 8) | (tr[2] << 16) | ((size_t)tr[3] << 24)) : 0;
+    if (isize + 1 > out_size) {
+        out_size = isize + 1;
+    }
+    fs->base_ptr = mmap(0, out_size, PROT_WRITE, 
                 MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
     if (fs->base_ptr == MAP_FAILED) {
         printf("mmap of uncompressed buffer %s of size %ld failed", 
-           fs->filename, fs->size * MAX_COMPRESSION_RATIO);
+           fs->filename, out_size);
         perror("mmap failed");
         exit(1);
     }
-    fs->size = fs->size * MAX_COMPRESSION_RATIO;
+    fs->size = out_size;
+    u_int64_t t0 = STAT_START();
     int ze = zlib_inflate(fs);
+    STAT_ADD(fs, STAT_INFLATE, t0, fs->written_size, 0);
     if (ze != 0) {
         zerr(ze);
         exit(1);
@@ -541,219 +1088,332 @@ static void open_file (file_state_t *fs) {
 }
 
 static void close_file (file_state_t *fs) {
-    munmap(fs->base_ptr, fs->size);
+#ifdef ZLIB_SUPPORTED
+    if (fs->zlib_ptr) {
+        munmap(fs->zlib_ptr, fs->zlib_size);
+        fs->zlib_ptr = NULL;
+    }
+    if (fs->zstrm) {
+        inflateEnd(fs->zstrm);
+        free(fs->zstrm);
+        fs->zstrm = NULL;
+        free(fs->base_ptr);
+        fs->base_ptr = NULL;
+    }
+#endif
+    if (fs->base_ptr) {
+        munmap(fs->base_ptr, fs->size);
+    }
     fs->base_ptr = NULL;
     fs->size = 0;
     close(fs->data_fd);
     fs->data_fd = 0;
     fs->used = 0;
     free(fs->basename);
+    if (fs->idx_map) {
+        munmap(fs->idx_map, fs->idx_map_size);
+        fs->idx_map = NULL;
+    } else {
+        free(fs->rec_offsets);
+        free(fs->rec_keys);
+        free(fs->rec_tokens);
+    }
+    fs->rec_offsets = NULL;
+    fs->rec_keys = NULL;
+    fs->rec_tokens = NULL;
+    free(fs->sel);
+    fs->sel = NULL;
 }
 
 /*
- * Find the needle in the haystack routine, implemented from CLRS - KMP
+ * Multi-pattern matcher (Aho-Corasick)
+ *
+ * All needles a record may be checked for ("(appctx):", "UUID: ", the
+ * --filter MAC and every --grep string) are compiled once into a DFA with
+ * the failure links folded into a full 256 entry transition row per state.
+ * One pass over a payload is then a table lookup per byte and reports which
+ * needles occur and where each first starts.
  */
+struct ac_automaton_s {
+    int32_t (*next)[256];
+    u_int64_t *out;         /* needles ending in each state */
+    size_t pat_len[AC_MAX_PATTERNS];
+    int num_states;
+    int cap_states;
+    int num_patterns;
+};
 
-static char * KMP (char* needle, size_t nsize, char* haystack, size_t hsize, 
-    int* matched) {
-    *matched = 0;
-    char *cp = haystack;
-    if (!nsize) {
-        *matched = 1;
-        return cp;
-    } else if (nsize > hsize) {
-        return cp;
-    }
-    size_t i = 0;
-    int pi[nsize];
-    pi[0] = 0;
-    size_t q = 0;
-    int k = 0;
-    for (i = 1; i < nsize; i++) {
-        while (k > 0 && needle[k] != needle[i]) {
-            k = pi[k-1];
-        }
-        if (needle[k] == needle[i]) {
-            k = k + 1;
+typedef struct ac_automaton_s ac_automaton_t;
+
+#define AC_PAT_APPCTX 0
+#define AC_PAT_UUID 1
+#define AC_PAT_MAC 2       /* first spelling of the --filter MAC */
+#define AC_BIT(p) (1ULL << (p))
+#define AC_MAC_BITS (AC_BIT(ac_grep_first) - AC_BIT(AC_PAT_MAC))
+#define AC_GREP_BITS (~(AC_BIT(ac_grep_first) - 1))
+
+static ac_automaton_t record_ac;
+static int ac_grep_first = AC_PAT_MAC;     /* first --grep string */
+static char *grep_strings[AC_MAX_PATTERNS];
+
+static int ac_new_state (ac_automaton_t *ac) {
+    if (ac->num_states == ac->cap_states) {
+        ac->cap_states = ac->cap_states ? 2 * ac->cap_states : 64;
+        ac->next = realloc(ac->next, ac->cap_states * sizeof(*ac->next));
+        ac->out = realloc(ac->out, ac->cap_states * sizeof(u_int64_t));
+        if (ac->next == NULL || ac->out == NULL) {
+            printf("could not grow pattern matcher\n");
+            exit(1);
         }
-        pi[i] = k;
     }
-    for (i = 0; i < hsize; i++) {
-        while (q > 0 && needle[q] != haystack[i]) {
-            q = pi[q-1];
+    memset(ac->next[ac->num_states], 0xff, sizeof(ac->next[0]));
+    ac->out[ac->num_states] = 0;
+    return ac->num_states++;
+}
+
+static int ac_add (ac_automaton_t *ac, const char *pat, size_t len) {
+    int st, i;
+    if (ac->num_patterns == AC_MAX_PATTERNS || len == 0) {
+        printf("too many or empty match patterns\n");
+        exit(1);
+    }
+    if (ac->num_states == 0) {
+        ac_new_state(ac);
+    }
+    for (st = 0, i = 0; i < (int)len; i++) {
+        unsigned char c = pat[i];
+        if (ac->next[st][c] < 0) {
+            int n = ac_new_state(ac);
+            ac->next[st][c] = n;
         }
-        if (needle[q] == haystack[i]) {
-            q = q + 1;
+        st = ac->next[st][c];
+    }
+    ac->out[st] |= AC_BIT(ac->num_patterns);
+    ac->pat_len[ac->num_patterns] = len;
+    return ac->num_patterns++;
+}
+
+/* breadth first over the trie, filling in failure transitions */
+static void ac_compile (ac_automaton_t *ac) {
+    int32_t *fail = calloc(ac->num_states, sizeof(int32_t));
+    int32_t *queue = malloc(ac->num_states * sizeof(int32_t));
+    int head = 0, tail = 0, c;
+    if (fail == NULL || queue == NULL) {
+        printf("could not compile pattern matcher\n");
+        exit(1);
+    }
+    for (c = 0; c < 256; c++) {
+        if (ac->next[0][c] < 0) {
+            ac->next[0][c] = 0;
+        } else {
+            queue[tail++] = ac->next[0][c];
         }
-        if (q == nsize) {
-            *matched = 1;
-            return (cp + i - nsize + 1);
+    }
+    while (head < tail) {
+        int st = queue[head++];
+        for (c = 0; c < 256; c++) {
+            int child = ac->next[st][c];
+            if (child < 0) {
+                ac->next[st][c] = ac->next[fail[st]][c];
+            } else {
+                fail[child] = ac->next[fail[st]][c];
+                ac->out[child] |= ac->out[fail[child]];
+                queue[tail++] = child;
+            }
         }
     }
-    return cp;
+    free(queue);
+    free(fail);
 }
 
-static char * uuid_val_matcher (char *start, size_t size, size_t *offset) {
-    int matched = 0;
-    char uuid[] = "UUID: ";
-    int uuid_len = 6;
-    char *cp = KMP(uuid, uuid_len, start, size, &matched);
-    if (matched) {
-        cp = cp + uuid_len;
-        *offset = 0;
-        char* ptr = cp;
-        while (*ptr != ',') {
-            ptr++;
-            (*offset)++;
+/*
+ * Run the automaton over text, returning the set of needles seen; first[p]
+ * is where needle p first starts.  Stops once everything in want is seen.
+ */
+static u_int64_t ac_scan (ac_automaton_t *ac, const char *text, size_t len, 
+    u_int64_t want, char **first) {
+    u_int64_t seen = 0;
+    int32_t st = 0;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        st = ac->next[st][(unsigned char)text[i]];
+        u_int64_t hit = ac->out[st] & ~seen;
+        if (hit) {
+            seen |= hit;
+            while (hit) {
+                int p = __builtin_ctzll(hit);
+                first[p] = (char *)text + i + 1 - ac->pat_len[p];
+                hit &= hit - 1;
+            }
+            if ((seen & want) == want) {
+                break;
+            }
         }
-        return cp;
     }
-    return NULL;
+    return seen;
 }
 
-static void appctx_matcher (char *start, size_t size, int *matched) {
-    *matched = 0;
-    char appctx[] = "(appctx):";
-    int appctx_len = 9;
-    KMP(appctx, appctx_len, start, size, matched);
+/* the UUID value runs from after "UUID: " up to the next ',' */
+static char * uuid_value (char *cp, char *end, size_t *offset) {
+    char *ptr = cp;
+    while (ptr < end && *ptr != ',') {
+        ptr++;
+    }
+    *offset = ptr - cp;
+    return cp;
 }
 
 /*
  * Mac address matcher
+ *
+ * The --filter MAC is not matched by a scanner of its own: it is parsed
+ * into octets and its usual spellings go into record_ac as needles, from
+ * AC_PAT_MAC up: colon separated with and without zero padding (the logs
+ * write 0:44:8:15:0:2), dash separated, Cisco dotted and bare, each in
+ * lower and upper case, plus the string as given.  The one ac_scan pass
+ * that finds "(appctx):" and "UUID: " then finds the MAC too, and a hit
+ * only has to be checked for not being part of a longer address.
  */
+#define MAC_SPELLINGS 5
 
-#define IS_VALID_CHAR(s) (( (*s) >= '0' && (*s) <= '9') \
-    || (( (*s) >= 'a' && (*s) <= 'f')) || (( (*s) >= 'A' && (*s) <= 'F')))
-
-/* Match one character portion of a valid sextet */
-static int match_one (const char *s, int last) {
-    if (IS_VALID_CHAR(s)) {
-    s++;
-    if (!last && *s == ':') {
-        return 2;
+/* octets of a MAC in any of the spellings above; 0 if s is not one */
+static int parse_mac (const char *s, unsigned char *oct) {
+    char hex[13];
+    size_t group[6], groups = 0, digits = 0, run = 0, i;
+    for (;; s++) {
+        if (isxdigit((unsigned char)*s)) {
+            if (digits == 12) {
+                return 0;
+            }
+            hex[digits++] = *s;
+            run++;
+            continue;
+        }
+        if (run == 0 || groups == 6 || (*s && *s != ':' && *s != '-' && 
+            *s != '.')) {
+            return 0;
+        }
+        group[groups++] = run;
+        run = 0;
+        if (!*s) {
+            break;
+        }
     }
-    if (last && *s == ' ') {
+    hex[digits] = '\0';
+    if (groups == 6) {
+        /* one or two digits an octet */
+        for (i = 0, s = hex; i < 6; s += group[i], i++) {
+            char octet[3] = { s[0], group[i] == 2 ? s[1] : '\0', '\0' };
+            if (group[i] > 2) {
+                return 0;
+            }
+            oct[i] = strtoul(octet, NULL, 16);
+        }
         return 1;
     }
+    if (digits != 12 || !(groups == 1 || (groups == 3 && group[0] == 4 && 
+        group[1] == 4))) {
+        return 0;
     }
-    return 0;
+    for (i = 0; i < 6; i++) {
+        char octet[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+        oct[i] = strtoul(octet, NULL, 16);
+    }
+    return 1;
 }
 
-/* Match two characters one portion of a valid sextet */
-static int match_two (const char *s, int last) {
-    if (IS_VALID_CHAR(s)) {
-    s++;
-    if (IS_VALID_CHAR(s)) {
-        s++;
-        if (!last && *s == ':') {
-        return 3;
+static void add_mac_needles (ac_automaton_t *ac, const char *mac) {
+    static const char *formats[MAC_SPELLINGS] = {
+        "%02x:%02x:%02x:%02x:%02x:%02x", "%x:%x:%x:%x:%x:%x",
+        "%02x-%02x-%02x-%02x-%02x-%02x", "%02x%02x.%02x%02x.%02x%02x",
+        "%02x%02x%02x%02x%02x%02x",
+    };
+    char spelled[2 * MAC_SPELLINGS + 1][18];
+    unsigned char o[6];
+    int n = 0, i, j, k;
+    if (!parse_mac(mac, o)) {
+        printf("%s is not a MAC address\n", mac);
+        exit(1);
+    }
+    snprintf(spelled[n++], sizeof(spelled[0]), "%s", mac);
+    for (i = 0; i < MAC_SPELLINGS; i++) {
+        snprintf(spelled[n], sizeof(spelled[0]), formats[i], 
+            o[0], o[1], o[2], o[3], o[4], o[5]);
+        for (k = 0; spelled[n][k]; k++) {
+            spelled[n + 1][k] = toupper((unsigned char)spelled[n][k]);
+        }
+        spelled[n + 1][k] = '\0';
+        n += 2;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < i && strcmp(spelled[i], spelled[j]) != 0; j++) {
         }
-        if (last && *s == ' ') {
-        return 2;
+        if (j == i) {
+            ac_add(ac, spelled[i], strlen(spelled[i]));
         }
     }
+}
+
+/* whether the byte at p, beside a MAC found in [lo, hi), extends it */
+static int mac_glued (const char *p, const char *lo, const char *hi, 
+    int dir) {
+    if (p < lo || p >= hi) {
+        return 0;
+    }
+    if (isalnum((unsigned char)*p)) {
+        return 1;
     }
-    return 0;
+    return (*p == ':' || *p == '-' || *p == '.') && p + dir >= lo && 
+        p + dir < hi && isxdigit((unsigned char)p[dir]);
 }
 
-static int 
-merge_strncmp (const char *needle, const char *candidate) {
-    //Attempt complete match on well formed mac
+/* needles in AC_PAT_* order, then the --grep strings */
+static void record_ac_build (void) {
     int i;
-        int a;
-    if (candidate && needle) {
-        a  = strncmp(candidate, needle, strlen(needle));    
-    } else {
-      return 1;
-    }
-    if (!a) {
-    return 0;
-    }
-    //Probably not well formed candidate, make it well formed
-    char norm[18];
-    for (i =0; i < 6; i++) {
-    //candidate mac special casing when last token delimiting character is ' '
-    if (i == 5) {
-        if (*(candidate+1) == ' ') {
-        norm[(3*i)]='0';
-        norm[(3*i)+1]=*candidate;
-        } else {
-        norm[(3*i)] = *candidate;
-        norm[(3*i)+1] = *(candidate+1);
-        norm[(3*i)+2]='\0';
-        }
-        break;
-    }
-    //candidate mac special casing when token delimiting character is ':'
-    if (*(candidate+1) == ':') {
-        norm[(3*i)]='0';
-        norm[(3*i)+1]=*candidate;
-        candidate += 2;
-    } else {
-        norm[(3*i)] = *candidate;
-        norm[(3*i)+1] = *(candidate+1);
-        candidate += 3;
-    }
-    if (i != 5) {
-        norm[(3*i)+2]=':';
-    }
-    }
-    // Attempt full match now
-    a = strncmp(norm, needle, 16);
-    if (!a) {
-    return 0;
-    } else {
-    // no match, keep strcmp semantics
-    return 1;
-    }
-}
-
-static int find_one_or_two_byte_mac (const char *s, int toks_matched, 
-    int *skip, const char *needle) {
-    int last = 0;
-    if (toks_matched == 6) {
-    return 1;
-    }
-    if (toks_matched == 5) {
-    last = 1;
+    ac_add(&record_ac, "(appctx):", 9);
+    ac_add(&record_ac, "UUID: ", 6);
+    if (mac_address_filter) {
+        add_mac_needles(&record_ac, mac_address_filter);
     }
-    if (match_two(s, last)) {
-    *skip += 3;
-    return find_one_or_two_byte_mac(s+3, ++toks_matched, skip, needle);
+    ac_grep_first = record_ac.num_patterns;
+    for (i = 0; i < num_greps; i++) {
+        ac_add(&record_ac, grep_strings[i], strlen(grep_strings[i]));
     }
-    if (match_one(s, last)) {
-    *skip += 2;
-    return find_one_or_two_byte_mac(s+2, ++toks_matched, skip, needle);
-    }
-    return 0;
+    ac_compile(&record_ac);
 }
 
-#define MAX_WORD_LENGTH 256
-
-// If mac, return mac size, else 0
-static int match_mac (const char *start, const char *end, const char *needle) 
-{ 
-    int num = 0;
-    char word[MAX_WORD_LENGTH] = {'\0'};
-    int  i =0;
-    
-    while (start < end-1) {
-        i = 0;
-        while (*start != ' ') {
-            word[i] = *start;
-            i++;start++;
-        }
-        word[i] = ' ';
-        start++;
-        if (find_one_or_two_byte_mac(word, 0, &num, needle)) {
-            if (merge_strncmp(needle, word) != 0) {
-                return 0;
-            } else {
+/*
+ * Whether a --filter MAC spelling occurs in text as a whole address, given
+ * what an ac_scan over text saw and where.  A hit glued to more address
+ * characters (10:44:8:15:0:2 for 0:44:8:15:0:2) is looked past by scanning
+ * on from just after its start for the MAC needles alone, which only
+ * happens for such near misses.
+ */
+static int mac_in_text (const char *text, size_t len, u_int64_t seen, 
+    char **first) {
+    const char *end = text + len;
+    for (;;) {
+        u_int64_t hit = seen & AC_MAC_BITS;
+        const char *restart = end;
+        if (!hit) {
+            return 0;
+        }
+        while (hit) {
+            int p = __builtin_ctzll(hit);
+            const char *at = first[p];
+            if (!mac_glued(at - 1, text, end, -1) && 
+                !mac_glued(at + record_ac.pat_len[p], text, end, 1)) {
                 return 1;
             }
+            if (at + 1 < restart) {
+                restart = at + 1;
+            }
+            hit &= hit - 1;
         }
+        seen = ac_scan(&record_ac, restart, end - restart, AC_MAC_BITS, 
+            first);
+        text = restart;
     }
-    return 0;
 }
 
 #if MACMATCH
@@ -887,272 +1547,2833 @@ static char * match_mac (char *start, char *end, char *needle) {
 
 #endif //end alternate MACMATCH
 
+/*
+ * Find the next record timestamp in [start, start + size).  The scanning
+ * itself is the vectorized log_scan_ts(); when nothing matches, cp is left
+ * TS_LEN short of the end, where the next scan of a growing buffer resumes.
+ */
 static char * date_time_matcher (char *start, size_t size, int *matched) {
-    size_t total_len = size - TS_LEN;
     *matched = 0;
-    char *cp = start;
-    if (size <= 2*TS_LEN) {
+    if (size < LOG_TS_SHAPE_LEN) {
+    return start;
+    }
+    char *cp = (char *)log_scan_ts(start, start + size);
+    if (cp) {
+    *matched = 1;
     return cp;
     }
-    while (total_len > 0) {
-    if (isdigit(*cp)) { /* Month */
-        if (isdigit(*(cp + 1))) {
-        if (*(cp + 2) == '/') {
-            if (isdigit(*(cp + 3))) { /* Day */
-            if (isdigit(*(cp + 4))) {
-                if (*(cp + 5) == ' ') {
-                if (isdigit(*(cp + 6))) { /* Hour */
-                    if (isdigit(*(cp + 7))) {
-                    if (*(cp + 8) == ':') {
-                        if (isdigit(*(cp + 9))) { /*Minute */
-                        if (isdigit(*(cp + 10))) {
-                            if (*(cp + 11) == ':') {
-                            if (isdigit(*(cp + 12))) { /*Second */
-                                if (isdigit(*(cp + 13))) {
-                                if (*(cp + 14) == '.') {
-                                    if (isdigit(*(cp + 15))) { /*microsecond */
-                                    if (isdigit(*(cp + 16))) {
-                                        if (isdigit(*(cp + 17))) {
-                                        if (*(cp + 18) == ' ') { /*space */
-                                            *matched = 1;
-                                            break;
-                                        }
-                                        }
-                                    }
-                                    }
-                                }
-                                }
-                            }
-                            }
-                        }
-                        }
-                    }
-                    }
-                }
-                }
+    return start + size - TS_LEN;
+}
+
+/*
+ * Merge runs lead every record with its key: RUN_KEY_MARK, which text
+ * logs do not contain, and the key in 20 decimal digits.  A run mixes
+ * time formats freely and is read back by key alone.  The original
+ * timestamp follows the key, and output drops the key again.
+ */
+#define RUN_KEY_MARK '\036'           /* ASCII record separator */
+#define RUN_KEY_LEN 21
+
+static void run_key_format (char *buf, u_int64_t key) {
+    int i;
+    buf[0] = RUN_KEY_MARK;
+    for (i = RUN_KEY_LEN - 1; i > 0; i--) {
+        buf[i] = '0' + key % 10;
+        key /= 10;
+    }
+}
+
+/* bytes of a record's key in the input, none outside merge runs */
+static inline size_t run_key_len (file_state_t *fs) {
+    return fs->keyed ? RUN_KEY_LEN : 0;
+}
+
+/*
+ * Find the next record start of fs in [start, start + size).  The first
+ * scan of a file detects its time format, unless --time-format gave one.
+ * Legacy traces keep using date_time_matcher(), which finds a timestamp
+ * anywhere; the other formats start records at a line start.  On a miss
+ * the pointer returned is where the scan of a growing buffer resumes.
+ */
+static char * record_matcher (file_state_t *fs, char *start, size_t size, 
+    int *matched) {
+    const char *cp, *resume;
+    if (fs->keyed) {
+        cp = memchr(start, RUN_KEY_MARK, size);
+        *matched = cp && start + size - cp >= RUN_KEY_LEN;
+        return (char *)(cp ? cp : start + size);
+    }
+    if (fs->tctx.format == LOG_TIME_UNKNOWN &&
+        log_time_detect(&fs->tctx, fs->base_ptr, 
+            fs->base_ptr + fs->written_size) == LOG_TIME_UNKNOWN) {
+        *matched = 0;
+        return start;
+    }
+    if (fs->tctx.format == LOG_TIME_LEGACY) {
+        return date_time_matcher(start, size, matched);
+    }
+    cp = log_time_next_line(&fs->tctx, fs->base_ptr, start, start + size, 
+        &resume);
+    *matched = (cp != NULL);
+    return (char *)(cp ? cp : resume);
+}
+
+/* merge key of the record timestamp at ts, nanoseconds since the epoch */
+static inline u_int64_t record_key (file_state_t *fs, const char *ts) {
+    uint64_t ns = 0;
+    int i;
+    if (fs->keyed) {
+        for (i = 1; i < RUN_KEY_LEN; i++) {
+            ns = ns * 10 + (ts[i] - '0');
+        }
+        return ns;
+    }
+    log_time_parse(&fs->tctx, ts, fs->base_ptr + fs->written_size, &ns);
+    return ns;
+}
+
+/*
+ * Bytes of the timestamp at the start of the record rec .. end, where -a
+ * inserts the file name; in a merge run, of the key and the timestamp.
+ * Safe from the slice workers, which share fs.
+ */
+static inline size_t record_ts_len (file_state_t *fs, const char *rec, 
+    const char *end) {
+    log_time_ctx_t ctx;
+    uint64_t ns;
+    size_t len;
+    int f;
+    if (fs->keyed) {
+        /* the key, and the timestamp of whichever format follows it */
+        ctx = fs->tctx;
+        for (f = LOG_TIME_LEGACY; f < LOG_TIME_FORMATS; f++) {
+            ctx.format = (log_time_format_t)f;
+            if ((len = log_time_parse(&ctx, rec + RUN_KEY_LEN, end, &ns))) {
+                return RUN_KEY_LEN + len;
             }
+        }
+        return RUN_KEY_LEN;
+    }
+    if (fs->tctx.format == LOG_TIME_LEGACY) {
+        return TS_LEN;
+    }
+    ctx = fs->tctx;
+    return log_time_parse(&ctx, rec, end, &ns);
+}
+
+/* how far past a record start the scan for the next one may begin */
+static inline size_t record_skip (file_state_t *fs) {
+    if (fs->keyed) {
+        return RUN_KEY_LEN;
+    }
+    return (fs->tctx.format == LOG_TIME_LEGACY) ? TS_LEN : 1;
+}
+
+static int file_is_streamed (file_state_t *fs __UNUSED) {
+#ifdef ZLIB_SUPPORTED
+    return fs->zstrm != NULL;
+#else
+    return 0;
+#endif
+}
+
+static int days_in_month (int year, int mon) {
+    return log_time_days(mon == 12 ? year + 1 : year, mon == 12 ? 1 : mon + 1, 
+        1) - log_time_days(year, mon, 1);
+}
+
+static int clamp_field (int v, int lo, int hi) {
+    return (v < lo) ? lo : (v > hi) ? hi : v;
+}
+
+/*
+ * Parse a --from/--to bound.  Any prefix of a legacy MM/DD HH:MM:SS.XXX
+ * or an ISO-8601 YYYY-MM-DD HH:MM:SS.fffffffff time is accepted.  The
+ * missing digits are filled with '0' for --from and '9' for --to (upper),
+ * and the fields then clamped to the calendar, so "03/10 11:40" covers
+ * the whole minute either way.  Bounds without a year or zone are read
+ * like a record in a file last written at ref.
+ */
+static int ts_bound_parse (const char *str, int upper, time_t ref, 
+    u_int64_t *key) {
+    static const char legacy_shape[] = "00/00 00:00:00.000";
+    static const char iso_shape[] = "0000-00-00 00:00:00.000000000";
+    const char *shape;
+    char ts[sizeof(iso_shape)];
+    size_t i, len = strlen(str), shape_len, frac_len;
+    int iso, year, mon, mday, hour, min, sec;
+    int64_t ns, frac = 0;
+    log_time_ctx_t ctx;
+
+    iso = (len > 2 && LOG_SCAN_IS_DIGIT(str[2]));
+    shape = iso ? iso_shape : legacy_shape;
+    shape_len = strlen(shape);
+    if (len == 0 || len > shape_len) {
+        return 0;
+    }
+    for (i = 0; i < shape_len; i++) {
+        ts[i] = (shape[i] != '0') ? shape[i] : (upper ? '9' : '0');
+        if (i < len) {
+            if (shape[i] == '0' ? !LOG_SCAN_IS_DIGIT(str[i]) : 
+                (str[i] != shape[i] && !(iso && i == 10 && str[i] == 'T'))) {
+                return 0;
             }
+            ts[i] = str[i];
         }
+    }
+    log_time_init(&ctx, LOG_TIME_LEGACY, ref, time_utc_offset);
+    if (iso) {
+        year = LOG_TIME_D2(ts) * 100 + LOG_TIME_D2(ts + 2);
+        mon = clamp_field(LOG_TIME_D2(ts + 5), 1, 12);
+        mday = LOG_TIME_D2(ts + 8);
+        hour = LOG_TIME_D2(ts + 11);
+        min = LOG_TIME_D2(ts + 14);
+        sec = LOG_TIME_D2(ts + 17);
+        frac_len = 9;
+    } else {
+        mon = clamp_field(LOG_TIME_D2(ts), 1, 12);
+        mday = LOG_TIME_D2(ts + 3);
+        hour = LOG_TIME_D2(ts + 6);
+        min = LOG_TIME_D2(ts + 9);
+        sec = LOG_TIME_D2(ts + 12);
+        frac_len = 3;
+        year = (mon * 32 + clamp_field(mday, 1, 31) > 
+            ctx.ref_mon * 32 + ctx.ref_mday + 1) ? ctx.ref_year - 1 
+            : ctx.ref_year;
+    }
+    mday = clamp_field(mday, 1, days_in_month(year, mon));
+    for (i = shape_len - frac_len; i < shape_len; i++) {
+        frac = frac * 10 + LOG_TIME_D(ts[i]);
+    }
+    for (i = frac_len; i < 9; i++) {
+        frac = frac * 10 + (upper ? 9 : 0);
+    }
+    ns = ((log_time_days(year, mon, mday) * 86400 - time_utc_offset) + 
+        clamp_field(hour, 0, 23) * 3600 + clamp_field(min, 0, 59) * 60 + 
+        clamp_field(sec, 0, 59)) * LOG_TIME_NS + frac;
+    *key = ns;
+    return 1;
+}
+
+/* start of record i, or the end of the data for i == rec_count */
+static inline char *
+record_ptr (file_state_t *fs, size_t i) {
+    return (i < fs->rec_count) ? fs->base_ptr + fs->rec_offsets[i]
+        : fs->base_ptr + fs->written_size;
+}
+
+/* first of keys[lo .. hi-1] that is not below key */
+static size_t key_lower_bound (const u_int64_t *keys, size_t lo, size_t hi, 
+    u_int64_t key) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-    cp++;
-    total_len--;
+    return lo;
+}
+
+/* narrow an indexed file to the records inside the --from/--to window */
+static void window_index (file_state_t *fs) {
+    fs->rec_first = 0;
+    fs->rec_end = fs->rec_count;
+    if (!use_window) {
+        return;
+    }
+    fs->rec_first = key_lower_bound(fs->rec_keys, 0, fs->rec_count, 
+        window_from);
+    if (window_to != UINT64_MAX) {
+        fs->rec_end = key_lower_bound(fs->rec_keys, fs->rec_first, 
+            fs->rec_count, window_to + 1);
     }
-    return cp;
 }
 
+/*
+ * Offset in a mapped, unindexed file from which the record scan can start
+ * without missing any record at or after key.  Bisects on byte offsets,
+ * resyncing on the next timestamp after each probe, and leaves the last
+ * TS_SEEK_LINEAR bytes to the normal scan.  Streamed files cannot seek.
+ */
+static size_t ts_seek (file_state_t *fs, u_int64_t key) {
+    size_t lo = 0, hi = fs->written_size;
+    int match;
+    if (file_is_streamed(fs)) {
+        return 0;
+    }
+    while (lo < hi && hi - lo > TS_SEEK_LINEAR) {
+        size_t mid = lo + (hi - lo) / 2;
+        char *p = record_matcher(fs, fs->base_ptr + mid, 
+            fs->written_size - mid, &match);
+        if (!match || p >= fs->base_ptr + hi || record_key(fs, p) >= key) {
+            hi = mid;
+        } else {
+            lo = p - fs->base_ptr + record_skip(fs);
+        }
+    }
+    return lo;
+}
+
+static void window_skip (file_state_t *fs);
+
 /*
  * The initial file offset setting is to skip over parts of the file until the
   first timestamp located 
  */
 static void initial_file_offset (file_state_t *fs) {
     int match = 0;
-    char *start_ts = date_time_matcher(fs->base_ptr, fs->written_size, &match);
+    size_t off = use_window ? ts_seek(fs, window_from) : 0;
+    u_int64_t t0;
+    if (fs->rec_offsets) {
+        /* already indexed, hand out the first record */
+        if (fs->rec_first == fs->rec_end) {
+            fs->eof = 1;
+        } else {
+            fs->start_ts_ptr = fs->base_ptr + fs->rec_offsets[fs->rec_first];
+            fs->end_ts_ptr = fs->start_ts_ptr + record_skip(fs);
+            fs->rec_next = fs->rec_first + 1;
+            fs->rec_cur = fs->rec_first;
+        }
+        fs->start_payload = fs->start_ts_ptr;
+        fs->end_payload = fs->start_ts_ptr;
+        return;
+    }
+    t0 = STAT_START();
+#ifdef ZLIB_SUPPORTED
+    char *start_ts = fs->zstrm ? stream_next_ts(fs, &match) :
+        record_matcher(fs, fs->base_ptr + off, fs->written_size - off, &match);
+#else
+    char *start_ts = record_matcher(fs, fs->base_ptr + off, 
+        fs->written_size - off, &match);
+#endif
+#ifdef ZLIB_SUPPORTED
+    if (!fs->zstrm)
+#endif
+    {
+        /* the streamed scan counts itself */
+        STAT_ADD(fs, STAT_SCAN, t0, start_ts - (fs->base_ptr + off), match);
+    }
     if (match == 0) {
         fs->eof = 1;
     } else {
         fs->start_ts_ptr = start_ts;
-        fs->end_ts_ptr = start_ts + TS_LEN;
+        fs->end_ts_ptr = start_ts + record_skip(fs);
     }
     fs->start_payload = fs->start_ts_ptr;
     fs->end_payload = fs->start_ts_ptr;
+    if (use_window) {
+        window_skip(fs);
+    }
 }
 
 static int next_file_offset (file_state_t *fs) {
     int match = 0;
-    char *start_ts = date_time_matcher(fs->end_ts_ptr, fs->written_size 
+    if (fs->rec_offsets) {
+        fs->start_payload = fs->start_ts_ptr;
+        fs->rec_cur = fs->rec_next - 1;
+        if (fs->rec_next < fs->rec_end) {
+            fs->end_payload = fs->base_ptr + fs->rec_offsets[fs->rec_next++];
+            fs->start_ts_ptr = fs->end_payload;
+            fs->end_ts_ptr = fs->end_payload + record_skip(fs);
+            return 1;
+        }
+        fs->eof = 1;
+        fs->end_payload = record_ptr(fs, fs->rec_end);
+        return 0;
+    }
+    char *start_ts;
+#ifdef ZLIB_SUPPORTED
+    if (fs->zstrm) {
+        /* counts its own scan, apart from the inflate */
+        start_ts = stream_next_ts(fs, &match);
+    } else
+#endif
+    {
+        u_int64_t t0 = STAT_START();
+        start_ts = record_matcher(fs, fs->end_ts_ptr, fs->written_size 
                        - (fs->end_ts_ptr - fs->base_ptr), &match);
+        STAT_ADD(fs, STAT_SCAN, t0, start_ts - fs->end_ts_ptr, match);
+    }
     if (match == 0) {
+        /* last record runs to the end of the file */
         fs->eof = 1;
         fs->start_payload = fs->start_ts_ptr;
-        fs->end_payload = start_ts;
+        fs->end_payload = fs->base_ptr + fs->written_size;
     } else {
         fs->start_payload = fs->start_ts_ptr;
         fs->end_payload = start_ts;
         fs->start_ts_ptr = start_ts;
-        fs->end_ts_ptr = start_ts + TS_LEN;
+        fs->end_ts_ptr = start_ts + record_skip(fs);
     }
     return match;
 }
 
-static void sort_files (file_state_t *states, int num_files, 
-    output_file_state_t *ofs) 
-{
-    int findex = 0;
-    for (findex = 0; findex < num_files; findex++) {
-    open_file(&states[findex]);
-    initial_file_offset(&states[findex]);
-    /* insert the first nodes into the binary heap */
-    if (!states[findex].eof) {
-        if (add_array_binheap (&filenode_binheap, &states[findex]) != EOK) {
-        printf("add to binheap failed\n");
-        }
-    }
-    heapify_binheap (&filenode_binheap);
+/*
+ * Step an unindexed file over the records before --from that ts_seek()
+ * could not rule out (all of them for a streamed file), leaving it as
+ * initial_file_offset() does: an empty record in front of the first one
+ * to merge.  If only the last record of the file is left it stays loaded
+ * with eof set.
+ */
+static void window_skip (file_state_t *fs) {
+    while (!fs->eof && record_key(fs, fs->start_ts_ptr) < window_from) {
+        next_file_offset(fs);
     }
-    int done = 0;
-    file_state_t *next_file = NULL;
-    while (!done) {
-    if (next_file != NULL) {
-        if (next_file->eof != 1) {
-        next_file_offset(next_file);
-        insert_binheap(&filenode_binheap, next_file);
-        } else {
-        /* close the file and cleanup */
-        close_file(next_file);
-        }
+    if (!fs->eof) {
+        fs->start_payload = fs->start_ts_ptr;
+        fs->end_payload = fs->start_ts_ptr;
+    } else if (fs->start_payload != fs->end_payload &&
+               record_key(fs, fs->start_payload) < window_from) {
+        fs->start_payload = fs->end_payload;
     }
-    file_state_t *popped_state;
-    if(pop_binheap(&filenode_binheap, (void **) &popped_state) == EOK) {
-        int emit_line = 0;
-        int appctx_match = 0;
-        if (popped_state->start_payload != popped_state->end_payload) {
-        appctx_matcher(popped_state->start_payload + TS_LEN,
-             popped_state->end_payload - popped_state->start_payload - TS_LEN,
-             &appctx_match);
-        if (appctx_match) {
-            int mac = 
-                match_mac(popped_state->start_payload + TS_LEN, 
-                    popped_state->end_payload, mac_address_filter);
-            if (mac) {
-                size_t uuid_offset = 0;
-                /*printf("ps %p %lx\n", 
-                    popped_state->start_payload + TS_LEN,
-                     popped_state->end_payload
-                   - popped_state->start_payload - TS_LEN); */
-                char *uuid_read = 
-                    uuid_val_matcher(popped_state->start_payload + TS_LEN, 
-                    popped_state->end_payload
-                               - popped_state->start_payload - TS_LEN, 
-                               &uuid_offset);
-                if (uuid_read != NULL) {
-                    uuid_entry_t *uuid = 
-                        (uuid_entry_t*)malloc(sizeof(uuid_entry_t));
-                    memset((void*)uuid, 0, sizeof(uuid_entry_t));
-                    memcpy(uuid->uuid, uuid_read, uuid_offset);
-                    uuid->uuid[uuid_offset] = '\0';
-                    uuid->uuid_len = uuid_offset + 1;
-                   uuid_hash_HASH_INSERT(&uuid_hash_head, uuid);
-                }
-            }
-        }
-        if (HASH_COUNT(&uuid_hash_head) > 0) {
-            size_t uuid_offset = 0;
-            char *uuid_read = 
-                uuid_val_matcher(popped_state->start_payload + TS_LEN, 
-                    popped_state->end_payload
-                               - popped_state->start_payload - TS_LEN, 
-                    &uuid_offset);
-            if (uuid_read != NULL) {
-                char tmp_str[uuid_offset+1];
-                memcpy(tmp_str, uuid_read, uuid_offset);
-                tmp_str[uuid_offset] = '\0';
-                uuid_entry_t uuid;
-                memcpy(uuid.uuid, uuid_read, uuid_offset);
-                uuid.uuid[uuid_offset + 1] = '\0';
-                uuid.uuid_len = uuid_offset + 1;
-                uuid_entry_t *found = 
-                    uuid_hash_HASH_FIND(&uuid_hash_head, &uuid);
-                if (found) {
-                    emit_line = 1;
-                }
+}
+
+static void pwrite_all (int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            printf("output write failed! - %s", strerror(errno));
+            exit(4);
         }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+}
 
-        if (emit_line || emit_line_always) {
-            if (ofs) {
-            write_output_file(ofs, popped_state->start_payload, TS_LEN);
-            if (addfilename) {
-                write_output_file(ofs, popped_state->basename, 
-                          popped_state->basename_len);
-            }
-            write_output_file(ofs, popped_state->start_payload + TS_LEN, 
-                      popped_state->end_payload 
-                      - popped_state->start_payload - TS_LEN);
-            } else {
-            write(1, popped_state->start_payload, TS_LEN);
-            if (addfilename) {
-                write(1, popped_state->basename, 
-                  popped_state->basename_len);
-            }
-            write(1, popped_state->start_payload + TS_LEN,
-                  popped_state->end_payload 
-                  - popped_state->start_payload - TS_LEN);
+static void write_all (int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            printf("output write failed! - %s", strerror(errno));
+            exit(4);
         }
-        }
-        next_file = popped_state;
-    } else {
-        done = 1;
-        break;
-    }
+        buf += n;
+        len -= n;
     }
 }
 
-#if TEST_HASH
+/*
+ * Compressed output (--compress)
+ *
+ * The merged stream is cut into CODEC_BLOCK_SIZE blocks that a pool of
+ * compressor threads turns into independent gzip members (or zstd frames),
+ * pigz style, while the merge goes on producing the next blocks.  The
+ * merge thread writes finished blocks out in order whenever it hands over
+ * a new one, and only waits when CODEC_BLOCKS_PER_THREAD blocks per
+ * compressor are in flight.  Each gzip member carries its own compressed
+ * size in an "MS" extra field, so a reader can hop from member to member
+ * and start inflating at any block, and gunzip still sees one stream.
+ * An empty member ends the output, telling a complete file from a
+ * truncated one.
+ */
+#define OUT_CODEC_NONE 0
+#define OUT_CODEC_GZIP 1
+#define OUT_CODEC_ZSTD 2
+#define CODEC_BLOCK_SIZE (1L * 1024 * 1024)
+#define CODEC_BLOCKS_PER_THREAD 2
+#define GZ_MEMBER_HEADER 20     /* with the 8 byte "MS" extra field */
+#define GZ_MEMBER_TRAILER 8
 
-static boolean uuid_walk_fn(uuid_entry_t *uuid, void *ctx __UNUSED) {
-    printf("walking uuid %s\n", uuid->uuid);
-    return TRUE;
-}
+#define CODEC_FREE 0            /* empty, or being filled by the merge */
+#define CODEC_READY 1           /* handed over, waiting for a compressor */
+#define CODEC_BUSY 2
+#define CODEC_DONE 3            /* compressed, waiting to be written */
 
-#endif
+struct codec_block_s {
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    int state;
+};
 
-int
-main (int argc, char **argv) {
-    int c;
-    output_file_state_t *ofs = NULL;
-    uuid_hash_head.htable = 
-        calloc(1, sizeof(struct uuid_hashht) * HASH_SIZE(256));
-    HASH_INIT(&uuid_hash_head, 256);
+typedef struct codec_block_s codec_block_t;
 
+struct codec_writer_s {
+    int fd;
+    int nthreads;
+    pthread_t tids[MAX_THREADS];
+    codec_block_t *blocks;
+    int nblocks;
+    size_t out_cap;
+    u_int64_t filled;       /* blocks handed over, the next is being filled */
+    u_int64_t taken;        /* blocks a compressor has picked up */
+    u_int64_t flushed;      /* blocks written out */
+    size_t written;         /* compressed bytes written */
+    int closing;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
 
-#if TEST_HASH
-    int i;
+typedef struct codec_writer_s codec_writer_t;
 
+#ifdef ZLIB_SUPPORTED
+static void put_le32 (unsigned char *p, u_int32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
 
-    static char val[200];
+/* one gzip member of the block, deflated raw so the header is ours */
+static void gz_member (z_stream *zs, codec_block_t *b, size_t out_cap) {
+    unsigned char *out = (unsigned char *)b->out;
+    static const unsigned char header[12] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3,     /* deflate, FEXTRA, unix */
+        8, 0                                    /* XLEN */
+    };
+    memcpy(out, header, sizeof(header));
+    out[12] = 'M';
+    out[13] = 'S';
+    out[14] = 4;
+    out[15] = 0;
+    deflateReset(zs);
+    zs->next_in = (Bytef *)b->in;
+    zs->avail_in = b->in_len;
+    zs->next_out = out + GZ_MEMBER_HEADER;
+    zs->avail_out = out_cap - GZ_MEMBER_HEADER - GZ_MEMBER_TRAILER;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        printf("deflate of an output block failed\n");
+        exit(1);
+    }
+    b->out_len = (char *)zs->next_out - b->out + GZ_MEMBER_TRAILER;
+    put_le32(out + 16, b->out_len);
+    put_le32((unsigned char *)zs->next_out, 
+        crc32(0, (Bytef *)b->in, b->in_len));
+    put_le32((unsigned char *)zs->next_out + 4, b->in_len);
+}
+#endif
 
-    for (i = 0; i < 100; i++) {
-    sprintf(val, "UUID: %x", i);
-    uuid_entry_t *uuid = calloc(1, sizeof(uuid));
-    memcpy(uuid->uuid, val, strlen(val));
-    uuid->uuid_len = strlen(val);
-    //printf("uuid insert %p %s %ld\n", uuid, uuid->uuid, uuid->uuid_len);
-    uuid_hash_HASH_INSERT(&uuid_hash_head, uuid);
-    //printf("uuid after insert %p %s %ld\n", uuid, uuid->uuid, uuid->uuid_len);
+static void * codec_worker (void *arg) {
+    codec_writer_t *cw = arg;
+    codec_block_t *b;
+#ifdef ZLIB_SUPPORTED
+    z_stream zs;
+    if (out_codec == OUT_CODEC_GZIP) {
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, out_level, Z_DEFLATED, -15, 8, 
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+            printf("could not set up deflate at level %d\n", out_level);
+            exit(1);
+        }
+    }
+#endif
+#ifdef ZSTD_SUPPORTED
+    ZSTD_CCtx *cctx = NULL;
+    if (out_codec == OUT_CODEC_ZSTD && (cctx = ZSTD_createCCtx()) == NULL) {
+        printf("could not allocate zstd context\n");
+        exit(1);
     }
+#endif
+    for (;;) {
+        pthread_mutex_lock(&cw->lock);
+        while (cw->taken == cw->filled && !cw->closing) {
+            pthread_cond_wait(&cw->cond, &cw->lock);
+        }
+        if (cw->taken == cw->filled) {
+            pthread_mutex_unlock(&cw->lock);
+            break;
+        }
+        b = &cw->blocks[cw->taken++ % cw->nblocks];
+        b->state = CODEC_BUSY;
+        pthread_mutex_unlock(&cw->lock);
 
-    HASH_FOREACH(uuid_entry_s, &uuid_hash_head, 
-         uuid_hash_entry, uuid_walk_fn, NULL);
+        u_int64_t t0 = STAT_START();
+#ifdef ZLIB_SUPPORTED
+        if (out_codec == OUT_CODEC_GZIP) {
+            gz_member(&zs, b, cw->out_cap);
+        }
+#endif
+#ifdef ZSTD_SUPPORTED
+        if (out_codec == OUT_CODEC_ZSTD) {
+            b->out_len = ZSTD_compressCCtx(cctx, b->out, cw->out_cap, 
+                b->in, b->in_len, out_level);
+            if (ZSTD_isError(b->out_len)) {
+                printf("zstd compression of an output block failed: %s\n",
+                    ZSTD_getErrorName(b->out_len));
+                exit(1);
+            }
+        }
+#endif
+        STAT_ADD(NULL, STAT_OUTPUT, t0, 0, 0);
 
+        pthread_mutex_lock(&cw->lock);
+        b->state = CODEC_DONE;
+        pthread_cond_broadcast(&cw->cond);
+        pthread_mutex_unlock(&cw->lock);
+    }
+#ifdef ZLIB_SUPPORTED
+    if (out_codec == OUT_CODEC_GZIP) {
+        deflateEnd(&zs);
+    }
+#endif
+#ifdef ZSTD_SUPPORTED
+    ZSTD_freeCCtx(cctx);
+#endif
+    stats_flush_thread();
+    return NULL;
+}
 
-    uuid_entry_t lkup_uuid;
-    strcpy(lkup_uuid.uuid, "UUID: e");
-    lkup_uuid.uuid_len = strlen(lkup_uuid.uuid);
+static codec_writer_t * codec_open (int fd) {
+    codec_writer_t *cw = calloc(1, sizeof(codec_writer_t));
+    int i;
+    if (cw == NULL) {
+        printf("could not allocate output compressor\n");
+        exit(1);
+    }
+    cw->fd = fd;
+    cw->nthreads = codec_threads;
+    cw->nblocks = cw->nthreads * CODEC_BLOCKS_PER_THREAD + 1;
+#ifdef ZLIB_SUPPORTED
+    if (out_codec == OUT_CODEC_GZIP) {
+        cw->out_cap = compressBound(CODEC_BLOCK_SIZE) + 
+            GZ_MEMBER_HEADER + GZ_MEMBER_TRAILER;
+    }
+#endif
+#ifdef ZSTD_SUPPORTED
+    if (out_codec == OUT_CODEC_ZSTD) {
+        cw->out_cap = ZSTD_compressBound(CODEC_BLOCK_SIZE);
+    }
+#endif
+    cw->blocks = calloc(cw->nblocks, sizeof(codec_block_t));
+    if (cw->blocks == NULL) {
+        printf("could not allocate output blocks\n");
+        exit(1);
+    }
+    for (i = 0; i < cw->nblocks; i++) {
+        cw->blocks[i].in = malloc(CODEC_BLOCK_SIZE);
+        cw->blocks[i].out = malloc(cw->out_cap);
+        if (cw->blocks[i].in == NULL || cw->blocks[i].out == NULL) {
+            printf("could not allocate output blocks\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&cw->lock, NULL);
+    pthread_cond_init(&cw->cond, NULL);
+    for (i = 0; i < cw->nthreads; i++) {
+        if (pthread_create(&cw->tids[i], NULL, codec_worker, cw) != 0) {
+            printf("could not start compressor thread\n");
+            exit(1);
+        }
+    }
+    return cw;
+}
 
-    uuid_entry_t *found = uuid_hash_HASH_FIND(&uuid_hash_head, &lkup_uuid);
-    if (found) {
-    printf("found uuid %s\n", found->uuid);
-    } else {
-        printf("not found\n");
+/*
+ * Write out compressed blocks in order, up to block upto, waiting for the
+ * compressors as needed.  Called with the lock held, by the merge thread
+ * only, which is the one freeing blocks for reuse.
+ */
+static void codec_write_upto (codec_writer_t *cw, u_int64_t upto) {
+    while (cw->flushed < upto) {
+        codec_block_t *b = &cw->blocks[cw->flushed % cw->nblocks];
+        if (b->state != CODEC_DONE) {
+            pthread_cond_wait(&cw->cond, &cw->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&cw->lock);
+        write_all(cw->fd, b->out, b->out_len);
+        pthread_mutex_lock(&cw->lock);
+        cw->written += b->out_len;
+        b->in_len = 0;
+        b->state = CODEC_FREE;
+        cw->flushed++;
     }
+}
 
-    uuid_entry_t lkup_uuid2;
-    strcpy(lkup_uuid2.uuid, "UUID: yy");
-    lkup_uuid2.uuid_len = strlen(lkup_uuid2.uuid);
+/* hand the block being filled to the compressors */
+static void codec_submit (codec_writer_t *cw) {
+    pthread_mutex_lock(&cw->lock);
+    cw->blocks[cw->filled % cw->nblocks].state = CODEC_READY;
+    cw->filled++;
+    pthread_cond_broadcast(&cw->cond);
+    /* whatever is done goes out now, and the next slot must be free */
+    while (cw->flushed < cw->filled && 
+           cw->blocks[cw->flushed % cw->nblocks].state == CODEC_DONE) {
+        codec_write_upto(cw, cw->flushed + 1);
+    }
+    if (cw->filled - cw->flushed == (u_int64_t)cw->nblocks) {
+        codec_write_upto(cw, cw->flushed + 1);
+    }
+    pthread_mutex_unlock(&cw->lock);
+}
 
-    uuid_entry_t *found2 = uuid_hash_HASH_FIND(&uuid_hash_head, &lkup_uuid2);
-    if (found2) {
-    printf("found uuid %s\n", found2->uuid);
-    } else {
-    printf("not found\n");
+static void codec_write (codec_writer_t *cw, const char *data, size_t len) {
+    while (len > 0) {
+        codec_block_t *b = &cw->blocks[cw->filled % cw->nblocks];
+        size_t n = CODEC_BLOCK_SIZE - b->in_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(b->in + b->in_len, data, n);
+        b->in_len += n;
+        data += n;
+        len -= n;
+        if (b->in_len == CODEC_BLOCK_SIZE) {
+            codec_submit(cw);
+        }
     }
+}
 
-    HASH_FOREACH(uuid_entry_s, &uuid_hash_head, 
-         uuid_hash_entry, uuid_walk_fn, NULL);
+/* everything so far out to the file, a partial block as its own member */
+static void codec_sync (codec_writer_t *cw) {
+    if (cw->blocks[cw->filled % cw->nblocks].in_len) {
+        codec_submit(cw);
+    }
+    pthread_mutex_lock(&cw->lock);
+    codec_write_upto(cw, cw->filled);
+    pthread_mutex_unlock(&cw->lock);
+}
 
-#endif
+/* finish the output, returns the compressed bytes written */
+static size_t codec_close (codec_writer_t *cw) {
+    size_t written;
+    int i;
+    codec_sync(cw);
+    if (out_codec == OUT_CODEC_GZIP) {
+        /* the empty end of stream member */
+        codec_submit(cw);
+        codec_sync(cw);
+    }
+    pthread_mutex_lock(&cw->lock);
+    cw->closing = 1;
+    pthread_cond_broadcast(&cw->cond);
+    pthread_mutex_unlock(&cw->lock);
+    for (i = 0; i < cw->nthreads; i++) {
+        pthread_join(cw->tids[i], NULL);
+    }
+    for (i = 0; i < cw->nblocks; i++) {
+        free(cw->blocks[i].in);
+        free(cw->blocks[i].out);
+    }
+    pthread_cond_destroy(&cw->cond);
+    pthread_mutex_destroy(&cw->lock);
+    written = cw->written;
+    free(cw->blocks);
+    free(cw);
+    return written;
+}
+
+/*
+ * Batched output for the single threaded merge.
+ *
+ * Records are not copied: each piece (timestamp, basename, payload) goes
+ * into an iovec pointing at the mapped input, pieces that continue the
+ * previous one are merged into it, and the batch goes out with one writev
+ * once it holds OUT_IOV_MAX pieces or OUT_BATCH_SIZE bytes.  When the
+ * output is a pipe the batch is vmspliced instead, so the pipe references
+ * the page cache pages rather than copying them.  That is only safe for
+ * memory that is never rewritten, so basenames and data from a --stream
+ * window (which is compacted and refilled) are copied into a side buffer,
+ * and after a vmsplice that buffer is handed over to the pipe and a fresh
+ * one mapped for the next batch.
+ */
+struct out_batch_s {
+    int fd;
+    int is_pipe;
+    int iovcnt;
+    size_t pending;
+    size_t written;
+    char *copy;
+    size_t copy_len;
+    codec_writer_t *codec;  /* --compress, the batch goes through it */
+    struct iovec iov[OUT_IOV_MAX];
+};
+
+typedef struct out_batch_s out_batch_t;
+
+static void out_batch_init (out_batch_t *ob, int fd) {
+    struct stat obuf;
+    memset(ob, 0, sizeof(out_batch_t));
+    ob->fd = fd;
+    if (out_codec != OUT_CODEC_NONE) {
+        /* blocks are copied out to the compressors, nothing to splice */
+        ob->codec = codec_open(fd);
+        return;
+    }
+    if (fstat(fd, &obuf) == 0 && S_ISFIFO(obuf.st_mode)) {
+        ob->is_pipe = 1;
+        /* fewer, larger vmsplices; keeps the default size if refused */
+        fcntl(fd, F_SETPIPE_SZ, OUT_PIPE_SIZE);
+    }
+}
+
+static void out_batch_flush (out_batch_t *ob) {
+    struct iovec *iov = ob->iov;
+    int cnt = ob->iovcnt;
+    u_int64_t t0 = STAT_START();
+    if (ob->codec) {
+        for (; cnt > 0; iov++, cnt--) {
+            codec_write(ob->codec, iov->iov_base, iov->iov_len);
+        }
+        ob->written = ob->codec->written;
+    }
+    while (cnt > 0) {
+        ssize_t n;
+        if (ob->is_pipe) {
+            n = vmsplice(ob->fd, iov, cnt, 0);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                /* not a pipe after all, or no vmsplice */
+                ob->is_pipe = 0;
+                continue;
+            }
+        } else {
+            n = writev(ob->fd, iov, cnt);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("output write failed! - %s", strerror(errno));
+            exit(4);
+        }
+        ob->written += n;
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    STAT_ADD(NULL, STAT_OUTPUT, t0, 0, 0);
+    ob->iovcnt = 0;
+    ob->pending = 0;
+    if (ob->is_pipe && ob->copy_len) {
+        /* the pipe may still reference these pages */
+        munmap(ob->copy, OUT_COPY_SIZE);
+        ob->copy = NULL;
+    }
+    ob->copy_len = 0;
+}
+
+/* queue size bytes at data, which must stay untouched until the flush */
+static void out_batch_put (out_batch_t *ob, const char *data, size_t size) {
+    struct iovec *last = ob->iovcnt ? &ob->iov[ob->iovcnt - 1] : NULL;
+    if (size == 0) {
+        return;
+    }
+    if (last && (char *)last->iov_base + last->iov_len == data) {
+        last->iov_len += size;
+    } else {
+        if (ob->iovcnt == OUT_IOV_MAX) {
+            out_batch_flush(ob);
+        }
+        ob->iov[ob->iovcnt].iov_base = (void *)data;
+        ob->iov[ob->iovcnt].iov_len = size;
+        ob->iovcnt++;
+    }
+    ob->pending += size;
+    if (ob->pending >= OUT_BATCH_SIZE) {
+        out_batch_flush(ob);
+    }
+}
+
+/* queue a copy of data, for memory that changes before the next flush */
+static void out_batch_copy (out_batch_t *ob, const char *data, size_t size) {
+    char *dst;
+    /* flush first, the put below must not recycle the buffer under us */
+    if (ob->copy_len + size > OUT_COPY_SIZE || ob->iovcnt == OUT_IOV_MAX) {
+        out_batch_flush(ob);
+        if (size > OUT_COPY_SIZE) {
+            u_int64_t t0 = STAT_START();
+            if (ob->codec) {
+                codec_write(ob->codec, data, size);
+                ob->written = ob->codec->written;
+            } else {
+                write_all(ob->fd, data, size);
+                ob->written += size;
+            }
+            STAT_ADD(NULL, STAT_OUTPUT, t0, 0, 0);
+            return;
+        }
+    }
+    if (ob->copy == NULL) {
+        ob->copy = mmap(0, OUT_COPY_SIZE, PROT_READ|PROT_WRITE, 
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (ob->copy == MAP_FAILED) {
+            printf("could not map output copy buffer\n");
+            exit(1);
+        }
+    }
+    dst = ob->copy + ob->copy_len;
+    memcpy(dst, data, size);
+    ob->copy_len += size;
+    out_batch_put(ob, dst, size);
+}
+
+static void out_batch_free (out_batch_t *ob) {
+    out_batch_flush(ob);
+    if (ob->codec) {
+        ob->written = codec_close(ob->codec);
+        ob->codec = NULL;
+    }
+    if (ob->copy) {
+        munmap(ob->copy, OUT_COPY_SIZE);
+    }
+}
+
+/*
+ * Walk the whole (inflated) file once and remember where every record
+ * starts.  Record boundaries are found exactly the way next_file_offset()
+ * finds them, so an indexed file merges to the same output, but the file
+ * can now be split at any record and searched by timestamp.
+ */
+static void index_file (file_state_t *fs, int with_tokens) {
+    int match = 0;
+    size_t cap = 1024, i;
+    u_int64_t t0 = STAT_START();
+    char *start_ts = record_matcher(fs, fs->base_ptr, fs->written_size, &match);
+    fs->rec_count = 0;
+    fs->rec_next = 0;
+    fs->rec_offsets = malloc(cap * sizeof(u_int64_t));
+    fs->rec_keys = malloc(cap * sizeof(u_int64_t));
+    if (fs->rec_offsets == NULL || fs->rec_keys == NULL) {
+        printf("could not allocate record index for %s\n", fs->filename);
+        exit(1);
+    }
+    while (match) {
+        if (fs->rec_count == cap) {
+            cap *= 2;
+            fs->rec_offsets = realloc(fs->rec_offsets, cap * sizeof(u_int64_t));
+            fs->rec_keys = realloc(fs->rec_keys, cap * sizeof(u_int64_t));
+            if (fs->rec_offsets == NULL || fs->rec_keys == NULL) {
+                printf("could not grow record index for %s\n", fs->filename);
+                exit(1);
+            }
+        }
+        fs->rec_offsets[fs->rec_count] = start_ts - fs->base_ptr;
+        fs->rec_keys[fs->rec_count++] = record_key(fs, start_ts);
+        start_ts = record_matcher(fs, start_ts + record_skip(fs), 
+            fs->written_size - (start_ts + record_skip(fs) - fs->base_ptr), 
+            &match);
+    }
+    STAT_ADD(fs, STAT_SCAN, t0, fs->written_size, fs->rec_count);
+    if (!with_tokens) {
+        return;
+    }
+    t0 = STAT_START();
+    fs->rec_tokens = calloc(fs->rec_count ? fs->rec_count : 1, 
+        sizeof(rec_token_t));
+    if (fs->rec_tokens == NULL) {
+        printf("could not allocate record tokens for %s\n", fs->filename);
+        exit(1);
+    }
+    for (i = 0; i < fs->rec_count; i++) {
+        char *rec = fs->base_ptr + fs->rec_offsets[i];
+        size_t len = ((i + 1 < fs->rec_count) ? fs->rec_offsets[i + 1] 
+            : fs->written_size) - fs->rec_offsets[i];
+        size_t uuid_len = 0, ts_len = record_ts_len(fs, rec, rec + len);
+        char *found[AC_MAX_PATTERNS];
+        u_int64_t seen = ac_scan(&record_ac, rec + ts_len, len - ts_len,
+            AC_BIT(AC_PAT_APPCTX) | AC_BIT(AC_PAT_UUID), found);
+        if (seen & AC_BIT(AC_PAT_UUID)) {
+            char *uuid = uuid_value(found[AC_PAT_UUID] + 
+                record_ac.pat_len[AC_PAT_UUID], rec + len, &uuid_len);
+            if (uuid_len <= UINT16_MAX) {
+                fs->rec_tokens[i].uuid_off = uuid - rec;
+                fs->rec_tokens[i].uuid_len = uuid_len;
+            }
+        }
+        fs->rec_tokens[i].flags = (seen & AC_BIT(AC_PAT_APPCTX)) ? 
+            REC_F_APPCTX : 0;
+    }
+    /* records and bytes count where a filter reads the tokens */
+    STAT_ADD(fs, STAT_MATCH, t0, 0, 0);
+}
+
+/*
+ * Sidecar index files
+ *
+ * <log>.msidx next to the log, or <index_dir>/<name>.<pathhash>.msidx when
+ * a cache directory is given.  A stale or short index is rebuilt, and a
+ * failure to write one only costs the next run a rescan.
+ */
+static char * index_path (file_state_t *fs) {
+    char *path;
+    int n;
+    if (index_dir) {
+        char *full = realpath(fs->filename, NULL);
+        u_int32_t h = HASH_FUNC(full ? full : fs->filename, 
+            strlen(full ? full : fs->filename), 13);
+        n = asprintf(&path, "%s/%s.%08x%s", index_dir, 
+            basename(fs->filename), h, MSIDX_SUFFIX);
+        free(full);
+    } else {
+        n = asprintf(&path, "%s%s", fs->filename, MSIDX_SUFFIX);
+    }
+    return (n < 0) ? NULL : path;
+}
+
+static int load_index (file_state_t *fs, struct stat *log_st, int with_tokens) {
+    char *path = index_path(fs);
+    struct stat ist;
+    msidx_header_t *hdr;
+    size_t need;
+    int fd;
+
+    if (path == NULL) {
+        return 0;
+    }
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &ist) || ist.st_size < (off_t)sizeof(msidx_header_t)) {
+        close(fd);
+        return 0;
+    }
+    hdr = mmap(0, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return 0;
+    }
+    need = sizeof(msidx_header_t) + hdr->rec_count * 2 * sizeof(u_int64_t);
+    if (hdr->flags & MSIDX_F_TOKENS) {
+        need += hdr->rec_count * sizeof(rec_token_t);
+    }
+    if (hdr->magic != MSIDX_MAGIC || 
+        hdr->file_size != (u_int64_t)log_st->st_size ||
+        hdr->mtime_sec != log_st->st_mtim.tv_sec ||
+        hdr->mtime_nsec != log_st->st_mtim.tv_nsec ||
+        hdr->data_size != fs->written_size ||
+        hdr->utc_offset != time_utc_offset ||
+        (time_format != LOG_TIME_UNKNOWN && hdr->time_format != time_format) ||
+        need != (size_t)ist.st_size ||
+        (with_tokens && !(hdr->flags & MSIDX_F_TOKENS))) {
+        munmap(hdr, ist.st_size);
+        return 0;
+    }
+    fs->idx_map = (char *)hdr;
+    fs->idx_map_size = ist.st_size;
+    fs->rec_count = hdr->rec_count;
+    fs->rec_next = 0;
+    fs->rec_offsets = (u_int64_t *)(hdr + 1);
+    fs->rec_keys = fs->rec_offsets + fs->rec_count;
+    fs->rec_tokens = (hdr->flags & MSIDX_F_TOKENS) ? 
+        (rec_token_t *)(fs->rec_keys + fs->rec_count) : NULL;
+    fs->tctx.format = hdr->time_format;
+    return 1;
+}
+
+static void save_index (file_state_t *fs, struct stat *log_st) {
+    char *path = index_path(fs);
+    char *tmp = NULL;
+    msidx_header_t hdr;
+    int fd;
+
+    if (path == NULL || asprintf(&tmp, "%s.%d", path, getpid()) < 0) {
+        free(path);
+        return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MSIDX_MAGIC;
+    hdr.file_size = log_st->st_size;
+    hdr.mtime_sec = log_st->st_mtim.tv_sec;
+    hdr.mtime_nsec = log_st->st_mtim.tv_nsec;
+    hdr.data_size = fs->written_size;
+    hdr.rec_count = fs->rec_count;
+    hdr.flags = fs->rec_tokens ? MSIDX_F_TOKENS : 0;
+    hdr.time_format = fs->tctx.format;
+    hdr.utc_offset = time_utc_offset;
+
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "could not write index %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    off_t off = 0;
+    pwrite_all(fd, (char *)&hdr, sizeof(hdr), off);
+    off += sizeof(hdr);
+    pwrite_all(fd, (char *)fs->rec_offsets, fs->rec_count * sizeof(u_int64_t), off);
+    off += fs->rec_count * sizeof(u_int64_t);
+    pwrite_all(fd, (char *)fs->rec_keys, fs->rec_count * sizeof(u_int64_t), off);
+    off += fs->rec_count * sizeof(u_int64_t);
+    if (fs->rec_tokens) {
+        pwrite_all(fd, (char *)fs->rec_tokens, 
+            fs->rec_count * sizeof(rec_token_t), off);
+    }
+    close(fd);
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "could not install index %s: %s\n", path, 
+            strerror(errno));
+        unlink(tmp);
+    }
+out:
+    free(tmp);
+    free(path);
+}
+
+/*
+ * Give an opened file its record index: from the sidecar when one is
+ * enabled and still valid, otherwise by scanning (and saving the result).
+ * Filtered merges want the per record tokens as well.
+ */
+static void load_or_build_index (file_state_t *fs) {
+    struct stat log_st;
+    int with_tokens = (mac_address_filter != NULL);
+    if (!use_index) {
+        index_file(fs, with_tokens);
+        return;
+    }
+    if (stat(fs->filename, &log_st) != 0) {
+        index_file(fs, with_tokens);
+        return;
+    }
+    if (load_index(fs, &log_st, with_tokens)) {
+        return;
+    }
+    index_file(fs, with_tokens);
+    save_index(fs, &log_st);
+}
+
+static void prepare_index (file_state_t *fs) {
+    load_or_build_index(fs);
+    window_index(fs);
+}
+
+/* records a file contributes to a sliced merge, and the i-th of them */
+static inline size_t merge_count (file_state_t *fs) {
+    return fs->sel ? fs->sel_count : fs->rec_end - fs->rec_first;
+}
+
+static inline size_t merge_rec (file_state_t *fs, size_t i) {
+    return fs->sel ? fs->sel[i] : fs->rec_first + i;
+}
+
+/*
+ * Run fn over every input with a pool of num_threads workers pulling file
+ * indices off a shared counter.
+ */
+typedef void (*file_worker_fn)(file_state_t *states, int findex, void *arg);
+
+struct file_pool_s {
+    file_state_t *states;
+    int num_files;
+    int next;
+    file_worker_fn fn;
+    void *arg;
+};
+
+typedef struct file_pool_s file_pool_t;
+
+static void * file_pool_worker (void *arg) {
+    file_pool_t *pool = arg;
+    int findex;
+    while ((findex = __sync_fetch_and_add(&pool->next, 1)) < pool->num_files) {
+        pool->fn(pool->states, findex, pool->arg);
+    }
+    stats_flush_thread();
+    return NULL;
+}
+
+static void for_each_file_parallel (file_state_t *states, int num_files, 
+    file_worker_fn fn, void *arg) {
+    file_pool_t pool = { states, num_files, 0, fn, arg };
+    int nworkers = (num_threads < num_files) ? num_threads : num_files;
+    pthread_t tids[MAX_THREADS];
+    int i;
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&tids[i], NULL, file_pool_worker, &pool) != 0) {
+            printf("could not start file worker thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+/* Parallel prescan: open, inflate and index every input */
+static void prescan_one (file_state_t *states, int findex, void *arg __UNUSED) {
+    open_file(&states[findex]);
+    prepare_index(&states[findex]);
+}
+
+static void prescan_files (file_state_t *states, int num_files) {
+    for_each_file_parallel(states, num_files, prescan_one, NULL);
+}
+
+/*
+ * Time sliced merge
+ *
+ * The merged time range is cut into slices at sampled timestamps.  Since
+ * every input is ordered, each slice is a contiguous run of records in
+ * every file, and slices can be merged independently and concatenated.
+ * The size of each slice's output is known up front, so when the output
+ * is seekable every worker writes its slice in place with pwrite.  For
+ * pipes the slices are buffered and flushed in order, with workers held
+ * back so no more than a few slices per thread are ever pending.
+ */
+struct slice_cursor_s {
+    file_state_t *fs;
+    size_t next;
+    size_t end;
+    char *start_payload;
+    char *end_payload;
+    size_t out_records;     /* --stats of the slice, added to fs after it */
+    size_t out_bytes;
+};
+
+typedef struct slice_cursor_s slice_cursor_t;
+
+struct slice_s {
+    size_t bytes;
+    off_t out_offset;
+    char *buf;
+    int done;
+};
+
+typedef struct slice_s slice_t;
+
+struct slice_merge_s {
+    file_state_t *states;
+    int num_files;
+    int num_slices;
+    size_t *bounds;     /* [slice][file] first record of each slice */
+    slice_t *slices;
+    int out_fd;
+    int positional;
+    int next_slice;
+    int flushed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef struct slice_merge_s slice_merge_t;
+
+#define SLICE_BOUND(sm, s, f) ((sm)->bounds[(size_t)(s) * (sm)->num_files + (f)])
+
+static int key_compare (const void *a, const void *b) {
+    u_int64_t ka = *(const u_int64_t *)a, kb = *(const u_int64_t *)b;
+    return (ka > kb) - (ka < kb);
+}
+
+/* first merged record in [lo, hi) of fs whose key is not below key */
+static size_t record_lower_bound (file_state_t *fs, size_t lo, size_t hi, 
+    u_int64_t key) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fs->rec_keys[merge_rec(fs, mid)] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void plan_slices (slice_merge_t *sm) {
+    file_state_t *states = sm->states;
+    int nfiles = sm->num_files;
+    size_t total_recs = 0, total_bytes = 0, nsample = 0, stride;
+    int f, s, nslices;
+    u_int64_t *sample;
+
+    for (f = 0; f < nfiles; f++) {
+        total_recs += merge_count(&states[f]);
+        total_bytes += states[f].written_size;
+    }
+    nslices = num_threads * SLICES_PER_THREAD;
+    if (total_bytes / SLICE_TARGET_SIZE > (size_t)nslices) {
+        nslices = total_bytes / SLICE_TARGET_SIZE;
+    }
+    if ((size_t)(nslices + 1) * nfiles > MAX_SLICE_BOUNDS) {
+        nslices = MAX_SLICE_BOUNDS / nfiles - 1;
+    }
+    if (nslices < 1 || total_recs < (size_t)nslices) {
+        nslices = 1;
+    }
+
+    /* sample timestamps evenly from every file to place the cut points */
+    stride = total_recs / ((size_t)nslices * 16) + 1;
+    sample = malloc((total_recs / stride + nfiles) * sizeof(u_int64_t));
+    for (f = 0; f < nfiles; f++) {
+        size_t r;
+        for (r = 0; r < merge_count(&states[f]); r += stride) {
+            sample[nsample++] = states[f].rec_keys[merge_rec(&states[f], r)];
+        }
+    }
+    qsort(sample, nsample, sizeof(u_int64_t), key_compare);
+
+    sm->num_slices = nslices;
+    sm->bounds = malloc((size_t)(nslices + 1) * nfiles * sizeof(size_t));
+    sm->slices = calloc(nslices, sizeof(slice_t));
+    for (f = 0; f < nfiles; f++) {
+        SLICE_BOUND(sm, 0, f) = 0;
+        SLICE_BOUND(sm, nslices, f) = merge_count(&states[f]);
+    }
+    for (s = 1; s < nslices; s++) {
+        u_int64_t cut = sample[(size_t)s * nsample / nslices];
+        for (f = 0; f < nfiles; f++) {
+            SLICE_BOUND(sm, s, f) = record_lower_bound(&states[f], 
+                SLICE_BOUND(sm, s - 1, f), merge_count(&states[f]), cut);
+        }
+    }
+    free(sample);
+
+    /* exact output size of every slice, and where it lands in the output */
+    off_t out_offset = 0;
+    for (s = 0; s < nslices; s++) {
+        size_t bytes = 0;
+        for (f = 0; f < nfiles; f++) {
+            size_t lo = SLICE_BOUND(sm, s, f), hi = SLICE_BOUND(sm, s + 1, f);
+            if (states[f].sel) {
+                size_t i;
+                for (i = lo; i < hi; i++) {
+                    size_t r = states[f].sel[i];
+                    bytes += record_ptr(&states[f], r + 1) - 
+                        record_ptr(&states[f], r);
+                }
+            } else {
+                bytes += record_ptr(&states[f], merge_rec(&states[f], hi)) - 
+                    record_ptr(&states[f], merge_rec(&states[f], lo));
+            }
+            if (addfilename) {
+                bytes += (hi - lo) * states[f].basename_len;
+            }
+            /* keys come off a merge run's records and onto a new run's */
+            bytes -= (hi - lo) * run_key_len(&states[f]);
+            if (write_run_keys) {
+                bytes += (hi - lo) * RUN_KEY_LEN;
+            }
+        }
+        sm->slices[s].bytes = bytes;
+        sm->slices[s].out_offset = out_offset;
+        out_offset += bytes;
+    }
+}
+
+/* staging buffer for one slice, flushed with pwrite in positional mode */
+struct slice_out_s {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;
+    off_t off;
+};
+
+typedef struct slice_out_s slice_out_t;
+
+static void slice_out_put (slice_out_t *out, const char *data, size_t size) {
+    if (out->len + size > out->cap) {
+        pwrite_all(out->fd, out->buf, out->len, out->off);
+        out->off += out->len;
+        out->len = 0;
+        if (size > out->cap) {
+            pwrite_all(out->fd, data, size, out->off);
+            out->off += size;
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, data, size);
+    out->len += size;
+}
+
+static void merge_slice (slice_merge_t *sm, int s, losertree_t *lt, 
+    slice_cursor_t *cursors, char *stage) {
+    slice_t *slice = &sm->slices[s];
+    slice_out_t out;
+    slice_cursor_t *c;
+    int f;
+
+    if (sm->positional) {
+        out.buf = stage;
+        out.cap = SLICE_STAGE_SIZE;
+        out.fd = sm->out_fd;
+        out.off = slice->out_offset;
+    } else {
+        out.buf = slice->buf = malloc(slice->bytes ? slice->bytes : 1);
+        if (slice->buf == NULL) {
+            printf("could not allocate %zu bytes for slice %d\n", 
+                slice->bytes, s);
+            exit(1);
+        }
+        out.cap = slice->bytes;
+        out.fd = -1;
+        out.off = 0;
+    }
+    out.len = 0;
+
+    for (f = 0; f < sm->num_files; f++) {
+        c = &cursors[f];
+        c->fs = &sm->states[f];
+        c->next = SLICE_BOUND(sm, s, f);
+        c->end = SLICE_BOUND(sm, s + 1, f);
+        c->out_records = 0;
+        c->out_bytes = 0;
+        if (c->next < c->end) {
+            size_t r = merge_rec(c->fs, c->next++);
+            c->start_payload = record_ptr(c->fs, r);
+            c->end_payload = record_ptr(c->fs, r + 1);
+            losertree_set(lt, f, c, c->fs->rec_keys[r]);
+        } else {
+            losertree_set(lt, f, c, LT_KEY_EOF);
+        }
+    }
+    losertree_build(lt);
+
+    while (!losertree_empty(lt)) {
+        u_int64_t key = LT_KEY_EOF, t0 = STAT_START();
+        c = lt->items[losertree_winner(lt)];
+        size_t ts_len = record_ts_len(c->fs, c->start_payload, c->end_payload);
+        size_t key_len = run_key_len(c->fs);
+        if (write_run_keys) {
+            char run_key[RUN_KEY_LEN];
+            run_key_format(run_key, lt->keys[losertree_winner(lt)]);
+            slice_out_put(&out, run_key, RUN_KEY_LEN);
+        }
+        slice_out_put(&out, c->start_payload + key_len, ts_len - key_len);
+        if (addfilename) {
+            slice_out_put(&out, c->fs->basename, c->fs->basename_len);
+        }
+        slice_out_put(&out, c->start_payload + ts_len, 
+            c->end_payload - c->start_payload - ts_len);
+        if (stats_mode) {
+            size_t len = c->end_payload - c->start_payload - key_len + 
+                (write_run_keys ? RUN_KEY_LEN : 0) + 
+                (addfilename ? c->fs->basename_len : 0);
+            c->out_records++;
+            c->out_bytes += len;
+            STAT_ADD(NULL, STAT_OUTPUT, t0, len, 1);
+        }
+        if (c->next < c->end) {
+            size_t r = merge_rec(c->fs, c->next++);
+            c->start_payload = record_ptr(c->fs, r);
+            c->end_payload = record_ptr(c->fs, r + 1);
+            key = c->fs->rec_keys[r];
+        }
+        t0 = STAT_START();
+        losertree_update(lt, key);
+        STAT_ADD(NULL, STAT_MERGE, t0, 0, 1);
+    }
+    if (sm->positional && out.len) {
+        u_int64_t t0 = STAT_START();
+        pwrite_all(out.fd, out.buf, out.len, out.off);
+        STAT_ADD(NULL, STAT_OUTPUT, t0, 0, 0);
+    }
+    if (stats_mode) {
+        /* other workers emit records of the same files */
+        for (f = 0; f < sm->num_files; f++) {
+            stage_stat_t *st = &sm->states[f].stats[STAT_OUTPUT];
+            __sync_fetch_and_add(&st->records, cursors[f].out_records);
+            __sync_fetch_and_add(&st->bytes, cursors[f].out_bytes);
+        }
+    }
+}
+
+static void * slice_worker (void *arg) {
+    slice_merge_t *sm = arg;
+    losertree_t lt;
+    slice_cursor_t *cursors = calloc(sm->num_files, sizeof(slice_cursor_t));
+    char *stage = sm->positional ? malloc(SLICE_STAGE_SIZE) : NULL;
+    int s;
+
+    losertree_init(&lt, sm->num_files);
+    if (cursors == NULL || (sm->positional && !stage)) {
+        printf("could not allocate slice merge state\n");
+        exit(1);
+    }
+    for (;;) {
+        pthread_mutex_lock(&sm->lock);
+        while (!sm->positional && sm->next_slice < sm->num_slices &&
+               sm->next_slice >= sm->flushed + num_threads * SLICES_PER_THREAD) {
+            pthread_cond_wait(&sm->cond, &sm->lock);
+        }
+        s = sm->next_slice++;
+        pthread_mutex_unlock(&sm->lock);
+        if (s >= sm->num_slices) {
+            break;
+        }
+        merge_slice(sm, s, &lt, cursors, stage);
+        pthread_mutex_lock(&sm->lock);
+        sm->slices[s].done = 1;
+        pthread_cond_broadcast(&sm->cond);
+        pthread_mutex_unlock(&sm->lock);
+    }
+    free(stage);
+    free(cursors);
+    losertree_free(&lt);
+    stats_flush_thread();
+    return NULL;
+}
+
+static void merge_slices (file_state_t *states, int num_files, 
+    output_file_state_t *ofs) 
+{
+    slice_merge_t sm;
+    pthread_t tids[MAX_THREADS];
+    struct stat obuf;
+    off_t base = 0;
+    int i, s;
+
+    memset(&sm, 0, sizeof(sm));
+    sm.states = states;
+    sm.num_files = num_files;
+    pthread_mutex_init(&sm.lock, NULL);
+    pthread_cond_init(&sm.cond, NULL);
+    plan_slices(&sm);
+
+    size_t total = sm.slices[sm.num_slices - 1].out_offset + 
+        sm.slices[sm.num_slices - 1].bytes;
+    codec_writer_t *codec = NULL;
+    if (out_codec != OUT_CODEC_NONE) {
+        /* compressed sizes are not known up front, slices go out in order */
+        sm.out_fd = ofs ? ofs->data_fd : 1;
+        codec = codec_open(sm.out_fd);
+    } else if (ofs) {
+        sm.out_fd = ofs->data_fd;
+        sm.positional = 1;
+        presize_output_file(ofs, total);
+        if (ftruncate(ofs->data_fd, total) != 0) {
+            printf("ftruncate failed!");
+            exit(5);
+        }
+        ofs->write_offset = total;
+    } else {
+        /* a plain file on stdout can be filled in place as well */
+        sm.out_fd = 1;
+        if (fstat(1, &obuf) == 0 && S_ISREG(obuf.st_mode) && 
+            !(fcntl(1, F_GETFL) & O_APPEND) &&
+            (base = lseek(1, 0, SEEK_CUR)) >= 0) {
+            sm.positional = 1;
+        }
+    }
+    if (base) {
+        for (s = 0; s < sm.num_slices; s++) {
+            sm.slices[s].out_offset += base;
+        }
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&tids[i], NULL, slice_worker, &sm) != 0) {
+            printf("could not start merge thread\n");
+            exit(1);
+        }
+    }
+    if (!sm.positional) {
+        for (s = 0; s < sm.num_slices; s++) {
+            pthread_mutex_lock(&sm.lock);
+            while (!sm.slices[s].done) {
+                pthread_cond_wait(&sm.cond, &sm.lock);
+            }
+            pthread_mutex_unlock(&sm.lock);
+            u_int64_t t0 = STAT_START();
+            if (codec) {
+                codec_write(codec, sm.slices[s].buf, sm.slices[s].bytes);
+            } else {
+                write_all(sm.out_fd, sm.slices[s].buf, sm.slices[s].bytes);
+            }
+            STAT_ADD(NULL, STAT_OUTPUT, t0, 0, 0);
+            free(sm.slices[s].buf);
+            pthread_mutex_lock(&sm.lock);
+            sm.flushed = s + 1;
+            pthread_cond_broadcast(&sm.cond);
+            pthread_mutex_unlock(&sm.lock);
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (codec) {
+        size_t written = codec_close(codec);
+        if (ofs) {
+            ofs->write_offset = written;
+        }
+    }
+    if (sm.positional && !ofs) {
+        lseek(1, base + total, SEEK_SET);
+    }
+
+    for (i = 0; i < num_files; i++) {
+        close_file(&states[i]);
+    }
+    free(sm.slices);
+    free(sm.bounds);
+    pthread_cond_destroy(&sm.cond);
+    pthread_mutex_destroy(&sm.lock);
+}
+
+/* merge key of the record a file will emit next */
+static inline u_int64_t file_key (file_state_t *fs) {
+    return fs->rec_keys ? fs->rec_keys[fs->rec_cur] 
+        : record_key(fs, fs->start_payload);
+}
+
+/* resize the bloom filter for the set as it is now */
+static void uuid_bloom_rebuild (void) {
+    size_t i, keys = 2 * uuid_set.count;
+    bloom_size(&uuid_bloom, keys < BLOOM_MIN_KEYS ? BLOOM_MIN_KEYS : keys);
+    for (i = 0; i < uuid_set.cap; i++) {
+        if (uuid_set.ctrl[i] != UUID_CTRL_EMPTY) {
+            bloom_add(&uuid_bloom, uuid_set.slots[i].hash);
+        }
+    }
+}
+
+static uuid_entry_t * uuid_set_find (char *uuid_read, size_t uuid_offset) {
+    size_t s;
+    int found;
+    u_int64_t hash;
+    if (uuid_offset >= UUID_STR_LEN || uuid_set.count == 0) {
+        return NULL;
+    }
+    hash = uuid_hash(uuid_read, uuid_offset);
+    if (uuid_bloom.capacity && !bloom_maybe(&uuid_bloom, hash)) {
+        return NULL;
+    }
+    s = uuid_set_probe(&uuid_set, hash, uuid_read, uuid_offset, &found);
+    return found ? &uuid_set.slots[s] : NULL;
+}
+
+static int uuid_set_contains (char *uuid_read, size_t uuid_offset) {
+    return uuid_set_find(uuid_read, uuid_offset) != NULL;
+}
+
+static uuid_entry_t * uuid_set_add (char *uuid_read, size_t uuid_offset) {
+    u_int64_t hash;
+    uuid_entry_t *uuid;
+    size_t s;
+    int found;
+    if (uuid_offset >= UUID_STR_LEN) {
+        return NULL;
+    }
+    /* keep the load at 7/8 at most */
+    if ((uuid_set.count + 1) * 8 > uuid_set.cap * 7) {
+        uuid_set_grow(&uuid_set);
+    }
+    hash = uuid_hash(uuid_read, uuid_offset);
+    s = uuid_set_probe(&uuid_set, hash, uuid_read, uuid_offset, &found);
+    uuid = &uuid_set.slots[s];
+    if (found) {
+        return uuid;
+    }
+    memset(uuid, 0, sizeof(uuid_entry_t));
+    uuid->hash = hash;
+    uuid->uuid = uuid_arena_intern(&uuid_set, uuid_read, uuid_offset);
+    uuid->uuid_len = uuid_offset;
+    uuid_set.ctrl[s] = UUID_H2(hash);
+    uuid_set.count++;
+    if (bloom_fpr > 0) {
+        if (uuid_set.count > uuid_bloom.capacity) {
+            uuid_bloom_rebuild();
+        } else {
+            bloom_add(&uuid_bloom, hash);
+        }
+    }
+    return uuid;
+}
+
+/*
+ * Decide whether the record in start_payload .. end_payload is output.
+ * An appctx record naming the --filter MAC adds its UUID to the set, and
+ * from then on records carrying a UUID of the set pass.  --grep strings
+ * further keep only records containing at least one of them.  A single
+ * matcher pass finds every needle; indexed files without --grep take
+ * appctx and UUID from their tokens instead.
+ */
+static int record_wanted (file_state_t *fs) {
+    char *payload = fs->start_payload + 
+        record_ts_len(fs, fs->start_payload, fs->end_payload);
+    char *found[AC_MAX_PATTERNS];
+    u_int64_t seen = 0;
+    char *uuid = NULL;
+    size_t uuid_len = 0;
+    int emit_line = emit_line_always, announce;
+    u_int64_t t0;
+
+    if (!mac_address_filter && !num_greps) {
+        return 1;
+    }
+    t0 = STAT_START();
+    if (fs->rec_tokens && !num_greps) {
+        rec_token_t *tok = &fs->rec_tokens[fs->rec_cur];
+        if ((tok->flags & REC_F_APPCTX) && tok->uuid_off) {
+            /* the MAC is not in the tokens, they outlive one --filter */
+            seen = ac_scan(&record_ac, payload, fs->end_payload - payload,
+                AC_MAC_BITS, found) | AC_BIT(AC_PAT_APPCTX);
+        }
+        if (tok->uuid_off) {
+            uuid = fs->start_payload + tok->uuid_off;
+            uuid_len = tok->uuid_len;
+        }
+    } else {
+        seen = ac_scan(&record_ac, payload, fs->end_payload - payload, 
+            ~0ULL >> (64 - record_ac.num_patterns), found);
+        if (seen & AC_BIT(AC_PAT_UUID)) {
+            uuid = uuid_value(found[AC_PAT_UUID] + 
+                record_ac.pat_len[AC_PAT_UUID], fs->end_payload, &uuid_len);
+        }
+    }
+    if (mac_address_filter && uuid) {
+        announce = (seen & AC_BIT(AC_PAT_APPCTX)) && 
+            mac_in_text(payload, fs->end_payload - payload, seen, found);
+        STAT_ADD(fs, STAT_MATCH, t0, fs->end_payload - payload, 1);
+        t0 = STAT_START();
+        if (announce) {
+            uuid_set_add(uuid, uuid_len);
+        }
+        if (uuid_set_contains(uuid, uuid_len)) {
+            emit_line = 1;
+        }
+        STAT_ADD(fs, STAT_HASH, t0, uuid_len, 1);
+    } else {
+        STAT_ADD(fs, STAT_MATCH, t0, fs->end_payload - payload, 1);
+    }
+    if (num_greps && !(seen & AC_GREP_BITS)) {
+        emit_line = 0;
+    }
+    return emit_line;
+}
+
+/*
+ * Filter-first merge (--prefilter)
+ *
+ * Phase 1 scans every input in parallel for appctx records naming the
+ * --filter MAC and collects their UUIDs, remembering for each UUID the
+ * earliest point in merge order (key, file, record) where it was announced.
+ * Phase 2 gives every file the list of records it will actually output:
+ * those whose UUID was announced at or before them, which is exactly what
+ * the in-merge filter lets through, and that hold a --grep string if any
+ * were given.  Only those records reach the merge, and since nothing then
+ * depends on merge order it runs sliced like an unfiltered one.
+ */
+struct uuid_seen_s {
+    char *uuid;
+    size_t uuid_len;
+    size_t rec;
+};
+
+typedef struct uuid_seen_s uuid_seen_t;
+
+struct prefilter_ctx_s {
+    uuid_seen_t **seen;     /* per file announcements from phase 1 */
+    size_t *seen_count;
+};
+
+typedef struct prefilter_ctx_s prefilter_ctx_t;
+
+static void prefilter_scan_one (file_state_t *states, int findex, void *arg) {
+    prefilter_ctx_t *ctx = arg;
+    file_state_t *fs = &states[findex];
+    char *found[AC_MAX_PATTERNS];
+    size_t r, cap = 0;
+    u_int64_t t0;
+
+    open_file(fs);
+    prepare_index(fs);
+    if (!mac_address_filter) {
+        return;
+    }
+    t0 = STAT_START();
+    for (r = fs->rec_first; r < fs->rec_end; r++) {
+        rec_token_t *tok = &fs->rec_tokens[r];
+        char *rec = record_ptr(fs, r), *end = record_ptr(fs, r + 1);
+        if (!(tok->flags & REC_F_APPCTX) || !tok->uuid_off) {
+            continue;
+        }
+        char *payload = rec + record_ts_len(fs, rec, end);
+        u_int64_t seen = ac_scan(&record_ac, payload, end - payload, 
+            AC_MAC_BITS, found);
+        if (!mac_in_text(payload, end - payload, seen, found)) {
+            continue;
+        }
+        if (ctx->seen_count[findex] == cap) {
+            cap = cap ? 2 * cap : 16;
+            ctx->seen[findex] = realloc(ctx->seen[findex], 
+                cap * sizeof(uuid_seen_t));
+            if (ctx->seen[findex] == NULL) {
+                printf("could not grow UUID list for %s\n", fs->filename);
+                exit(1);
+            }
+        }
+        uuid_seen_t *us = &ctx->seen[findex][ctx->seen_count[findex]++];
+        us->uuid = record_ptr(fs, r) + tok->uuid_off;
+        us->uuid_len = tok->uuid_len;
+        us->rec = r;
+    }
+    STAT_ADD(fs, STAT_MATCH, t0, 
+        record_ptr(fs, fs->rec_end) - record_ptr(fs, fs->rec_first), 
+        fs->rec_end - fs->rec_first);
+}
+
+static void prefilter_select_one (file_state_t *states, int findex, 
+    void *arg __UNUSED) {
+    file_state_t *fs = &states[findex];
+    char *found[AC_MAX_PATTERNS];
+    size_t r, cap = 0;
+
+    for (r = fs->rec_first; r < fs->rec_end; r++) {
+        char *rec = record_ptr(fs, r);
+        char *end = record_ptr(fs, r + 1);
+        if (mac_address_filter) {
+            rec_token_t *tok = &fs->rec_tokens[r];
+            uuid_entry_t *uuid = NULL;
+            u_int64_t t0 = STAT_START();
+            if (tok->uuid_off) {
+                uuid = uuid_set_find(rec + tok->uuid_off, tok->uuid_len);
+                STAT_ADD(fs, STAT_HASH, t0, tok->uuid_len, 1);
+            }
+            if (uuid == NULL) {
+                continue;
+            }
+            /* not announced yet at this point of the merge */
+            if (uuid->first_key > fs->rec_keys[r] ||
+                (uuid->first_key == fs->rec_keys[r] && 
+                 (uuid->first_file > findex || 
+                  (uuid->first_file == findex && uuid->first_rec > r)))) {
+                continue;
+            }
+        }
+        if (num_greps) {
+            size_t ts_len = record_ts_len(fs, rec, end);
+            u_int64_t t0 = STAT_START();
+            u_int64_t seen = ac_scan(&record_ac, rec + ts_len, 
+                end - rec - ts_len, AC_GREP_BITS, found);
+            /* with a MAC the record counted in prefilter_scan_one() */
+            STAT_ADD(fs, STAT_MATCH, t0, 
+                mac_address_filter ? 0 : end - rec - ts_len, 
+                !mac_address_filter);
+            if (!(seen & AC_GREP_BITS)) {
+                continue;
+            }
+        }
+        if (fs->sel_count == cap) {
+            cap = cap ? 2 * cap : 1024;
+            fs->sel = realloc(fs->sel, cap * sizeof(size_t));
+            if (fs->sel == NULL) {
+                printf("could not grow record list for %s\n", fs->filename);
+                exit(1);
+            }
+        }
+        fs->sel[fs->sel_count++] = r;
+    }
+    if (fs->sel == NULL) {
+        /* nothing kept, but still merge through the (empty) list */
+        fs->sel = malloc(sizeof(size_t));
+    }
+}
+
+static void prefilter_files (file_state_t *states, int num_files) {
+    prefilter_ctx_t ctx;
+    int f;
+    size_t i;
+
+    ctx.seen = calloc(num_files, sizeof(uuid_seen_t *));
+    ctx.seen_count = calloc(num_files, sizeof(size_t));
+    if (ctx.seen == NULL || ctx.seen_count == NULL) {
+        printf("could not allocate prefilter state\n");
+        exit(1);
+    }
+    for_each_file_parallel(states, num_files, prefilter_scan_one, &ctx);
+
+    /* files in input order, records in file order: first insert wins ties */
+    for (f = 0; f < num_files; f++) {
+        u_int64_t t0 = STAT_START();
+        for (i = 0; i < ctx.seen_count[f]; i++) {
+            uuid_seen_t *us = &ctx.seen[f][i];
+            u_int64_t key = states[f].rec_keys[us->rec];
+            int fresh = !uuid_set_contains(us->uuid, us->uuid_len);
+            uuid_entry_t *uuid = uuid_set_add(us->uuid, us->uuid_len);
+            if (uuid && (fresh || key < uuid->first_key)) {
+                uuid->first_key = key;
+                uuid->first_file = f;
+                uuid->first_rec = us->rec;
+            }
+        }
+        STAT_ADD(&states[f], STAT_HASH, t0, 0, ctx.seen_count[f]);
+        free(ctx.seen[f]);
+    }
+    free(ctx.seen);
+    free(ctx.seen_count);
+
+    for_each_file_parallel(states, num_files, prefilter_select_one, NULL);
+}
+
+/*
+ * Open file pool
+ *
+ * Merging more inputs than max_open in one pass keeps only max_open of
+ * them mapped.  Mapped files sit on an LRU list; when another one is
+ * needed the least recently used plain file is parked: its position is
+ * saved as offsets, and it is unmapped and closed until it wins the
+ * tournament again.  Compressed inputs cannot be parked (their inflated
+ * data would be lost), so sort_files() only pools archives of plain files
+ * whose time ranges overlap little enough that parking stays rare, and
+ * merges anything else in runs.
+ */
+static file_state_t *lru_head = NULL, *lru_tail = NULL;
+static int lru_mapped = 0;
+
+static void lru_unlink (file_state_t *fs) {
+    if (fs->lru_prev) {
+        fs->lru_prev->lru_next = fs->lru_next;
+    } else {
+        lru_head = fs->lru_next;
+    }
+    if (fs->lru_next) {
+        fs->lru_next->lru_prev = fs->lru_prev;
+    } else {
+        lru_tail = fs->lru_prev;
+    }
+    fs->lru_prev = fs->lru_next = NULL;
+}
+
+static void lru_push (file_state_t *fs) {
+    fs->lru_prev = NULL;
+    fs->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = fs;
+    } else {
+        lru_tail = fs;
+    }
+    lru_head = fs;
+}
+
+static int file_is_plain (file_state_t *fs __UNUSED) {
+#ifdef ZLIB_SUPPORTED
+    return fs->zlib_ptr == NULL && fs->zstrm == NULL;
+#else
+    return 1;
+#endif
+}
+
+static void park_file (file_state_t *fs) {
+    fs->park_start_ts = fs->start_ts_ptr - fs->base_ptr;
+    fs->park_start_payload = fs->start_payload - fs->base_ptr;
+    fs->park_end_payload = fs->end_payload - fs->base_ptr;
+    munmap(fs->base_ptr, fs->size);
+    close(fs->data_fd);
+    fs->base_ptr = NULL;
+    fs->parked = 1;
+    lru_unlink(fs);
+    lru_mapped--;
+}
+
+static void unpark_file (file_state_t *fs) {
+    open_file(fs);
+    if (fs->base_ptr == MAP_FAILED) {
+        exit(1);
+    }
+    fs->start_ts_ptr = fs->base_ptr + fs->park_start_ts;
+    fs->end_ts_ptr = fs->start_ts_ptr + record_skip(fs);
+    fs->start_payload = fs->base_ptr + fs->park_start_payload;
+    fs->end_payload = fs->base_ptr + fs->park_end_payload;
+    fs->parked = 0;
+}
+
+/* park the least recently used plain file other than keep */
+static int pool_evict (file_state_t *keep, out_batch_t *ob) {
+    file_state_t *victim;
+    for (victim = lru_tail; victim; victim = victim->lru_prev) {
+        if (victim != keep && file_is_plain(victim)) {
+            break;
+        }
+    }
+    if (victim == NULL) {
+        return 0;
+    }
+    /* queued output may still point into its mapping */
+    if (ob) {
+        out_batch_flush(ob);
+    }
+    park_file(victim);
+    return 1;
+}
+
+/* a freshly opened file joins the pool */
+static void pool_add (file_state_t *fs, out_batch_t *ob) {
+    fs->in_pool = 1;
+    lru_push(fs);
+    lru_mapped++;
+    while (lru_mapped > max_open && pool_evict(fs, ob)) {
+    }
+}
+
+/* make sure fs is mapped, it is about to be read */
+static void pool_acquire (file_state_t *fs, out_batch_t *ob) {
+    if (!fs->parked) {
+        if (fs != lru_head) {
+            lru_unlink(fs);
+            lru_push(fs);
+        }
+        return;
+    }
+    while (lru_mapped >= max_open && pool_evict(fs, ob)) {
+    }
+    unpark_file(fs);
+    lru_push(fs);
+    lru_mapped++;
+}
+
+static void pool_remove (file_state_t *fs) {
+    if (fs->in_pool) {
+        lru_unlink(fs);
+        lru_mapped--;
+        fs->in_pool = 0;
+    }
+}
+
+static void merge_files (file_state_t *states, int num_files, 
+    output_file_state_t *ofs, int pooled) 
+{
+    int findex = 0;
+    losertree_t lt;
+    out_batch_t *ob;
+    size_t in_size = 0;
+    u_int64_t key;
+    if (prefilter && (mac_address_filter || num_greps)) {
+        prefilter_files(states, num_files);
+        merge_slices(states, num_files, ofs);
+        return;
+    }
+    /* streaming keeps only a window per file, nothing to prescan */
+    if (num_threads > 1 && !stream_chunk_size && !pooled) {
+        prescan_files(states, num_files);
+        /* 
+         * Unfiltered merges split into independent time slices.  With a 
+         * filter the UUID set depends on merge order, so the merge itself
+         * stays on one thread and only reuses the prebuilt indices.  The
+         * slices are sized for every record, so --grep stays here too.
+         */
+        if (emit_line_always && !num_greps) {
+            merge_slices(states, num_files, ofs);
+            return;
+        }
+    }
+    losertree_init(&lt, num_files);
+    for (findex = 0; findex < num_files; findex++) {
+    if (states[findex].base_ptr == NULL) {
+        open_file(&states[findex]);
+        if (use_index && !file_is_streamed(&states[findex])) {
+            prepare_index(&states[findex]);
+        }
+    }
+    initial_file_offset(&states[findex]);
+#ifdef ZLIB_SUPPORTED
+    in_size += states[findex].zstrm ? states[findex].zlib_size : 
+        states[findex].written_size;
+#else
+    in_size += states[findex].written_size;
+#endif
+    /* the first record of every file enters the tournament */
+    key = (states[findex].eof && 
+           states[findex].start_payload == states[findex].end_payload) ? 
+        LT_KEY_EOF : file_key(&states[findex]);
+    if (key == LT_KEY_EOF || key > window_to) {
+        /* nothing to merge from this file */
+        close_file(&states[findex]);
+        key = LT_KEY_EOF;
+    } else if (pooled) {
+        pool_add(&states[findex], NULL);
+    }
+    losertree_set(&lt, findex, &states[findex], key);
+    }
+    losertree_build(&lt);
+    if (ofs && emit_line_always && !num_greps && !use_window && 
+        out_codec == OUT_CODEC_NONE) {
+        presize_output_file(ofs, in_size);
+    }
+    ob = malloc(sizeof(out_batch_t));
+    if (ob == NULL) {
+        printf("could not allocate output batch\n");
+        exit(1);
+    }
+    out_batch_init(ob, ofs ? ofs->data_fd : 1);
+    int done = 0;
+    file_state_t *next_file = NULL;
+    while (!done) {
+    if (next_file != NULL) {
+        key = LT_KEY_EOF;
+        if (next_file->eof != 1) {
+        next_file_offset(next_file);
+        key = file_key(next_file);
+        }
+        if (key == LT_KEY_EOF || key > window_to) {
+        /* close the file and cleanup, after the batch is done with it */
+        out_batch_flush(ob);
+        if (pooled) {
+            pool_remove(next_file);
+        }
+        close_file(next_file);
+        key = LT_KEY_EOF;
+        }
+        u_int64_t t0 = STAT_START();
+        losertree_update(&lt, key);
+        /* a record entering counts, a file running out does not */
+        STAT_ADD(NULL, STAT_MERGE, t0, 0, key != LT_KEY_EOF);
+    }
+    file_state_t *popped_state;
+    if (!losertree_empty(&lt)) {
+        popped_state = lt.items[losertree_winner(&lt)];
+        if (pooled) {
+            pool_acquire(popped_state, ob);
+        }
+        if (popped_state->start_payload != popped_state->end_payload) {
+        if (record_wanted(popped_state)) {
+            void (*put)(out_batch_t *, const char *, size_t) = 
+                file_is_streamed(popped_state) ? out_batch_copy : out_batch_put;
+            size_t ts_len = record_ts_len(popped_state, 
+                popped_state->start_payload, popped_state->end_payload);
+            size_t key_len = run_key_len(popped_state);
+            if (write_run_keys) {
+                char run_key[RUN_KEY_LEN];
+                run_key_format(run_key, lt.keys[losertree_winner(&lt)]);
+                out_batch_copy(ob, run_key, RUN_KEY_LEN);
+            }
+            put(ob, popped_state->start_payload + key_len, ts_len - key_len);
+            if (addfilename) {
+                out_batch_copy(ob, popped_state->basename, 
+                      popped_state->basename_len);
+            }
+            put(ob, popped_state->start_payload + ts_len,
+                popped_state->end_payload 
+                - popped_state->start_payload - ts_len);
+            STAT_ADD(popped_state, STAT_OUTPUT, 0, 
+                popped_state->end_payload - popped_state->start_payload - 
+                key_len + (write_run_keys ? RUN_KEY_LEN : 0) + 
+                (addfilename ? popped_state->basename_len : 0), 1);
+        }
+        }
+        next_file = popped_state;
+    } else {
+        done = 1;
+        break;
+    }
+    }
+    out_batch_free(ob);
+    if (ofs) {
+        ofs->write_offset = ob->written;
+    }
+    free(ob);
+    losertree_free(&lt);
+}
+
+/*
+ * Follow mode (--follow)
+ *
+ * Keeps merging while the inputs grow.  Every input is watched with
+ * inotify and its mapping extended with mremap when it grows.  A record
+ * is complete once the next timestamp in its file shows up, and may go
+ * out once no live input can still produce an earlier one: every input
+ * that is still growing holds the merge back at the timestamp of the
+ * record it is in the middle of.  An input that has not grown for the
+ * latency bound stops holding the others back, and its last record is
+ * taken as complete, so output is never delayed by more than that.  A
+ * record arriving later than the bound on a quiet input is emitted as
+ * soon as it is seen, out of order rather than lost.
+ */
+struct follow_s {
+    file_state_t *fs;
+    size_t mapped;          /* bytes mapped, grows with the file */
+    size_t cur;             /* start of the oldest record not emitted */
+    size_t next;            /* start of the record after it, if found */
+    size_t scan;            /* where the search for next resumes */
+    int has_cur;
+    int has_next;
+    int gone;               /* deleted or moved away, no more growth */
+    int wd;
+    u_int64_t key;          /* key of the record at cur */
+    u_int64_t last_key;     /* last key emitted or held, for idle inputs */
+    struct timespec grown;  /* last time the file grew */
+};
+
+typedef struct follow_s follow_t;
+
+static long follow_elapsed_ms (struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + 
+        (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* find the record boundaries in what is mapped so far */
+static void follow_scan (follow_t *fw) {
+    file_state_t *fs = fw->fs;
+    char *cp;
+    int match;
+
+    if (fw->mapped == 0) {
+        return;
+    }
+    if (!fw->has_cur) {
+        cp = record_matcher(fs, fs->base_ptr + fw->scan, 
+            fw->mapped - fw->scan, &match);
+        if (!match) {
+            fw->scan = cp - fs->base_ptr;
+            return;
+        }
+        fw->cur = cp - fs->base_ptr;
+        fw->key = record_key(fs, cp);
+        fw->has_cur = 1;
+        fw->scan = fw->cur + record_skip(fs);
+    }
+    if (!fw->has_next) {
+        cp = record_matcher(fs, fs->base_ptr + fw->scan, 
+            fw->mapped - fw->scan, &match);
+        if (match) {
+            fw->next = cp - fs->base_ptr;
+            fw->has_next = 1;
+        } else {
+            fw->scan = cp - fs->base_ptr;
+        }
+    }
+}
+
+/*
+ * Pick up growth of one input.  The mapping may move, so nothing queued
+ * for output may point into it.
+ */
+static void follow_refresh (follow_t *fw) {
+    file_state_t *fs = fw->fs;
+    struct stat fbuf;
+
+    if (fstat(fs->data_fd, &fbuf) != 0) {
+        return;
+    }
+    if (fbuf.st_nlink == 0) {
+        /* unlinked, we hold the last reference so it cannot grow */
+        fw->gone = 1;
+    }
+    if ((size_t)fbuf.st_size < fw->mapped) {
+        /* truncated in place, start over on the new contents */
+        munmap(fs->base_ptr, fw->mapped);
+        fs->base_ptr = NULL;
+        fw->mapped = fw->cur = fw->next = fw->scan = 0;
+        fw->has_cur = fw->has_next = 0;
+    }
+    if ((size_t)fbuf.st_size > fw->mapped) {
+        char *p = fs->base_ptr ? 
+            mremap(fs->base_ptr, fw->mapped, fbuf.st_size, MREMAP_MAYMOVE) :
+            mmap(0, fbuf.st_size, PROT_READ, MAP_SHARED, fs->data_fd, 0);
+        if (p == MAP_FAILED) {
+            printf("could not map %s at %zu bytes - %s\n", fs->filename, 
+                (size_t)fbuf.st_size, strerror(errno));
+            exit(1);
+        }
+        fs->base_ptr = p;
+        fs->size = fs->written_size = fw->mapped = fbuf.st_size;
+        clock_gettime(CLOCK_MONOTONIC, &fw->grown);
+    }
+    follow_scan(fw);
+}
+
+/* is this input quiet for longer than the latency bound */
+static int follow_idle (follow_t *fw) {
+    return fw->gone || follow_elapsed_ms(&fw->grown) >= follow_ms;
+}
+
+/* the key an input holds the merge at, LT_KEY_EOF if it holds nothing */
+static u_int64_t follow_key (follow_t *fw) {
+    if (fw->has_cur) {
+        return fw->key;
+    }
+    return follow_idle(fw) ? LT_KEY_EOF : fw->last_key;
+}
+
+static void follow_emit (follow_t *fw, out_batch_t *ob) {
+    file_state_t *fs = fw->fs;
+    size_t end = fw->has_next ? fw->next : fw->mapped;
+    fs->start_payload = fs->base_ptr + fw->cur;
+    fs->end_payload = fs->base_ptr + end;
+    if (fw->key >= window_from && fw->key <= window_to && record_wanted(fs)) {
+        size_t ts_len = record_ts_len(fs, fs->start_payload, fs->end_payload);
+        out_batch_put(ob, fs->start_payload, ts_len);
+        if (addfilename) {
+            out_batch_copy(ob, fs->basename, fs->basename_len);
+        }
+        out_batch_put(ob, fs->start_payload + ts_len, end - fw->cur - ts_len);
+    }
+    fw->last_key = fw->key;
+    fw->has_cur = fw->has_next = 0;
+    fw->scan = end;
+    if (end < fw->mapped) {
+        fw->has_cur = 1;
+        fw->cur = end;
+        fw->key = record_key(fs, fs->base_ptr + end);
+        fw->scan = end + record_skip(fs);
+    }
+}
+
+static void follow_files (file_state_t *states, int num_files, 
+    output_file_state_t *ofs) 
+{
+    follow_t *fws = calloc(num_files, sizeof(follow_t));
+    out_batch_t *ob = malloc(sizeof(out_batch_t));
+    struct pollfd pfd;
+    losertree_t lt;
+    char evbuf[4096];
+    int f, live;
+
+    if (fws == NULL || ob == NULL) {
+        printf("could not allocate follow state\n");
+        exit(1);
+    }
+    pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    pfd.events = POLLIN;
+    if (pfd.fd < 0) {
+        perror("inotify_init failed");
+        exit(1);
+    }
+    for (f = 0; f < num_files; f++) {
+        file_state_t *fs = &states[f];
+        unsigned char magic[2];
+        struct stat fbuf;
+        fws[f].fs = fs;
+        fs->data_fd = open(fs->filename, O_RDONLY);
+        if (fs->data_fd < 0) {
+            printf("could not open file %s\n", fs->filename);
+            perror("file open error");
+            exit(1);
+        }
+        if (pread(fs->data_fd, magic, 2, 0) == 2 && 
+            magic[0] == 0x1f && magic[1] == 0x8b) {
+            printf("--follow needs plain log files, %s is compressed\n", 
+                fs->filename);
+            exit(1);
+        }
+        if (fstat(fs->data_fd, &fbuf) == 0) {
+            fs->mtime = fbuf.st_mtime;
+        }
+        log_time_init(&fs->tctx, time_format, fs->mtime, time_utc_offset);
+        fws[f].wd = inotify_add_watch(pfd.fd, fs->filename, 
+            IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+        clock_gettime(CLOCK_MONOTONIC, &fws[f].grown);
+    }
+    out_batch_init(ob, ofs ? ofs->data_fd : 1);
+    losertree_init(&lt, num_files);
+
+    for (;;) {
+        /* merge as far as every live input allows */
+        for (f = 0; f < num_files; f++) {
+            follow_refresh(&fws[f]);
+            losertree_set(&lt, f, &fws[f], follow_key(&fws[f]));
+        }
+        losertree_build(&lt);
+        while (!losertree_empty(&lt)) {
+            follow_t *fw = lt.items[losertree_winner(&lt)];
+            if (!fw->has_cur || (!fw->has_next && !follow_idle(fw))) {
+                /* the earliest key may still grow or be preceded */
+                break;
+            }
+            follow_emit(fw, ob);
+            follow_scan(fw);
+            losertree_update(&lt, follow_key(fw));
+        }
+        out_batch_flush(ob);
+        if (ob->codec) {
+            /* latency over ratio: a partial block goes out as a member */
+            codec_sync(ob->codec);
+            ob->written = ob->codec->written;
+        }
+        if (ofs) {
+            ofs->write_offset = ob->written;
+        }
+
+        for (live = 0, f = 0; f < num_files; f++) {
+            live += !fws[f].gone;
+        }
+        if (live == 0) {
+            break;
+        }
+        /* wake up on growth, or when a quiet input passes the bound */
+        if (poll(&pfd, 1, follow_ms) > 0) {
+            ssize_t n = read(pfd.fd, evbuf, sizeof(evbuf));
+            char *ep = evbuf;
+            while (n > 0 && ep < evbuf + n) {
+                struct inotify_event *ev = (struct inotify_event *)ep;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    for (f = 0; f < num_files; f++) {
+                        if (fws[f].wd == ev->wd) {
+                            fws[f].gone = 1;
+                        }
+                    }
+                }
+                ep += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+
+    /* every input went away: drain what is left */
+    for (f = 0; f < num_files; f++) {
+        follow_refresh(&fws[f]);
+        losertree_set(&lt, f, &fws[f], follow_key(&fws[f]));
+    }
+    losertree_build(&lt);
+    while (!losertree_empty(&lt)) {
+        follow_t *fw = lt.items[losertree_winner(&lt)];
+        follow_emit(fw, ob);
+        follow_scan(fw);
+        losertree_update(&lt, follow_key(fw));
+    }
+    out_batch_free(ob);
+    if (ofs) {
+        ofs->write_offset = ob->written;
+    }
+    for (f = 0; f < num_files; f++) {
+        if (states[f].base_ptr) {
+            munmap(states[f].base_ptr, fws[f].mapped);
+        }
+        close(states[f].data_fd);
+    }
+    close(pfd.fd);
+    losertree_free(&lt);
+    free(ob);
+    free(fws);
+}
+
+/* how many inputs can be open and mapped at once */
+static int default_max_open (void) {
+    struct rlimit rl;
+    long n = MAX_OPEN_FILES, maps;
+    FILE *fp;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        (long)rl.rlim_cur - OPEN_FILES_RESERVE < n) {
+        n = (long)rl.rlim_cur - OPEN_FILES_RESERVE;
+    }
+    /* an input can take a log, an inflate and an index mapping */
+    if ((fp = fopen("/proc/sys/vm/max_map_count", "r")) != NULL) {
+        if (fscanf(fp, "%ld", &maps) == 1 && maps / 4 < n) {
+            n = maps / 4;
+        }
+        fclose(fp);
+    }
+    return (n < 2) ? 2 : n;
+}
+
+/* key of the last record, from the tail of the file */
+static u_int64_t file_last_key (file_state_t *fs) {
+    size_t from = (fs->written_size > TS_SEEK_LINEAR) ? 
+        fs->written_size - TS_SEEK_LINEAR : 0;
+    char *cp = fs->base_ptr + from, *last = NULL;
+    int match;
+    for (;;) {
+        cp = record_matcher(fs, cp, fs->written_size - (cp - fs->base_ptr), 
+            &match);
+        if (!match) {
+            break;
+        }
+        last = cp;
+        cp += record_skip(fs);
+    }
+    return last ? record_key(fs, last) : LT_KEY_EOF;
+}
+
+struct key_event_s {
+    u_int64_t key;
+    int delta;
+};
+
+typedef struct key_event_s key_event_t;
+
+static int key_event_compare (const void *a, const void *b) {
+    const key_event_t *x = a, *y = b;
+    if (x->key != y->key) {
+        return (x->key < y->key) ? -1 : 1;
+    }
+    return y->delta - x->delta;     /* openings first */
+}
+
+/*
+ * Can the inputs merge in one pass through the open file pool: all plain
+ * files, and never more than max_open of them live at the same time.
+ */
+static int pool_fits (file_state_t *states, int num_files) {
+    key_event_t *ev = malloc(2 * (size_t)num_files * sizeof(key_event_t));
+    int f, live = 0, peak = 0, plain = 1;
+    size_t nev = 0, i;
+    if (ev == NULL) {
+        return 0;
+    }
+    for (f = 0; f < num_files && plain; f++) {
+        struct stat fbuf;
+        char *base;
+        int fd, match;
+        if ((fd = open(states[f].filename, O_RDONLY)) < 0) {
+            printf("could not open file %s\n", states[f].filename);
+            perror("file open error");
+            exit(1);
+        }
+        if (fstat(fd, &fbuf) != 0 || fbuf.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        base = mmap(0, fbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            plain = 0;
+            break;
+        }
+        if (fbuf.st_size >= 2 && (unsigned char)base[0] == 0x1f && 
+            (unsigned char)base[1] == 0x8b) {
+            plain = 0;
+        } else {
+            file_state_t probe;
+            char *first;
+            memset(&probe, 0, sizeof(probe));
+            probe.base_ptr = base;
+            probe.written_size = fbuf.st_size;
+            log_time_init(&probe.tctx, time_format, fbuf.st_mtime, 
+                time_utc_offset);
+            first = record_matcher(&probe, base, fbuf.st_size, &match);
+            if (match) {
+                ev[nev].key = record_key(&probe, first);
+                ev[nev++].delta = 1;
+                ev[nev].key = file_last_key(&probe);
+                ev[nev++].delta = -1;
+            }
+        }
+        munmap(base, fbuf.st_size);
+    }
+    if (plain) {
+        qsort(ev, nev, sizeof(key_event_t), key_event_compare);
+        for (i = 0; i < nev; i++) {
+            live += ev[i].delta;
+            if (live > peak) {
+                peak = live;
+            }
+        }
+    }
+    free(ev);
+    return plain && peak <= max_open;
+}
+
+/*
+ * Run files on disk.  They are removed as soon as they are merged, and
+ * whatever is left when msort_log exits, on an error included.
+ */
+static char **run_paths = NULL;
+static int num_run_paths = 0;
+
+static void runs_remove_all (void) {
+    int i;
+    for (i = 0; i < num_run_paths; i++) {
+        unlink(run_paths[i]);
+    }
+    num_run_paths = 0;
+}
+
+static void run_created (char *path) {
+    static int cap = 0;
+    if (num_run_paths == cap) {
+        if (cap == 0) {
+            atexit(runs_remove_all);
+        }
+        cap = cap ? 2 * cap : 16;
+        run_paths = realloc(run_paths, cap * sizeof(char *));
+        if (run_paths == NULL) {
+            unlink(path);
+            fprintf(stderr, "could not grow the merge run list\n");
+            exit(1);
+        }
+    }
+    run_paths[num_run_paths++] = path;
+}
+
+static void run_remove (char *path) {
+    int i;
+    unlink(path);
+    for (i = 0; i < num_run_paths; i++) {
+        if (run_paths[i] == path) {
+            run_paths[i] = run_paths[--num_run_paths];
+            break;
+        }
+    }
+    free(path);
+}
+
+/*
+ * Merge in runs: groups of max_open inputs are merged into temporary run
+ * files (in $TMPDIR), repeated until max_open runs or fewer are left, and
+ * those are merged into the output.  Every record of a run leads with its
+ * merge key (see RUN_KEY_LEN), so inputs of any time formats share a run
+ * and the run is read back without parsing a timestamp.  Groups are
+ * consecutive inputs, so equal timestamps keep their input order.  The
+ * filters depend on merge order and run only in the final merge;
+ * --from/--to and -a are applied while building the first runs.
+ */
+static void merge_in_runs (file_state_t *states, int num_files, 
+    output_file_state_t *ofs) 
+{
+    int saved_emit = emit_line_always, saved_greps = num_greps;
+    int saved_addname = addfilename, saved_index = use_index;
+    int saved_codec = out_codec;
+    char *saved_mac = mac_address_filter;
+    const char *tmpdir = getenv("TMPDIR");
+    file_state_t *runs = NULL;
+    int g, ngroups, level = 0;
+
+    if (tmpdir == NULL || *tmpdir == '\0') {
+        tmpdir = "/tmp";
+    }
+    while (num_files > max_open) {
+        ngroups = (num_files + max_open - 1) / max_open;
+        runs = calloc(ngroups, sizeof(file_state_t));
+        if (runs == NULL) {
+            fprintf(stderr, "could not allocate %d merge runs\n", ngroups);
+            exit(1);
+        }
+        emit_line_always = 1;
+        num_greps = 0;
+        mac_address_filter = NULL;
+        /* runs are read back, only the final merge is compressed */
+        out_codec = OUT_CODEC_NONE;
+        write_run_keys = 1;
+        /* records count as the inputs are scanned and in the final merge */
+        stats_uncounted = (1 << STAT_MERGE) | (1 << STAT_OUTPUT) | 
+            (level ? 1 << STAT_SCAN : 0);
+        for (g = 0; g < ngroups; g++) {
+            int first = g * max_open;
+            int count = (num_files - first < max_open) ? 
+                num_files - first : max_open;
+            output_file_state_t *run_ofs;
+            char *path = malloc(strlen(tmpdir) + 32);
+            int fd;
+            sprintf(path, "%s/msort_run.XXXXXX", tmpdir);
+            if ((fd = mkstemp(path)) < 0) {
+                fprintf(stderr, "could not create merge run in %s: %s\n", 
+                    tmpdir, strerror(errno));
+                exit(1);
+            }
+            close(fd);
+            run_created(path);
+            run_ofs = open_output_file(path);
+            merge_files(states + first, count, run_ofs, 0);
+            close_output_file(run_ofs);
+            runs[g].filename = path;
+            runs[g].basename = strdup("");
+            runs[g].used = 1;
+            runs[g].keyed = 1;
+        }
+        if (level++ > 0) {
+            /* the previous level's runs are merged now */
+            for (g = 0; g < num_files; g++) {
+                run_remove(states[g].filename);
+            }
+            free(states);
+        }
+        /* runs carry the basenames already, and are not worth indexing */
+        addfilename = 0;
+        use_index = 0;
+        states = runs;
+        num_files = ngroups;
+    }
+    emit_line_always = saved_emit;
+    num_greps = saved_greps;
+    mac_address_filter = saved_mac;
+    out_codec = saved_codec;
+    write_run_keys = 0;
+    stats_uncounted = level ? 1 << STAT_SCAN : 0;
+    merge_files(states, num_files, ofs, 0);
+    stats_uncounted = 0;
+    if (level > 0) {
+        for (g = 0; g < num_files; g++) {
+            run_remove(states[g].filename);
+        }
+        free(states);
+    }
+    addfilename = saved_addname;
+    use_index = saved_index;
+}
+
+static void sort_files (file_state_t *states, int num_files, 
+    output_file_state_t *ofs) 
+{
+    if (max_open == 0) {
+        max_open = default_max_open();
+    }
+    if (num_files <= max_open) {
+        merge_files(states, num_files, ofs, 0);
+    } else if (num_threads == 1 && !prefilter && pool_fits(states, num_files)) {
+        merge_files(states, num_files, ofs, 1);
+    } else {
+        merge_in_runs(states, num_files, ofs);
+    }
+}
+
+/*
+ * Key the --from/--to bounds.  Legacy and syslog times have no year, and
+ * a bound without one is read like a record of the newest input.
+ */
+static void window_bounds (file_state_t *states, int num_files) {
+    time_t ref = 0;
+    struct stat fbuf;
+    int f;
+    for (f = 0; f < num_files; f++) {
+        if (stat(states[f].filename, &fbuf) == 0 && fbuf.st_mtime > ref) {
+            ref = fbuf.st_mtime;
+        }
+    }
+    if (ref == 0) {
+        ref = time(NULL);
+    }
+    if (window_from_str) {
+        ts_bound_parse(window_from_str, 0, ref, &window_from);
+    }
+    if (window_to_str) {
+        ts_bound_parse(window_to_str, 1, ref, &window_to);
+    }
+}
+
+#ifdef CODEC_SUPPORTED
+/* --compress codec[:level], false for a codec not built in */
+static int parse_codec (const char *arg) {
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    int lo = 1, hi = 9;
+#ifdef ZLIB_SUPPORTED
+    if (len == 4 && strncmp(arg, "gzip", 4) == 0) {
+        out_codec = OUT_CODEC_GZIP;
+        out_level = Z_DEFAULT_COMPRESSION;
+    } else
+#endif
+#ifdef ZSTD_SUPPORTED
+    if (len == 4 && strncmp(arg, "zstd", 4) == 0) {
+        out_codec = OUT_CODEC_ZSTD;
+        out_level = ZSTD_CLEVEL_DEFAULT;
+        hi = ZSTD_maxCLevel();
+    } else
+#endif
+    {
+        return 0;
+    }
+    if (colon) {
+        out_level = atoi(colon + 1);
+        if (out_level < lo || out_level > hi) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+/* a file name as a JSON string */
+static void json_string (FILE *f, const char *str) {
+    const unsigned char *cp;
+    fputc('"', f);
+    for (cp = (const unsigned char *)str; *cp; cp++) {
+        if (*cp == '"' || *cp == '\\') {
+            fprintf(f, "\\%c", *cp);
+        } else if (*cp < 0x20) {
+            fprintf(f, "\\u%04x", *cp);
+        } else {
+            fputc(*cp, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void stats_json_stages (FILE *f, stage_stat_t *st, double cycles_ms) {
+    int i;
+    fprintf(f, "{");
+    for (i = 0; i < STAT_STAGES; i++) {
+        fprintf(f, "%s\"%s\": {\"cycles\": %" PRIu64 ", \"ms\": %.3f, "
+            "\"bytes\": %" PRIu64 ", \"records\": %" PRIu64 "}", 
+            i ? ", " : "", stat_names[i], st[i].cycles, 
+            st[i].cycles / cycles_ms, st[i].bytes, st[i].records);
+    }
+    fprintf(f, "}");
+}
+
+/*
+ * Print the --stats report on stderr, stdout may be the merge output.
+ * Cycles are converted to ms at the clock rate seen over the whole run.
+ */
+static void print_stats (void) {
+    u_int64_t wall_ns = stat_clock_ns() - stats_start_ns;
+    double wall_ms = wall_ns / 1e6;
+    double cycles_ms = wall_ns ? 
+        (STAT_CLOCK() - stats_start_cycles) / wall_ms : 1;
+    FILE *f = stderr;
+    int i;
+
+    stats_flush_thread();
+    if (cycles_ms <= 0) {
+        cycles_ms = 1;
+    }
+    if (stats_mode == STATS_JSON) {
+        fprintf(f, "{\"wall_ms\": %.3f, \"cycles_per_ms\": %.0f, "
+            "\"threads\": %d, \"stages\": ", wall_ms, cycles_ms, num_threads);
+        stats_json_stages(f, stage_totals, cycles_ms);
+        fprintf(f, ", \"files\": [");
+        for (i = 0; i < next_file_state; i++) {
+            fprintf(f, "%s\n  {\"file\": ", i ? "," : "");
+            json_string(f, file_states[i].filename);
+            fprintf(f, ", \"stages\": ");
+            stats_json_stages(f, file_states[i].stats, cycles_ms);
+            fprintf(f, "}");
+        }
+        fprintf(f, "]}\n");
+        return;
+    }
+
+    fprintf(f, "%-10s %14s %10s %10s %12s %9s\n", 
+        "stage", "cycles", "ms", "MB", "records", "MB/s");
+    for (i = 0; i < STAT_STAGES; i++) {
+        stage_stat_t *st = &stage_totals[i];
+        double ms = st->cycles / cycles_ms;
+        fprintf(f, "%-10s %14" PRIu64 " %10.1f %10.1f %12" PRIu64 " %9.1f\n", 
+            stat_names[i], st->cycles, ms, st->bytes / 1e6, st->records, 
+            ms > 0 ? st->bytes / 1e3 / ms : 0.0);
+    }
+    fprintf(f, "wall %.1f ms, %.0f cycles/ms, %d thread%s\n\n", wall_ms, 
+        cycles_ms, num_threads, num_threads > 1 ? "s" : "");
+
+    fprintf(f, "%-24s %10s %10s %10s %10s %10s %10s %10s\n", "file", 
+        "inflate ms", "scan ms", "match ms", "hash ms", "records", 
+        "emitted", "MB out");
+    for (i = 0; i < next_file_state; i++) {
+        stage_stat_t *st = file_states[i].stats;
+        const char *name = strrchr(file_states[i].filename, '/');
+        fprintf(f, "%-24.24s %10.1f %10.1f %10.1f %10.1f %10" PRIu64 
+            " %10" PRIu64 " %10.1f\n", 
+            name ? name + 1 : file_states[i].filename,
+            st[STAT_INFLATE].cycles / cycles_ms, 
+            st[STAT_SCAN].cycles / cycles_ms, 
+            st[STAT_MATCH].cycles / cycles_ms, 
+            st[STAT_HASH].cycles / cycles_ms, 
+            st[STAT_SCAN].records, st[STAT_OUTPUT].records, 
+            st[STAT_OUTPUT].bytes / 1e6);
+    }
+}
+
+int
+main (int argc, char **argv) {
+    int c;
+    output_file_state_t *ofs = NULL;
+    time_utc_offset = log_time_local_offset();
+
+#if TEST_HASH
+    int i;
+    static char val[200];
+
+    for (i = 0; i < 100000; i++) {
+    sprintf(val, "UUID: %x", i);
+    uuid_set_add(val, strlen(val));
+    }
+    for (i = 0; i < 100000; i++) {
+    sprintf(val, "UUID: %x", i);
+    if (!uuid_set_contains(val, strlen(val))) {
+        printf("lost uuid %s\n", val);
+    }
+    }
+    printf("%zu uuids in %zu slots\n", uuid_set.count, uuid_set.cap);
+    strcpy(val, "UUID: yy");
+    printf("%s %s\n", val, uuid_set_contains(val, strlen(val)) ? 
+        "found" : "not found");
+#endif
 
     while (1) {
     int option_index = 0;
@@ -1160,10 +4381,30 @@ main (int argc, char **argv) {
         {"output", 1, 0, 'o'},
         {"addfilename", 0, 0, 'a'},
         {"filter", 1, 0, 'f'},
+        {"threads", 1, 0, 't'},
+#ifdef ZLIB_SUPPORTED
+        {"stream", 2, 0, 's'},
+#endif
+        {"index", 0, 0, 'i'},
+        {"index-dir", 1, 0, 'I'},
+        {"grep", 1, 0, 'g'},
+        {"prefilter", 0, 0, 'p'},
+        {"from", 1, 0, 'F'},
+        {"to", 1, 0, 'T'},
+        {"max-open", 1, 0, 'm'},
+        {"follow", 2, 0, 'w'},
+        {"time-format", 1, 0, 'd'},
+        {"bloom", 2, 0, 'b'},
+        {"bloom-mem", 1, 0, 'B'},
+        {"stats", 2, 0, 'S'},
+#ifdef CODEC_SUPPORTED
+        {"compress", 1, 0, 'z'},
+        {"compress-threads", 1, 0, 'Z'},
+#endif
         {0, 0, 0, 0}
     };
 
-    c = getopt_long (argc, argv, "ao:f:",
+    c = getopt_long (argc, argv, "ao:f:t:s::iI:g:pF:T:m:w::d:b::B:S::z:Z:",
              long_options, &option_index);
     if (c == -1)
         break;
@@ -1178,6 +4419,141 @@ main (int argc, char **argv) {
         mac_address_filter = strdup(optarg);
         printf("Matching mac_address %s\n", mac_address_filter);
         break;
+    case 't':
+        num_threads = atoi(optarg);
+        if (num_threads < 1 || num_threads > MAX_THREADS) {
+            printf("threads must be between 1 and %d\n", MAX_THREADS);
+            exit(1);
+        }
+        break;
+#ifdef ZLIB_SUPPORTED
+    case 's':
+        /* inflate .gz inputs in chunks of the given KB as they are merged */
+        stream_chunk_size = optarg ? strtoul(optarg, NULL, 0) * 1024 
+            : STREAM_CHUNK_SIZE;
+        if (stream_chunk_size < 4 * TS_LEN) {
+            printf("stream chunk size too small\n");
+            exit(1);
+        }
+        break;
+#endif
+    case 'i':
+        /* keep .msidx record indices next to the logs */
+        use_index = 1;
+        break;
+    case 'I':
+        use_index = 1;
+        index_dir = strdup(optarg);
+        break;
+    case 'g':
+        /* only output records containing one of the --grep strings */
+        if (num_greps == AC_MAX_PATTERNS) {
+            printf("too many --grep strings\n");
+            exit(1);
+        }
+        grep_strings[num_greps++] = optarg;
+        break;
+    case 'p':
+        /* filter every input first, merge only the records that pass */
+        prefilter = 1;
+        break;
+    case 'F':
+        /* checked now, keyed once the inputs' mtimes are known */
+        if (!ts_bound_parse(optarg, 0, time(NULL), &window_from)) {
+            printf("bad --from time '%s', expected MM/DD HH:MM:SS.XXX "
+                "or YYYY-MM-DD HH:MM:SS\n", optarg);
+            exit(1);
+        }
+        window_from_str = strdup(optarg);
+        use_window = 1;
+        break;
+    case 'T':
+        if (!ts_bound_parse(optarg, 1, time(NULL), &window_to)) {
+            printf("bad --to time '%s', expected MM/DD HH:MM:SS.XXX "
+                "or YYYY-MM-DD HH:MM:SS\n", optarg);
+            exit(1);
+        }
+        window_to_str = strdup(optarg);
+        use_window = 1;
+        break;
+    case 'd':
+        /* time format of every input instead of detecting it per file */
+        if ((c = log_time_format_by_name(optarg)) < 0) {
+            printf("unknown --time-format '%s', expected auto, legacy, "
+                "iso8601, syslog or epoch\n", optarg);
+            exit(1);
+        }
+        time_format = (log_time_format_t)c;
+        break;
+    case 'w':
+        /* keep merging as the inputs grow, latency bound in ms */
+        follow_ms = optarg ? atoi(optarg) : FOLLOW_LATENCY_MS;
+        if (follow_ms <= 0) {
+            follow_ms = FOLLOW_LATENCY_MS;
+        }
+        break;
+    case 'b':
+        /* screen UUID lookups with a bloom filter of this false positive rate */
+        bloom_fpr = optarg ? strtod(optarg, NULL) : BLOOM_FPR;
+        if (!(bloom_fpr > 0 && bloom_fpr < 1)) {
+            printf("--bloom false positive rate must be between 0 and 1\n");
+            exit(1);
+        }
+        break;
+    case 'B':
+        /* most memory the bloom filter may take, in KB */
+        bloom_max_mem = strtoul(optarg, NULL, 0) * 1024;
+        if (bloom_max_mem < BLOOM_BLOCK_WORDS * sizeof(u_int64_t)) {
+            printf("--bloom-mem must be at least 1 KB\n");
+            exit(1);
+        }
+        break;
+    case 'S':
+        /* per stage and per input counters on stderr, table or json */
+        if (optarg == NULL || strcmp(optarg, "table") == 0) {
+            stats_mode = STATS_TABLE;
+        } else if (strcmp(optarg, "json") == 0) {
+            stats_mode = STATS_JSON;
+        } else {
+            printf("unknown --stats format '%s', expected table or json\n",
+                optarg);
+            exit(1);
+        }
+        stats_start_ns = stat_clock_ns();
+        stats_start_cycles = STAT_CLOCK();
+        break;
+#ifdef CODEC_SUPPORTED
+    case 'z':
+        /* compress the output in parallel blocks, codec[:level] */
+        if (!parse_codec(optarg)) {
+            printf("unknown --compress '%s', expected"
+#ifdef ZLIB_SUPPORTED
+                " gzip[:1-9]"
+#endif
+#ifdef ZSTD_SUPPORTED
+                " zstd[:1-19]"
+#endif
+                "\n", optarg);
+            exit(1);
+        }
+        break;
+    case 'Z':
+        codec_threads = atoi(optarg);
+        if (codec_threads < 1 || codec_threads > MAX_THREADS) {
+            printf("compress threads must be between 1 and %d\n", 
+                MAX_THREADS);
+            exit(1);
+        }
+        break;
+#endif
+    case 'm':
+        /* merge more inputs than this in runs or through the file pool */
+        max_open = atoi(optarg);
+        if (max_open < 2) {
+            printf("--max-open needs at least 2 files\n");
+            exit(1);
+        }
+        break;
     case 'o':
         printf("option o with value '%s'\n", optarg);
         ofs = open_output_file(optarg);
@@ -1193,19 +4569,40 @@ main (int argc, char **argv) {
     }
 
 
-    binheap_init(&filenode_binheap, filenode_binheap_compare);
+    record_ac_build();
+    if (prefilter && stream_chunk_size) {
+        /* the prefilter needs every input indexed */
+        stream_chunk_size = 0;
+    }
+    if (out_codec != OUT_CODEC_NONE && codec_threads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        codec_threads = (ncpu < 1) ? 1 : (ncpu > MAX_THREADS) ? MAX_THREADS 
+            : (int)ncpu;
+    }
 
     int inp_file_count = 0, tmp_opt_ind = 0;
     if (optind < argc) {
         inp_file_count = argc;
         tmp_opt_ind = optind;
         while (optind < argc) {
+            if (next_file_state == file_states_cap) {
+                file_states_cap = file_states_cap ? 2 * file_states_cap : 256;
+                file_states = realloc(file_states, 
+                    file_states_cap * sizeof(file_state_t));
+                if (file_states == NULL) {
+                    printf("could not allocate state for %d files\n", 
+                        file_states_cap);
+                    exit(1);
+                }
+            }
             memset(&file_states[next_file_state], 0, sizeof(file_state_t));
             file_states[next_file_state].filename = strdup(argv[optind]);
-            file_states[next_file_state].basename = malloc(MAX_FILENAME_SIZE);
+            file_states[next_file_state].basename = 
+                calloc(1, MAX_FILENAME_SIZE);
             strcat(file_states[next_file_state].basename, " ");
-            strcat(file_states[next_file_state].basename, 
-            basename(file_states[next_file_state].filename));
+            strncat(file_states[next_file_state].basename, 
+            basename(file_states[next_file_state].filename), 
+            MAX_FILENAME_SIZE - 2);
             file_states[next_file_state].basename_len = 
                 strlen(file_states[next_file_state].basename);
             file_states[next_file_state].used = 1;
@@ -1214,11 +4611,22 @@ main (int argc, char **argv) {
         }
     }
 
-    sort_files(file_states, next_file_state, ofs);
+    if (use_window) {
+        window_bounds(file_states, next_file_state);
+    }
+
+    if (follow_ms) {
+        follow_files(file_states, next_file_state, ofs);
+    } else {
+        sort_files(file_states, next_file_state, ofs);
+    }
    
     if (ofs) {
         close_output_file(ofs);
     }
+    if (stats_mode) {
+        print_stats();
+    }
 
     exit (0);
 }